@@ -13,8 +13,15 @@ Celestial Mechanics and Dynamical Astronomy, 121(1), 17–38.
 http://doi.org/10.1007/s10569-014-9588-x
 */
 
+// NOTE: the precision is selected by build options (PRECISION), double by default,
+// PRECISION_FLOAT: everything in single precision (with -cl-single-precision-constant),
+// PRECISION_MIXED: particle state and the field sums in double precision, the
+// face-relative geometry of face_field_edges() (Geom_t) in single precision
+
 #undef USING_DOUBLE_PRECISIONQ
+#ifndef PRECISION_FLOAT
 #define USING_DOUBLE_PRECISIONQ
+#endif
 
 #ifdef USING_DOUBLE_PRECISIONQ
 #pragma OPENCL EXTENSION cl_khr_fp64 : enable
@@ -23,15 +30,973 @@ http://doi.org/10.1007/s10569-014-9588-x
 #define Real_t double
 #undef Real_t4
 #define Real_t4 double4
+#else
+#undef Real_t
+#define Real_t float
+#undef Real_t4
+#define Real_t4 float4
 #endif /* USING_DOUBLE_PRECISIONQ */
 
+#ifdef PRECISION_MIXED
+#define Geom_t float
+#define Geom_t4 float4
+#define convert_Geom_t4 convert_float4
+#else
+#define Geom_t Real_t
+#define Geom_t4 Real_t4
+#define convert_Geom_t4
+#endif
+
+#if defined(PRECISION_MIXED) || defined(PRECISION_FLOAT)
+#define GEOM_SINGLE // Geom_t is float
+#endif
+
 #define norm length
 
+// NOTE: all integrate_eom* kernels propagate the particles activeIn[0..numpoints-1],
+// re-collided particles are periodically removed from that list, see compact_scan()
+
+// NOTE: each launch performs numsteps integration steps (see step_update()), the particle
+// state is kept in registers and only written back to pnew, vnew after the last step
+
+// NOTE: COLLISION_BVH (build option, COLLISION_TEST=bvh) replaces the inside test by
+// the solid angle sum (thetasum) with a segment test against the surface, the
+// solid angle is then only computed where the field itself needs it
+
+#define BVH_STACK_SIZE 32 // see BodyMesh.h
+
+/*
+First intersection of the segment p0 -> p0+d with the surface, traversing the
+bounding volume hierarchy prepared on the host (see BodyMesh.h). Returns 1 and
+the segment parameter t in [0,1] and the face index, 0 if there is none.
+
+bvhIn[2*n]   : lower corner (xyz), first face in bvhTriIn (leaf) or right child (w)
+bvhIn[2*n+1] : upper corner (xyz), number of faces (leaf) or 0 (w)
+bvhTriIn[3*k]: vertex 0 (xyz), face index (w), bvhTriIn[3*k+1], [3*k+2]: edges v1-v0, v2-v0
+*/
+int bvh_intersect(
+Real_t4 p0,
+Real_t4 d,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn,
+Real_t *t,
+int *face
+)
+{
+   p0.w=0.0;
+   d.w=0.0;
+   Real_t4 inv=(Real_t4)(1.0/d.x,1.0/d.y,1.0/d.z,0.0);
+   Real_t tmax=1.0;
+   *face=-1;
+   int stack[BVH_STACK_SIZE];
+   int sp=0;
+   int node=0;
+   while(1)
+   {
+      // slab test against the remaining segment [0,tmax], fmin/fmax drop the NaN of 0*inf
+      Real_t4 lo=bvhIn[2*node];
+      Real_t4 hi=bvhIn[2*node+1];
+      Real_t4 t0=(lo-p0)*inv;
+      Real_t4 t1=(hi-p0)*inv;
+      Real_t tn=fmax(fmax(fmax(0.0,fmin(t0.x,t1.x)),fmin(t0.y,t1.y)),fmin(t0.z,t1.z));
+      Real_t tf=fmin(fmin(fmin(tmax,fmax(t0.x,t1.x)),fmax(t0.y,t1.y)),fmax(t0.z,t1.z));
+      if(tn<=tf && hi.w==0.0) // inner node, visit the left child first
+      {
+         stack[sp++]=(int)lo.w;
+         node++;
+         continue;
+      }
+      if(tn<=tf) // leaf, Moeller-Trumbore test of its faces (both sides)
+      {
+         int first=(int)lo.w;
+         for(int i=first;i<first+(int)hi.w;i++)
+         {
+            Real_t4 v0=bvhTriIn[3*i];
+            Real_t4 e1=bvhTriIn[3*i+1];
+            Real_t4 e2=bvhTriIn[3*i+2];
+            Real_t4 pvec=cross(d,e2);
+            Real_t det=dot(e1,pvec);
+            if(det==0.0) continue;
+            Real_t inv_det=1.0/det;
+            Real_t4 tvec=p0-(Real_t4)(v0.x,v0.y,v0.z,0.0);
+            Real_t u=dot(tvec,pvec)*inv_det;
+            if(u<0.0 || u>1.0) continue;
+            Real_t4 qvec=cross(tvec,e1);
+            Real_t v=dot(d,qvec)*inv_det;
+            if(v<0.0 || u+v>1.0) continue;
+            Real_t ti=dot(e2,qvec)*inv_det;
+            if(ti>=0.0 && ti<=tmax)
+            {
+               tmax=ti;
+               *face=(int)v0.w;
+            }
+         }
+      }
+      if(sp==0) break;
+      node=stack[--sp];
+   }
+   *t=tmax;
+   return *face>=0;
+}
+
+// acceleration in the rotating frame of the comet: field of the body g
+// (without G*density), Coriolis and centrifugal terms
+Real_t4 acceleration(
+Real_t4 g,
+Real_t4 pos,
+Real_t4 vel,
+Real_t omega,
+Real_t gdens
+)
+{
+   g*=gdens;
+   g.x+=(+2.0*omega*vel.y+pos.x*omega*omega);
+   g.y+=(-2.0*omega*vel.x+pos.y*omega*omega);
+   return g;
+}
+
+// kick-drift step of h in the rotating frame of the comet, g: field of the
+// body (without G*density)
+void kick_drift(
+Real_t4 g,
+Real_t4 *pos, 
+Real_t4 *vel, 
+Real_t h,
+Real_t omega,
+Real_t gdens
+)
+{
+   g=acceleration(g, *pos, *vel, omega, gdens);
+   *vel=*vel+g*h;
+   *pos=*pos+*vel*h+g*h*h*0.5;
+}
+
+// kick of h for the symplectic integrators: the velocity independent part of
+// the acceleration (field of the body, centrifugal term) in two halves around
+// the exact rotation of the velocity by the Coriolis term
+void kick(
+Real_t4 g,
+Real_t4 pos,
+Real_t4 *vel, 
+Real_t h,
+Real_t omega,
+Real_t gdens
+)
+{
+   g*=gdens;
+   g.x+=pos.x*omega*omega;
+   g.y+=pos.y*omega*omega;
+   Real_t4 v=*vel+g*(0.5*h);
+   Real_t c=cos(2.0*omega*h);
+   Real_t s=sin(2.0*omega*h);
+   *vel=(Real_t4)(v.x*c+v.y*s, -v.x*s+v.y*c, v.z, v.w)+g*(0.5*h);
+}
+
+#ifdef COLLISION_BVH
+// moves the particle to pnew, vnew unless the segment crosses the surface, then
+// it stops at the impact point, is masked as a hit in vel.w (1.0) and pos.w
+// holds the index of the hit face, returns 1 for a hit, t: fraction of the
+// segment up to the impact point (1.0 without a hit)
+int move_checked(
+Real_t4 *pos, 
+Real_t4 *vel, 
+Real_t4 pnew,
+Real_t4 vnew,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn,
+Real_t *t
+)
+{
+   int face;
+   if (bvh_intersect(*pos, pnew-*pos, bvhIn, bvhTriIn, t, &face))
+   {
+      *pos=*pos+(pnew-*pos)*(*t);
+      *vel=*vel+(vnew-*vel)*(*t);
+      (*pos).w=face;
+      (*vel).w=1.0;
+      return 1;
+   }
+   *pos=pnew;
+   *vel=vnew;
+   *t=1.0;
+   return 0;
+}
+#endif
+
+// kick-drift update, particles inside the nucleus (thetasum >= 0.1) are frozen
+// and masked as a hit in vel.w (1.0), with COLLISION_BVH particles whose step
+// crosses the surface stop at the impact point (see move_checked()), t:
+// fraction of dt the particle moved
+void update_particle(
+Real_t4 g,
+Real_t thetasum,
+Real_t4 *pos, 
+Real_t4 *vel, 
+Real_t dt,
+Real_t omega,
+Real_t gdens,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn,
+Real_t *t
+)
+{
+#ifdef COLLISION_BVH
+   Real_t4 pnew=*pos;
+   Real_t4 vnew=*vel;
+   kick_drift(g, &pnew, &vnew, dt, omega, gdens);
+   move_checked(pos, vel, pnew, vnew, bvhIn, bvhTriIn, t);
+#else
+   if (thetasum<0.1) // position outside the comet
+   {
+      kick_drift(g, pos, vel, dt, omega, gdens);
+      *t=1.0;
+   }
+   else // we re-collided with the comet, do not update position, but mask vel.w as a hit (1.0)
+   {
+      (*vel).w=1.0;
+      *t=0.0;
+   }
+#endif
+}
+
+// escape test at the end of a launch (ESCAPE_CRITERION, escape_radius>0): a
+// particle beyond escape_radius from the centre of mass escaped, with the
+// energy criterion (escape_gm>0) only if its energy per mass in the inertial
+// frame with the potential of a point mass escape_gm is positive; it is masked
+// in vel.w (2.0) and pos.w holds the step
+void escape_test(
+Real_t4 *pos,
+Real_t4 *vel,
+Real_t omega,
+Real_t radius,
+Real_t gm,
+int step
+)
+{
+   if ((*vel).w!=0.0 || radius<=0.0) return;
+   Real_t r2=(*pos).x*(*pos).x+(*pos).y*(*pos).y+(*pos).z*(*pos).z;
+   if (r2<radius*radius) return;
+   if (gm>0.0)
+   {
+      // velocity in the inertial frame, vel+cross(omega,pos)
+      Real_t vx=(*vel).x-omega*(*pos).y;
+      Real_t vy=(*vel).y+omega*(*pos).x;
+      Real_t vz=(*vel).z;
+      if (0.5*(vx*vx+vy*vy+vz*vz)-gm/sqrt(r2)<=0.0) return;
+   }
+   (*vel).w=2.0;
+   (*pos).w=step;
+}
+
+// appends the impact of particle m in a launch that started at step firststep
+// to the impact log (IMPACT_LOG, maxevents>0): time of the impact since the
+// start of the launch (see step_state), eventIdOut: particle, hit face (-1
+// without COLLISION_BVH), step of the impact, eventOut: position and time
+// since the start of that step, velocity
+void log_impact(
+int m,
+Real_t4 pos,
+Real_t4 vel,
+Real_t time,
+Real_t dt,
+int firststep,
+__global int4 *eventIdOut,
+__global Real_t4 *eventOut,
+volatile __global int *eventCount,
+int maxevents
+)
+{
+   if (maxevents<=0) return;
+   int k=atomic_inc(eventCount);
+   if (k>=maxevents) return;
+   int steps=(int)floor(time/dt);
+#ifdef COLLISION_BVH
+   int face=(int)pos.w;
+#else
+   int face=-1;
+#endif
+   eventIdOut[k]=(int4)(m, face, firststep+steps, 0);
+   eventOut[2*k]=(Real_t4)(pos.x, pos.y, pos.z, time-steps*dt);
+   eventOut[2*k+1]=(Real_t4)(vel.x, vel.y, vel.z, 0.0);
+}
+
+/*
+Time stepping of a launch, each iteration of the step loop of the kernels
+evaluates the field at pos and passes it to step_update():
+
+step_state s=step_begin(&pos, vel, dt, numsteps);
+while(step_continue(vel,&s))
+{
+   ... field g, thetasum at pos ...
+   step_update(g, thetasum, &pos, &vel, &s, ...);
+}
+step_end(&pos, vel, &s);
+if (vel.w==1.0 && vold[m].w==0.0) log_impact(..., s.time, ...);
+escape_test(&pos, &vel, ...);
+
+The integrator is selected by build options (INTEGRATOR):
+
+(none)              kick-drift steps of dt (update_particle()), with
+                    ADAPTIVE_STEPS see below
+INTEGRATOR_VERLET   velocity Verlet (kick-drift-kick) steps of dt, one field
+                    evaluation per step
+INTEGRATOR_YOSHIDA4 Yoshida's 4th order composition of three velocity Verlet
+                    steps, three field evaluations per step
+INTEGRATOR_RK4      classical 4th order Runge-Kutta steps of dt, four field
+                    evaluations per step
+INTEGRATOR_RKF45    Runge-Kutta-Fehlberg 4(5), six field evaluations per
+                    attempt, adaptive step size
+
+The kicks of the symplectic integrators (see kick()) rotate the velocity
+exactly by the Coriolis term. Their last kick of a launch needs the field at
+the final position, one more field evaluation per launch, so that all
+velocities are synchronised at the outputs. The collision tests of the higher
+order integrators only consider the positions at the ends of the steps (with
+COLLISION_BVH the chord of each step), the field of their intermediate stages
+may be evaluated inside the comet, the negative drift of Yoshida's
+composition goes back beyond the start of the step.
+
+With ADAPTIVE_STEPS (ADAPTIVE_TOLERANCE>0 and the kick-drift integrator) each
+particle integrates over numsteps*dt with its own step size h, controlled by
+step doubling: a step of h is compared with two steps of h/2 (one more field
+evaluation, at the midpoint), the two half steps are accepted if the positions
+differ by at most tolerance (m) and h is adapted to the difference.
+INTEGRATOR_RKF45 controls h the same way with the difference of its 4th and 5th
+order solutions. The last step is clamped to the end of the launch, so all
+particles are at the same time after each launch (outputs and compactions are
+at launch boundaries). Between launches h of active particles is kept in pos.w
+(0: start with dt).
+
+All variants keep the time of pos, vel since the start of the launch in
+s.time. For a hit it is the time of the impact: with COLLISION_BVH interpolated
+on the tested segment, otherwise the time of the position found inside.
+Particles with a non-finite field are retired as hits (see retire_non_finite()).
+*/
+
+#define ADAPTIVE_MIN_STEP 1.0e-3 // smallest step size in units of dt
+#define ADAPTIVE_MAX_GROWTH 4.0  // largest change of the step size per step
+#define ADAPTIVE_SAFETY 0.9      // of the step size expected to meet the tolerance
+
+// a particle whose field is not finite (e.g. rounding in the face sums) would
+// propagate as NaN, with COLLISION_BVH it never hits the surface, it is frozen
+// at its position and masked as a hit in vel.w (1.0) without a face (pos.w -1),
+// returns 1 if the particle was retired
+int retire_non_finite(
+Real_t4 g,
+Real_t thetasum,
+Real_t4 *pos, 
+Real_t4 *vel
+)
+{
+   if (isfinite(g.x) && isfinite(g.y) && isfinite(g.z) && isfinite(thetasum))
+      return 0;
+   (*pos).w=-1.0;
+   (*vel).w=1.0;
+   return 1;
+}
+
+#if defined(INTEGRATOR_VERLET) || defined(INTEGRATOR_YOSHIDA4)
+#ifdef INTEGRATOR_YOSHIDA4
+// kicks k[0..3] and drifts d[0..2] of a step (in units of dt), w1=1/(2-2^(1/3)),
+// w0=-2^(1/3)*w1: kicks w1/2, (w1+w0)/2, (w0+w1)/2, w1/2, drifts w1, w0, w1
+#define SYMPLECTIC_STAGES 3
+Real_t symplectic_kick(int stage)
+{
+   return (stage==0 || stage==3) ? 0.6756035959798289 : -0.17560359597982889;
+}
+
+Real_t symplectic_drift(int stage)
+{
+   return (stage==1) ? -1.7024143839193155 : 1.3512071919596578;
+}
+#else
+#define SYMPLECTIC_STAGES 1
+Real_t symplectic_kick(int stage)
+{
+   return 0.5;
+}
+
+Real_t symplectic_drift(int stage)
+{
+   return 1.0;
+}
+#endif
+
+typedef struct
+{
+   Real_t4 p0, v0; // start of the step
+   Real_t dt;
+   Real_t time;    // of the start of the step
+   int steps;      // steps left
+   int stage;      // next kick of the step
+} step_state;
+
+step_state step_begin(Real_t4 *pos, Real_t4 vel, Real_t dt, int numsteps)
+{
+   step_state s;
+   s.dt=dt;
+   s.time=0.0;
+   s.steps=numsteps;
+   s.stage=0;
+   return s;
+}
+
+int step_continue(Real_t4 vel, step_state *s)
+{
+   return vel.w==0.0 && s->steps>0;
+}
+
+void step_update(
+Real_t4 g,
+Real_t thetasum,
+Real_t4 *pos, 
+Real_t4 *vel, 
+step_state *s,
+Real_t omega,
+Real_t gdens,
+Real_t tolerance,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn
+)
+{
+   if (retire_non_finite(g, thetasum, pos, vel))
+      return;
+#ifndef COLLISION_BVH
+   if ((s->stage==0 || s->stage==SYMPLECTIC_STAGES) && thetasum>=0.1) // inside the comet at the start or the end of a step
+   {
+      if (s->stage==SYMPLECTIC_STAGES)
+         s->time+=s->dt;
+      (*vel).w=1.0;
+      return;
+   }
+#endif
+   kick(g, *pos, vel, symplectic_kick(s->stage)*s->dt, omega, gdens);
+   if (s->stage==SYMPLECTIC_STAGES)
+   {
+      // last kick of the step, the first one of the next step has the same field
+      s->stage=0;
+      s->time+=s->dt;
+      if (--s->steps==0)
+         return;
+      kick(g, *pos, vel, symplectic_kick(0)*s->dt, omega, gdens);
+   }
+   if (s->stage==0)
+   {
+      s->p0=*pos;
+      s->v0=*vel;
+   }
+   Real_t4 pnew=*pos+*vel*(symplectic_drift(s->stage)*s->dt);
+#ifdef COLLISION_BVH
+   if (s->stage==SYMPLECTIC_STAGES-1)
+   {
+      // the chord of the whole step is tested against the surface
+      Real_t4 vnew=*vel;
+      Real_t t;
+      *pos=s->p0;
+      *vel=s->v0;
+      if (move_checked(pos, vel, pnew, vnew, bvhIn, bvhTriIn, &t))
+         s->time+=t*s->dt;
+   }
+   else
+      *pos=pnew;
+#else
+   *pos=pnew;
+#endif
+   s->stage++;
+}
+
+void step_end(Real_t4 *pos, Real_t4 vel, step_state *s)
+{
+}
+#elif defined(INTEGRATOR_RK4) || defined(INTEGRATOR_RKF45)
+// Butcher tableau, rk_a: lower triangle row by row, rk_b: weights of the
+// propagated solution, rk_e: of the error estimate
+#ifdef INTEGRATOR_RKF45
+#define RK_STAGES 6
+__constant Real_t rk_a[15]={
+   1.0/4.0,
+   3.0/32.0, 9.0/32.0,
+   1932.0/2197.0, -7200.0/2197.0, 7296.0/2197.0,
+   439.0/216.0, -8.0, 3680.0/513.0, -845.0/4104.0,
+   -8.0/27.0, 2.0, -3544.0/2565.0, 1859.0/4104.0, -11.0/40.0 };
+__constant Real_t rk_b[6]={ 25.0/216.0, 0.0, 1408.0/2565.0, 2197.0/4104.0, -1.0/5.0, 0.0 };
+__constant Real_t rk_e[6]={ 1.0/360.0, 0.0, -128.0/4275.0, -2197.0/75240.0, 1.0/50.0, 2.0/55.0 };
+#else
+#define RK_STAGES 4
+__constant Real_t rk_a[6]={
+   1.0/2.0,
+   0.0, 1.0/2.0,
+   0.0, 0.0, 1.0 };
+__constant Real_t rk_b[4]={ 1.0/6.0, 1.0/3.0, 1.0/3.0, 1.0/6.0 };
+#endif
+
+typedef struct
+{
+   Real_t4 p0, v0;        // start of the step
+   Real_t4 kp[RK_STAGES]; // stage derivatives of the position
+   Real_t4 kv[RK_STAGES]; // and of the velocity
+   Real_t h;              // step size
+   Real_t time;           // of the start of the step
+   int stage;             // stage pos, vel belong to
+#ifdef INTEGRATOR_RKF45
+   Real_t next;           // proposed size of the next step
+   Real_t hmin;
+   Real_t remaining;      // time to the end of the launch
+#else
+   int steps;             // steps left
+#endif
+} step_state;
+
+// pos, vel of stage j of the step
+void rk_stage(step_state *s, int j, Real_t4 *pos, Real_t4 *vel)
+{
+   Real_t4 p=s->p0;
+   Real_t4 v=s->v0;
+   for (int i=0; i<j; i++)
+   {
+      Real_t a=rk_a[j*(j-1)/2+i]*s->h;
+      p+=s->kp[i]*a;
+      v+=s->kv[i]*a;
+   }
+   *pos=p;
+   *vel=v;
+   s->stage=j;
+}
+
+step_state step_begin(Real_t4 *pos, Real_t4 vel, Real_t dt, int numsteps)
+{
+   step_state s;
+   s.stage=0;
+   s.time=0.0;
+#ifdef INTEGRATOR_RKF45
+   s.next=((*pos).w>0.0) ? (*pos).w : dt;
+   s.hmin=dt*ADAPTIVE_MIN_STEP;
+   s.remaining=numsteps*dt;
+   if (vel.w==0.0) // pos.w of removed particles holds the hit face or escape step
+      (*pos).w=0.0;
+#else
+   s.h=dt;
+   s.steps=numsteps;
+#endif
+   return s;
+}
+
+int step_continue(Real_t4 vel, step_state *s)
+{
+#ifdef INTEGRATOR_RKF45
+   return vel.w==0.0 && s->remaining>0.0;
+#else
+   return vel.w==0.0 && s->steps>0;
+#endif
+}
+
+void step_update(
+Real_t4 g,
+Real_t thetasum,
+Real_t4 *pos, 
+Real_t4 *vel, 
+step_state *s,
+Real_t omega,
+Real_t gdens,
+Real_t tolerance,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn
+)
+{
+   if (retire_non_finite(g, thetasum, pos, vel))
+      return;
+#ifndef COLLISION_BVH
+   if (s->stage==0 && thetasum>=0.1) // inside the comet at the end of the last step
+   {
+      (*vel).w=1.0;
+      return;
+   }
+#endif
+   if (s->stage==0)
+   {
+      s->p0=*pos;
+      s->v0=*vel;
+#ifdef INTEGRATOR_RKF45
+      s->h=fmin(s->next, s->remaining);
+#endif
+   }
+   s->kp[s->stage]=*vel;
+   s->kv[s->stage]=acceleration(g, *pos, *vel, omega, gdens);
+   if (s->stage<RK_STAGES-1)
+   {
+      rk_stage(s, s->stage+1, pos, vel);
+      return;
+   }
+
+   Real_t4 pnew=s->p0;
+   Real_t4 vnew=s->v0;
+   for (int i=0; i<RK_STAGES; i++)
+   {
+      pnew+=s->kp[i]*(rk_b[i]*s->h);
+      vnew+=s->kv[i]*(rk_b[i]*s->h);
+   }
+#ifdef INTEGRATOR_RKF45
+   Real_t4 perr=(Real_t4)(0.0);
+   for (int i=0; i<RK_STAGES; i++)
+      perr+=s->kp[i]*(rk_e[i]*s->h);
+   Real_t err=length(perr);
+   Real_t scale=(err>0.0) ? ADAPTIVE_SAFETY*pow(tolerance/err,(Real_t)0.2) : ADAPTIVE_MAX_GROWTH;
+   scale=clamp(scale,(Real_t)(1.0/ADAPTIVE_MAX_GROWTH),(Real_t)ADAPTIVE_MAX_GROWTH);
+   if (err>tolerance && s->h>s->hmin)
+   {
+      // rejected, retried from the start of the step, the first stage is known
+      s->h=fmax(s->h*scale, s->hmin);
+      s->next=s->h;
+      rk_stage(s, 1, pos, vel);
+      return;
+   }
+   // a step clamped to the end of the launch does not shrink the proposal
+   s->next=(s->h<s->next) ? fmax(s->next, s->h*scale) : s->h*scale;
+   s->remaining-=s->h;
+#else
+   s->steps--;
+#endif
+   s->stage=0;
+   Real_t t=1.0;
+#ifdef COLLISION_BVH
+   *pos=s->p0;
+   *vel=s->v0;
+   move_checked(pos, vel, pnew, vnew, bvhIn, bvhTriIn, &t);
+#else
+   *pos=pnew;
+   *vel=vnew;
+#endif
+   s->time+=t*s->h;
+}
+
+void step_end(Real_t4 *pos, Real_t4 vel, step_state *s)
+{
+#ifdef INTEGRATOR_RKF45
+   if (vel.w==0.0)
+      (*pos).w=s->next;
+#endif
+}
+#elif defined(ADAPTIVE_STEPS)
+typedef struct
+{
+   Real_t4 p0, v0, g0; // start of the current attempt and the field there
+   Real_t4 p1, v1;     // result of the full step of the attempt
+   Real_t h;           // step size of the attempt
+   Real_t next;        // proposed size of the next step
+   Real_t hmin;
+   Real_t remaining;   // time to the end of the launch
+   Real_t time;        // of the start of the attempt
+   int half;           // pos, vel are the midpoint of the attempt
+} step_state;
+
+step_state step_begin(Real_t4 *pos, Real_t4 vel, Real_t dt, int numsteps)
+{
+   step_state s;
+   s.next=((*pos).w>0.0) ? (*pos).w : dt;
+   s.hmin=dt*ADAPTIVE_MIN_STEP;
+   s.remaining=numsteps*dt;
+   s.time=0.0;
+   s.half=0;
+   if (vel.w==0.0) // pos.w of removed particles holds the hit face or escape step
+      (*pos).w=0.0;
+   return s;
+}
+
+int step_continue(Real_t4 vel, step_state *s)
+{
+   return vel.w==0.0 && s->remaining>0.0;
+}
+
+void step_update(
+Real_t4 g,
+Real_t thetasum,
+Real_t4 *pos, 
+Real_t4 *vel, 
+step_state *s,
+Real_t omega,
+Real_t gdens,
+Real_t tolerance,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn
+)
+{
+   if (retire_non_finite(g, thetasum, pos, vel))
+      return;
+#ifndef COLLISION_BVH
+   if (thetasum>=0.1) // inside the comet at the start or the midpoint of an attempt
+   {
+      if (s->half)
+         s->time+=0.5*s->h;
+      (*vel).w=1.0;
+      return;
+   }
+#endif
+   if (!s->half)
+   {
+      s->p0=*pos;
+      s->v0=*vel;
+      s->g0=g;
+   }
+   else
+   {
+      // second half step, compared with the full step
+      Real_t4 p2=*pos;
+      Real_t4 v2=*vel;
+      kick_drift(g, &p2, &v2, 0.5*s->h, omega, gdens);
+      Real_t err=length(p2-s->p1);
+      Real_t scale=(err>0.0) ? ADAPTIVE_SAFETY*sqrt(tolerance/err) : ADAPTIVE_MAX_GROWTH;
+      scale=clamp(scale,(Real_t)(1.0/ADAPTIVE_MAX_GROWTH),(Real_t)ADAPTIVE_MAX_GROWTH);
+      if (err<=tolerance || s->h<=s->hmin)
+      {
+#ifdef COLLISION_BVH
+         // both half steps are tested against the surface
+         Real_t4 pm=*pos;
+         Real_t4 vm=*vel;
+         Real_t t;
+         *pos=s->p0;
+         *vel=s->v0;
+         if (move_checked(pos, vel, pm, vm, bvhIn, bvhTriIn, &t))
+         {
+            s->time+=0.5*s->h*t;
+            return;
+         }
+         if (move_checked(pos, vel, p2, v2, bvhIn, bvhTriIn, &t))
+         {
+            s->time+=0.5*s->h*(1.0+t);
+            return;
+         }
+#else
+         *pos=p2;
+         *vel=v2;
+#endif
+         // a step clamped to the end of the launch does not shrink the proposal
+         s->next=(s->h<s->next) ? fmax(s->next, s->h*scale) : s->h*scale;
+         s->remaining-=s->h;
+         s->time+=s->h;
+         s->half=0;
+         return; // the next attempt needs the field at the new position
+      }
+      // rejected, retried from the start of the attempt, the field there is known
+      s->next=fmax(s->h*scale, s->hmin);
+      *pos=s->p0;
+      *vel=s->v0;
+      g=s->g0;
+   }
+
+   // new attempt: the full step and the first half step, the field at the midpoint is evaluated next
+   s->h=fmin(s->next, s->remaining);
+   s->p1=*pos;
+   s->v1=*vel;
+   kick_drift(g, &s->p1, &s->v1, s->h, omega, gdens);
+   kick_drift(g, pos, vel, 0.5*s->h, omega, gdens);
+   s->half=1;
+}
+
+void step_end(Real_t4 *pos, Real_t4 vel, step_state *s)
+{
+   if (vel.w==0.0)
+      (*pos).w=s->next;
+}
+#else
+typedef struct
+{
+   Real_t dt;
+   Real_t time; // of the start of the step
+   int steps;   // steps left
+} step_state;
+
+step_state step_begin(Real_t4 *pos, Real_t4 vel, Real_t dt, int numsteps)
+{
+   step_state s;
+   s.dt=dt;
+   s.time=0.0;
+   s.steps=numsteps;
+   return s;
+}
+
+int step_continue(Real_t4 vel, step_state *s)
+{
+   return vel.w==0.0 && s->steps>0;
+}
+
+void step_update(
+Real_t4 g,
+Real_t thetasum,
+Real_t4 *pos, 
+Real_t4 *vel, 
+step_state *s,
+Real_t omega,
+Real_t gdens,
+Real_t tolerance,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn
+)
+{
+   if (retire_non_finite(g, thetasum, pos, vel))
+      return;
+   Real_t t;
+   update_particle(g, thetasum, pos, vel, s->dt, omega, gdens, bvhIn, bvhTriIn, &t);
+   s->time+=t*s->dt;
+   s->steps--;
+}
+
+void step_end(Real_t4 *pos, Real_t4 vel, step_state *s)
+{
+}
+#endif
+
+/*
+Far-field multipole expansion of the field (see BodyMultipole.h), used instead
+of the sum over the faces for particles beyond the multipole radius. mporder<0
+disables it.
+
+mpIn[0..2]: centre of mass, mpIn[3]: 1/body radius, mpIn[4]: multipole radius^2
+mpIn[8+6*(n*(n+1)/2-1+m)..]: Re, Im of the coefficients G_n^m for x, y, z
+*/
+int multipole_far(Real_t4 Rm, __global Real_t *mpIn, int mporder)
+{
+   if(mporder<0) return 0;
+   Real_t4 d=(Real_t4)(Rm.x-mpIn[0],Rm.y-mpIn[1],Rm.z-mpIn[2],0.0);
+   return dot(d,d)>=mpIn[4];
+}
+
+// g = sum_{n=1}^{mporder+1} sum_{m=0}^{n} Re(G_n^m I_n^m), the irregular solid harmonics
+// I_n^m are computed per m with the recurrences
+// I_m^m = -(2m-1) (x+iy) I_(m-1)^(m-1) / r^2
+// I_n^m = ((2n-1) z I_(n-1)^m - (n+m-1) (n-m-1) I_(n-2)^m) / r^2
+Real_t4 multipole_field(Real_t4 Rm, __global Real_t *mpIn, int mporder)
+{
+   Real_t4 x=(Real_t4)(Rm.x-mpIn[0],Rm.y-mpIn[1],Rm.z-mpIn[2],0.0)*mpIn[3];
+   Real_t q=1.0/dot(x,x);
+   Real_t4 g=(Real_t4)(0.0,0.0,0.0,0.0);
+
+   Real_t dre=sqrt(q); // I_m^m, starting with I_0^0 = 1/r
+   Real_t dim=0.0;
+   for(int m=0;m<=mporder+1;m++)
+   {
+      if(m>0)
+      {
+         Real_t f=-(2*m-1)*q;
+         Real_t t=f*(x.x*dre-x.y*dim);
+         dim=f*(x.x*dim+x.y*dre);
+         dre=t;
+      }
+      Real_t pre=dre, pim=dim;     // I_(n-1)^m
+      Real_t ppre=0.0, ppim=0.0;   // I_(n-2)^m
+      for(int n=m;n<=mporder+1;n++)
+      {
+         Real_t ire=dre, iim=dim;
+         if(n>m)
+         {
+            Real_t a=(2*n-1)*x.z*q;
+            Real_t b=(n+m-1)*(n-m-1)*q;
+            ire=a*pre-b*ppre;
+            iim=a*pim-b*ppim;
+            ppre=pre;
+            ppim=pim;
+            pre=ire;
+            pim=iim;
+         }
+         if(n>0)
+         {
+            __global Real_t *c=mpIn+8+6*(n*(n+1)/2-1+m);
+            g.x+=c[0]*ire-c[1]*iim;
+            g.y+=c[2]*ire-c[3]*iim;
+            g.z+=c[4]*ire-c[5]*iim;
+         }
+      }
+   }
+   return g;
+}
+
+/*
+Gravity field sampled from the precomputed nested grids (see GravityGrid.h),
+returns 1 if g and thetasum are valid, 0 if the exact field is needed (close
+to the surface or outside of all levels). gridlevels=0 disables it.
+
+gridParamIn[0]: nodes per axis, gridParamIn[8+8*k..]: origin (xyz), 1/h, h of level k
+gridIn: field (xyz) and signed distance (w) of the nodes, level-major
+*/
+int grid_field(
+Real_t4 Rm,
+__global Real_t4 *gridIn,
+__global Real_t *gridParamIn,
+int gridlevels,
+Real_t4 *g,
+Real_t *thetasum
+)
+{
+   int n=(int)gridParamIn[0];
+   for(int k=0;k<gridlevels;k++)
+   {
+      __global Real_t *lp=gridParamIn+8+8*k;
+      Real_t4 u=(Real_t4)((Rm.x-lp[0])*lp[3],(Rm.y-lp[1])*lp[3],(Rm.z-lp[2])*lp[3],0.0);
+      // the stencil i-1..i+2 has to be inside the level
+      if(u.x<1.0 || u.y<1.0 || u.z<1.0 || u.x>=n-2 || u.y>=n-2 || u.z>=n-2)
+         continue;
+
+      int ix=(int)floor(u.x);
+      int iy=(int)floor(u.y);
+      int iz=(int)floor(u.z);
+      Real_t t[3]={u.x-ix,u.y-iy,u.z-iz};
+      Real_t w[3][4];
+      for(int c=0;c<3;c++) // Catmull-Rom weights
+      {
+         w[c][0]=0.5*t[c]*((2.0-t[c])*t[c]-1.0);
+         w[c][1]=0.5*(t[c]*t[c]*(3.0*t[c]-5.0)+2.0);
+         w[c][2]=0.5*t[c]*((4.0-3.0*t[c])*t[c]+1.0);
+         w[c][3]=0.5*(t[c]-1.0)*t[c]*t[c];
+      }
+      __global Real_t4 *level=gridIn+(size_t)k*n*n*n;
+      Real_t4 s=(Real_t4)(0.0,0.0,0.0,0.0);
+      for(int c=0;c<4;c++)
+         for(int b=0;b<4;b++)
+            for(int a=0;a<4;a++)
+               s+=(w[0][a]*w[1][b]*w[2][c])*level[((size_t)(iz-1+c)*n+(iy-1+b))*n+(ix-1+a)];
+
+      Real_t margin=4.0*lp[4];
+      if(s.w>margin) // the whole stencil is outside the body
+      {
+         *g=(Real_t4)(s.x,s.y,s.z,0.0);
+         return 1;
+      }
+      if(s.w<-margin) // inside
+      {
+         *thetasum=4.0*3.1415926535897932385;
+         return 1;
+      }
+      return 0; // close to the surface
+   }
+   return 0;
+}
+
+// multipole expansion far away, gravity grid close to the body, returns 1 if
+// g and thetasum are valid without the sum over the faces
+int field_shortcut(
+Real_t4 Rm,
+__global Real_t *mpIn,
+int mporder,
+__global Real_t4 *gridIn,
+__global Real_t *gridParamIn,
+int gridlevels,
+Real_t4 *g,
+Real_t *thetasum
+)
+{
+   if(multipole_far(Rm, mpIn, mporder))
+   {
+      *g=multipole_field(Rm, mpIn, mporder);
+      return 1;
+   }
+   return grid_field(Rm, gridIn, gridParamIn, gridlevels, g, thetasum);
+}
+
 __kernel void integrate_eom( 
 __global Real_t4 *pold, 
 __global Real_t4 *vold, 
 __global Real_t4 *pnew, 
 __global Real_t4 *vnew, 
+__global int *activeIn,
 __global Real_t *nvIn,
 __global Real_t *rijIn,
 int numpoints, 
@@ -39,7 +1004,23 @@ int numfaces,
 int numvertices,
 Real_t dt,
 Real_t omega,
-Real_t gdens
+Real_t gdens,
+Real_t tolerance, // ADAPTIVE_TOLERANCE
+int numsteps,
+__global Real_t *mpIn,
+int mporder,
+__global Real_t4 *gridIn,
+__global Real_t *gridParamIn,
+int gridlevels,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn,
+Real_t escape_radius, // see escape_test()
+Real_t escape_gm,
+int endstep,
+__global int4 *eventIdOut, // see log_impact()
+__global Real_t4 *eventOut,
+volatile __global int *eventCount,
+int maxevents
 )
 { 
 /*
@@ -48,8 +1029,14 @@ __global Real_t *gOut,
 __global Real_t *thetasum, 
 */    
    //for(int m=0;m<numpoints;m++)
-   int m=get_global_id(0);
+   int a=get_global_id(0);
+   if(a>=numpoints) return;
+   int m=activeIn[a];
 
+   Real_t4 pos=pold[m];
+   Real_t4 vel=vold[m];
+   step_state s=step_begin(&pos, vel, dt, numsteps);
+   while(step_continue(vel, &s))
    {
       Real_t phi=0.0;
       Real_t thetasum=0.0;
@@ -57,9 +1044,11 @@ __global Real_t *thetasum,
       
       // Real_t4 Rm=(Real_t4)(RIn[3*m+0],RIn[3*m+1],RIn[3*m+2],0.0);
 
-      Real_t4 Rm=pold[m];
+      Real_t4 Rm=pos;
+      // the multipole expansion or the gravity grid replace the sum over the faces where possible
+      int shortcut=field_shortcut(Rm, mpIn, mporder, gridIn, gridParamIn, gridlevels, &g, &thetasum);
 
-      for(int i=0;i<numfaces;i++)
+      for(int i=0;i<(shortcut ? 0 : numfaces);i++)
       {
          Real_t4 nv=(Real_t4)(nvIn[3*i+0],nvIn[3*i+1],nvIn[3*i+2],0.0);
          
@@ -85,6 +1074,7 @@ __global Real_t *thetasum,
          nr1=norm(r1);
          nr2=norm(r2);
          nr3=norm(r3);
+#ifndef COLLISION_BVH
          // compute solid angle to determine if position is inside the comet or outside
          thetasum+=2.0*atan2(
                     dot(r1,cross(r2,r3)),
@@ -93,6 +1083,7 @@ __global Real_t *thetasum,
                     +dot(r1,r3)*nr2
                     +dot(r2,r3)*nr1
                     );
+#endif
          for(int j=0;j<numvertices;j++)
          {
             Real_t4 rij  =(Real_t4)(rijIn[(i*4+j  )*3+0],rijIn[(i*4+j  )*3+1],rijIn[(i*4+j  )*3+2],0.0); 
@@ -114,7 +1105,7 @@ __global Real_t *thetasum,
                
                if      (fabs(arg-1.0)<1.0e-12) aux=0.0;
                else if (fabs(arg+1.0)<1.0e-12) aux=3.1415926535897932385;
-               else                     aux=acos(arg);
+               else                     aux=acos(clamp(arg,-1.0,1.0)); // see face_field_edges()
 #ifdef PRINTF               
                if (isnan(aux)) 
                   printf("acos error\n");
@@ -133,7 +1124,9 @@ __global Real_t *thetasum,
             if(fabs(dij)>1.0e-5)
             {
                Real_t epa2m2b=(1.0+a*a-2.0*b);
+#ifndef PRECISION_FLOAT
                Real_t a2mb2mc2=(a*a-b*b-c*c);
+#endif
                
                Real_t sepa2m2b;
                Real_t sa2mb2mc2;
@@ -147,7 +1140,14 @@ __global Real_t *thetasum,
                } 
                else 
                   sepa2m2b=sqrt(epa2m2b);
-               if (a2mb2mc2<0.0) 
+#ifdef PRECISION_FLOAT
+               // see face_field_edges()
+               sa2mb2mc2=fabs(dij)/nrijp1rij;
+               Real_t dist2=c*c+sa2mb2mc2*sa2mb2mc2;
+               Real_t amb=(b>0.0) ? dist2/(a+b) : a-b;
+               Real_t ombpe=(b>1.0) ? dist2/(sepa2m2b+b-1.0) : 1.0-b+sepa2m2b;
+#else
+               if (a2mb2mc2<=0.0) // can cancel to 0 with |dij|>1e-5
                {
 #ifdef PRINTF
                   printf("TROUBLE B\n");
@@ -156,8 +1156,11 @@ __global Real_t *thetasum,
                } 
                else 
                   sa2mb2mc2=sqrt(a2mb2mc2);
+               Real_t amb=a-b;
+               Real_t ombpe=1.0-b+sepa2m2b;
+#endif
                
-               Iij=dij*((c*atan((b*c)/(a*sa2mb2mc2)))/sa2mb2mc2 + (c*atan(((1.0 - b)*c)/(sa2mb2mc2*sepa2m2b)))/sa2mb2mc2 + log((1.0 - b + sepa2m2b)/(a - b)));
+               Iij=dij*((c*atan((b*c)/(a*sa2mb2mc2)))/sa2mb2mc2 + (c*atan(((1.0 - b)*c)/(sa2mb2mc2*sepa2m2b)))/sa2mb2mc2 + log(ombpe/amb));
             } 
             else
                Iij=0.0;  
@@ -166,19 +1169,709 @@ __global Real_t *thetasum,
          }
       }
 
-      if (thetasum<0.1) // position outside the comet
+      step_update(g, thetasum, &pos, &vel, &s, omega, gdens, tolerance, bvhIn, bvhTriIn);
+   }  
+   step_end(&pos, vel, &s);
+   if (vel.w==1.0 && vold[m].w==0.0)
+      log_impact(m, pos, vel, s.time, dt, endstep-numsteps, eventIdOut, eventOut, eventCount, maxevents);
+   escape_test(&pos, &vel, omega, escape_radius, escape_gm, endstep);
+   pnew[m]=pos;
+   vnew[m]=vel;
+}
+
+/*
+Field contribution of a single face, using the mesh invariants prepared once on
+the host (see prepare_edges()):
+
+nv  : face normal (xyz), plane offset dot(nv,ri0) (w)
+v[j]: vertices of the face (xyz)
+e[2*j]  : edge rijp1-rij (xyz), 1/norm(rijp1-rij) (w)
+e[2*j+1]: cross(rijp1-rij,nv)/norm(rijp1-rij) (xyz), unused (w)
+
+The vertex distances to Rm and to its projection rpi are computed once per face
+and shared between the solid angle and the three edge terms.
+*/
+void face_field_edges(
+Real_t4 Rm,
+Real_t4 nv,
+Real_t4 *v,
+Real_t4 *e,
+Real_t4 *g,
+Real_t *phi,
+Real_t *thetasum
+)
+{
+   Real_t hd=dot(nv,Rm)-nv.w; // = dot(nv,Rm-rij) for all vertices of the face
+   nv.w=0.0;
+   
+   // NOTE: the differences to Rm are taken in Real_t, everything relative to the face in Geom_t,
+   // the literals are single precision where they are exact and cast otherwise
+   Geom_t h=hd;
+   Geom_t4 nvg=convert_Geom_t4(nv);
+
+   // vertices relative to Rm (r) and to its projection rpi=Rm-h*nv onto the face plane (s)
+   Geom_t4 r[3];
+   Geom_t4 s[3];
+   Geom_t nr[3];
+   Geom_t ns[3];
+   for(int j=0;j<3;j++)
+   {
+      r[j]=convert_Geom_t4((Real_t4)(v[j].x-Rm.x,v[j].y-Rm.y,v[j].z-Rm.z,0.0));
+      s[j]=r[j]+nvg*h;
+      nr[j]=norm(r[j]);
+      ns[j]=norm(s[j]);
+   }
+#ifndef COLLISION_BVH
+   // compute solid angle to determine if position is inside the comet or outside
+   *thetasum+=2.0f*atan2(
+              dot(r[0],cross(r[1],r[2])),
+              nr[0]*nr[1]*nr[2]
+              +dot(r[0],r[1])*nr[2]
+              +dot(r[0],r[2])*nr[1]
+              +dot(r[1],r[2])*nr[0]
+              );
+#endif
+   Geom_t IKsum=0.0f;
+   for(int j=0;j<3;j++)
+   {
+      int jp1=(j==2) ? 0 : j+1;
+      Geom_t4 ej =convert_Geom_t4(e[2*j+0]);
+      Geom_t4 enj=convert_Geom_t4(e[2*j+1]);
+      Geom_t inrijp1rij=ej.w;
+      ej.w=0.0f;
+      enj.w=0.0f;
+      
+      Geom_t theta = -sign(dot(nvg,cross(s[j],s[jp1])));
+      Geom_t aux_norm=ns[j]*ns[jp1];
+      
+      if(aux_norm!=0.0f)
+      {
+         Geom_t arg=dot(s[j],s[jp1])/aux_norm;
+         Geom_t aux;
+         
+         if      (fabs(arg-1.0f)<(Geom_t)1.0e-12) aux=0.0f;
+         else if (fabs(arg+1.0f)<(Geom_t)1.0e-12) aux=(Geom_t)3.1415926535897932385;
+         else                     aux=acos(clamp(arg,(Geom_t)-1.0,(Geom_t)1.0)); // rounding can leave arg slightly outside [-1,1]
+         theta*=aux;
+      }
+      
+      Geom_t Kij,a,b,c,dij,Iij;
+      
+      // NOTE: vsub_Rm_rij = -r[j]
+      Kij=-fabs(h)*theta;
+      a = nr[j]*inrijp1rij;
+      b = -dot(r[j],ej)*inrijp1rij*inrijp1rij;
+      c = h*inrijp1rij;
+      dij = -dot(r[j],enj);
+   
+      if(fabs(dij)>(Geom_t)1.0e-5)
+      {
+         Geom_t epa2m2b=(1.0f+a*a-2.0f*b);
+         Geom_t sepa2m2b=(epa2m2b<0.0f) ? 1.0f : sqrt(epa2m2b);
+#ifdef GEOM_SINGLE
+         // close to the edge line a*a-b*b-c*c, and on its extension beyond the edge also a-b and
+         // 1-b+sepa2m2b, cancel in single precision, they are computed from the squared distance to
+         // the line (in edge lengths) dist2 = a*a-b*b = sepa2m2b*sepa2m2b-(1-b)*(1-b) instead
+         Geom_t sa2mb2mc2=fabs(dij)*inrijp1rij;
+         Geom_t dist2=c*c+sa2mb2mc2*sa2mb2mc2;
+         Geom_t amb=(b>0.0f) ? dist2/(a+b) : a-b;
+         Geom_t ombpe=(b>1.0f) ? dist2/(sepa2m2b+b-1.0f) : 1.0f-b+sepa2m2b;
+#else
+         Geom_t a2mb2mc2=(a*a-b*b-c*c);
+         // a2mb2mc2 = (dij/l)^2 cancels to 0 at some points with |dij| > 1e-5, the divisions by its root then give NaN
+         Geom_t sa2mb2mc2=(a2mb2mc2<=0.0f) ? 1.0f : sqrt(a2mb2mc2);
+         Geom_t amb=a-b;
+         Geom_t ombpe=1.0f-b+sepa2m2b;
+#endif
+         
+         Iij=dij*((c*atan((b*c)/(a*sa2mb2mc2)))/sa2mb2mc2 + (c*atan(((1.0f - b)*c)/(sa2mb2mc2*sepa2m2b)))/sa2mb2mc2 + log(ombpe/amb));
+      } 
+      else
+         Iij=0.0f;  
+      IKsum+=Iij+Kij;
+   }
+   *phi+=0.5*hd*IKsum;
+   *g+=nv*(Real_t)IKsum;
+}
+
+/*
+Same field as integrate_eom, but all quantities that only depend on the mesh are
+read from tables prepared once on the host, see face_field_edges().
+
+planeIn[i]       : face normal nv (xyz), plane offset dot(nv,ri0) (w)
+edgeIn[2*(3*i+j)]  : edge rijp1-rij (xyz), 1/norm(rijp1-rij) (w)
+edgeIn[2*(3*i+j)+1]: cross(rijp1-rij,nv)/norm(rijp1-rij) (xyz), unused (w)
+*/
+__kernel void integrate_eom_edges( 
+__global Real_t4 *pold, 
+__global Real_t4 *vold, 
+__global Real_t4 *pnew, 
+__global Real_t4 *vnew, 
+__global int *activeIn,
+__global Real_t4 *planeIn,
+__global Real_t *rijIn,
+__global Real_t4 *edgeIn,
+int numpoints, 
+int numfaces, 
+Real_t dt,
+Real_t omega,
+Real_t gdens,
+Real_t tolerance, // ADAPTIVE_TOLERANCE
+int numsteps,
+__global Real_t *mpIn,
+int mporder,
+__global Real_t4 *gridIn,
+__global Real_t *gridParamIn,
+int gridlevels,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn,
+Real_t escape_radius, // see escape_test()
+Real_t escape_gm,
+int endstep,
+__global int4 *eventIdOut, // see log_impact()
+__global Real_t4 *eventOut,
+volatile __global int *eventCount,
+int maxevents
+)
+{ 
+   int a=get_global_id(0);
+   if(a>=numpoints) return;
+   int m=activeIn[a];
+
+   Real_t4 pos=pold[m];
+   Real_t4 vel=vold[m];
+   step_state s=step_begin(&pos, vel, dt, numsteps);
+   while(step_continue(vel, &s))
+   {
+      Real_t phi=0.0;
+      Real_t thetasum=0.0;
+      Real_t4 g=(Real_t4)(0.0,0.0,0.0,0.0);
+
+      Real_t4 Rm=pos;
+      // the multipole expansion or the gravity grid replace the sum over the faces where possible
+      int shortcut=field_shortcut(Rm, mpIn, mporder, gridIn, gridParamIn, gridlevels, &g, &thetasum);
+
+      for(int i=0;i<(shortcut ? 0 : numfaces);i++)
+      {
+         Real_t4 v[3];
+         Real_t4 e[6];
+         for(int j=0;j<3;j++)
+            v[j]=(Real_t4)(rijIn[(i*4+j)*3+0],rijIn[(i*4+j)*3+1],rijIn[(i*4+j)*3+2],0.0);
+         for(int j=0;j<6;j++)
+            e[j]=edgeIn[6*i+j];
+         face_field_edges(Rm, planeIn[i], v, e, &g, &phi, &thetasum);
+      }
+
+      step_update(g, thetasum, &pos, &vel, &s, omega, gdens, tolerance, bvhIn, bvhTriIn);
+   }  
+   step_end(&pos, vel, &s);
+   if (vel.w==1.0 && vold[m].w==0.0)
+      log_impact(m, pos, vel, s.time, dt, endstep-numsteps, eventIdOut, eventOut, eventCount, maxevents);
+   escape_test(&pos, &vel, omega, escape_radius, escape_gm, endstep);
+   pnew[m]=pos;
+   vnew[m]=vel;
+}
+
+/*
+Same field as integrate_eom_edges with a structure-of-arrays mesh layout,
+faces are processed in tiles that are cooperatively loaded into local memory
+by all work-items of a work-group (the number of faces per tile equals the
+work-group size).
+
+planeIn[i]            : face normal nv (xyz), plane offset dot(nv,ri0) (w)
+vertIn[j*numfaces+i]  : vertex j of face i (xyz)
+edgeIn[j*numfaces+i]  : edge table entry j (see face_field_edges()) of face i
+*/
+__kernel void integrate_eom_tiled( 
+__global Real_t4 *pold, 
+__global Real_t4 *vold, 
+__global Real_t4 *pnew, 
+__global Real_t4 *vnew, 
+__global int *activeIn,
+__global Real_t4 *planeIn,
+__global Real_t4 *vertIn,
+__global Real_t4 *edgeIn,
+__local Real_t4 *tileIn, // 10 * local work size
+int numpoints, 
+int numfaces, 
+Real_t dt,
+Real_t omega,
+Real_t gdens,
+Real_t tolerance, // ADAPTIVE_TOLERANCE
+int numsteps,
+__global Real_t *mpIn,
+int mporder,
+__global Real_t4 *gridIn,
+__global Real_t *gridParamIn,
+int gridlevels,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn,
+Real_t escape_radius, // see escape_test()
+Real_t escape_gm,
+int endstep,
+__global int4 *eventIdOut, // see log_impact()
+__global Real_t4 *eventOut,
+volatile __global int *eventCount,
+int maxevents
+)
+{ 
+   int a=get_global_id(0);
+   int lid=get_local_id(0);
+   int tile_size=get_local_size(0);
+
+   __local Real_t4 *tplane=tileIn;
+   __local Real_t4 *tvert=tileIn+tile_size;
+   __local Real_t4 *tedge=tileIn+4*tile_size;
+
+   // NOTE: work-items beyond numpoints take part in loading tiles, but are not propagated
+   int m=(a<numpoints) ? activeIn[a] : 0;
+   Real_t4 pos=(a<numpoints) ? pold[m] : (Real_t4)(0.0,0.0,0.0,0.0);
+   Real_t4 vel=(a<numpoints) ? vold[m] : (Real_t4)(0.0,0.0,0.0,1.0);
+
+   // NOTE: all work-items of a work-group iterate until the last one is done because of
+   // the barriers, busy is reset only after the barriers of the tiles (numfaces>0)
+   __local int busy;
+   step_state s=step_begin(&pos, vel, dt, numsteps);
+   for(;;)
+   {
+      if(lid==0) busy=0;
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if(step_continue(vel, &s)) busy=1;
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if(!busy) break;
+
+      Real_t phi=0.0;
+      Real_t thetasum=0.0;
+      Real_t4 g=(Real_t4)(0.0,0.0,0.0,0.0);
+
+      Real_t4 Rm=pos;
+      // the multipole expansion or the gravity grid replace the sum over the faces where possible,
+      // these particles take part in loading the tiles, but skip the faces
+      int shortcut=field_shortcut(Rm, mpIn, mporder, gridIn, gridParamIn, gridlevels, &g, &thetasum);
+
+      for(int tile=0;tile<numfaces;tile+=tile_size)
+      {
+         int i=tile+lid;
+         if(i<numfaces)
+         {
+            tplane[lid]=planeIn[i];
+            for(int j=0;j<3;j++)
+               tvert[j*tile_size+lid]=vertIn[j*numfaces+i];
+            for(int j=0;j<6;j++)
+               tedge[j*tile_size+lid]=edgeIn[j*numfaces+i];
+         }
+         barrier(CLK_LOCAL_MEM_FENCE);
+
+         int tile_faces=shortcut ? 0 : min(tile_size,numfaces-tile);
+         for(int k=0;k<tile_faces;k++)
+         {
+            Real_t4 v[3];
+            Real_t4 e[6];
+            for(int j=0;j<3;j++)
+               v[j]=tvert[j*tile_size+k];
+            for(int j=0;j<6;j++)
+               e[j]=tedge[j*tile_size+k];
+            face_field_edges(Rm, tplane[k], v, e, &g, &phi, &thetasum);
+         }
+         barrier(CLK_LOCAL_MEM_FENCE);
+      }
+
+      if(step_continue(vel, &s))
+         step_update(g, thetasum, &pos, &vel, &s, omega, gdens, tolerance, bvhIn, bvhTriIn);
+   }  
+   if(a>=numpoints) return; // the placeholder state must not overwrite particle 0
+   step_end(&pos, vel, &s);
+   if (vel.w==1.0 && vold[m].w==0.0)
+      log_impact(m, pos, vel, s.time, dt, endstep-numsteps, eventIdOut, eventOut, eventCount, maxevents);
+   escape_test(&pos, &vel, omega, escape_radius, escape_gm, endstep);
+   pnew[m]=pos;
+   vnew[m]=vel;
+}
+
+/*
+Shared-edge formulation of the same field for closed meshes, see
+
+Werner, R. A., & Scheeres, D. J. (1997). Exterior gravitation of a polyhedron
+derived and compared with harmonic and mascon gravitation representations of
+asteroid 4769 Castalia. Celestial Mechanics and Dynamical Astronomy, 65(3), 313–344.
+
+The edge terms of the two faces adjacent to an edge are combined into the
+dyad E_e = nA*nA_e^T + nB*nB_e^T (prepared on the host, see
+prepare_shared_edges()), so the log term is evaluated once per unique edge.
+The remaining face terms only need the per-face solid angle, which is already
+computed for the inside/outside test.
+
+planeIn[i]         : face normal nv (xyz), plane offset dot(nv,ri0) (w)
+sedgeIn[5*k+0]     : first edge vertex (xyz), edge length (w)
+sedgeIn[5*k+1]     : second edge vertex (xyz), unused (w)
+sedgeIn[5*k+2..4]  : rows of E_e (xyz), unused (w)
+*/
+__kernel void integrate_eom_shared_edges( 
+__global Real_t4 *pold, 
+__global Real_t4 *vold, 
+__global Real_t4 *pnew, 
+__global Real_t4 *vnew, 
+__global int *activeIn,
+__global Real_t4 *planeIn,
+__global Real_t *rijIn,
+__global Real_t4 *sedgeIn,
+int numpoints, 
+int numfaces, 
+int numedges,
+Real_t dt,
+Real_t omega,
+Real_t gdens,
+Real_t tolerance, // ADAPTIVE_TOLERANCE
+int numsteps,
+__global Real_t *mpIn,
+int mporder,
+__global Real_t4 *gridIn,
+__global Real_t *gridParamIn,
+int gridlevels,
+__global Real_t4 *bvhIn,
+__global Real_t4 *bvhTriIn,
+Real_t escape_radius, // see escape_test()
+Real_t escape_gm,
+int endstep,
+__global int4 *eventIdOut, // see log_impact()
+__global Real_t4 *eventOut,
+volatile __global int *eventCount,
+int maxevents
+)
+{ 
+   int a=get_global_id(0);
+   if(a>=numpoints) return;
+   int m=activeIn[a];
+
+   Real_t4 pos=pold[m];
+   Real_t4 vel=vold[m];
+   step_state s=step_begin(&pos, vel, dt, numsteps);
+   while(step_continue(vel, &s))
+   {
+      Real_t phi=0.0;
+      Real_t thetasum=0.0;
+      Real_t4 g=(Real_t4)(0.0,0.0,0.0,0.0);
+
+      Real_t4 Rm=pos;
+      // the multipole expansion or the gravity grid replace the sums over the faces and edges where possible
+      int shortcut=field_shortcut(Rm, mpIn, mporder, gridIn, gridParamIn, gridlevels, &g, &thetasum);
+
+      // face terms: solid angle omega_f and F_f*r_f = nv*dot(nv,r_f)
+      for(int i=0;i<(shortcut ? 0 : numfaces);i++)
       {
-         g*=gdens;
-         g.x+=(+2.0*omega*vold[m].y+pold[m].x*omega*omega);
-         g.y+=(-2.0*omega*vold[m].x+pold[m].y*omega*omega);
-         vnew[m]=vold[m]+g*dt;
-         pnew[m]=pold[m]+vnew[m]*dt+g*dt*dt*0.5;
+         Real_t4 nv=planeIn[i];
+         Real_t nr_f=nv.w-dot(nv,Rm); // = dot(nv,rij-Rm) for all vertices of the face
+         nv.w=0.0;
+
+         Real_t4 r1=(Real_t4)(
+                     rijIn[(i*4+0  )*3+0]-Rm.x,
+                     rijIn[(i*4+0  )*3+1]-Rm.y,
+                     rijIn[(i*4+0  )*3+2]-Rm.z,
+                     0.0);
+         Real_t4 r2=(Real_t4)(
+                     rijIn[(i*4+1  )*3+0]-Rm.x,
+                     rijIn[(i*4+1  )*3+1]-Rm.y,
+                     rijIn[(i*4+1  )*3+2]-Rm.z,
+                     0.0);
+         Real_t4 r3=(Real_t4)(
+                     rijIn[(i*4+2  )*3+0]-Rm.x,
+                     rijIn[(i*4+2  )*3+1]-Rm.y,
+                     rijIn[(i*4+2  )*3+2]-Rm.z,
+                     0.0);
+         Real_t nr1,nr2,nr3;
+         nr1=norm(r1);
+         nr2=norm(r2);
+         nr3=norm(r3);
+         // NOTE: dot(r1,cross(r2,r3)) = dot(r1,cross(r2-r1,r3-r1)), the latter avoids cancellation far away
+         Real_t4 e12=(Real_t4)(
+                     rijIn[(i*4+1  )*3+0]-rijIn[(i*4+0  )*3+0],
+                     rijIn[(i*4+1  )*3+1]-rijIn[(i*4+0  )*3+1],
+                     rijIn[(i*4+1  )*3+2]-rijIn[(i*4+0  )*3+2],
+                     0.0);
+         Real_t4 e13=(Real_t4)(
+                     rijIn[(i*4+2  )*3+0]-rijIn[(i*4+0  )*3+0],
+                     rijIn[(i*4+2  )*3+1]-rijIn[(i*4+0  )*3+1],
+                     rijIn[(i*4+2  )*3+2]-rijIn[(i*4+0  )*3+2],
+                     0.0);
+         // solid angle, also used to determine if position is inside the comet or outside
+         Real_t omega_f=2.0*atan2(
+                    dot(r1,cross(e12,e13)),
+                    nr1*nr2*nr3
+                    +dot(r1,r2)*nr3
+                    +dot(r1,r3)*nr2
+                    +dot(r2,r3)*nr1
+                    );
+         thetasum+=omega_f;
+         phi-=0.5*nr_f*nr_f*omega_f;
+         g+=nv*(nr_f*omega_f);
       }
-      else // we re-collided with the comet, do not update position, but mask vel.w as a hit (1.0)
+
+      // edge terms: E_e*r_e*L_e
+      for(int k=0;k<(shortcut ? 0 : numedges);k++)
       {
-         vnew[m]=vold[m];
-         vnew[m].w=1.0;
-         pnew[m]=pold[m];
+         Real_t4 ri=sedgeIn[5*k+0];
+         Real_t4 rj=sedgeIn[5*k+1];
+         Real_t len=ri.w;
+         ri-=Rm;
+         rj-=Rm;
+         ri.w=0.0;
+         rj.w=0.0;
+
+         Real_t nri_nrj=norm(ri)+norm(rj);
+         if(nri_nrj-len>0.0)
+         {
+            Real_t Le=log((nri_nrj+len)/(nri_nrj-len));
+            Real_t4 Er=(Real_t4)(
+                        dot(sedgeIn[5*k+2],ri),
+                        dot(sedgeIn[5*k+3],ri),
+                        dot(sedgeIn[5*k+4],ri),
+                        0.0);
+            phi+=0.5*dot(ri,Er)*Le;
+            g-=Er*Le;
+         }
       }
+
+      step_update(g, thetasum, &pos, &vel, &s, omega, gdens, tolerance, bvhIn, bvhTriIn);
    }  
+   step_end(&pos, vel, &s);
+   if (vel.w==1.0 && vold[m].w==0.0)
+      log_impact(m, pos, vel, s.time, dt, endstep-numsteps, eventIdOut, eventOut, eventCount, maxevents);
+   escape_test(&pos, &vel, omega, escape_radius, escape_gm, endstep);
+   pnew[m]=pos;
+   vnew[m]=vel;
+}
+
+/*
+Conservation diagnostics of the current state (JACOBI_REPORT, JACOBI_OUTPUT),
+in two passes:
+
+diagnostics       : potential and Jacobi constant (energy per mass in the
+                    rotating frame) of the particles 0..numpoints-1, with the
+                    exact field of face_field_edges() (the shortcuts have no
+                    potential), diagOut[m]: potential, Jacobi constant, drift
+                    from jacobiRefIn[m], status (vel.w); the drift of the
+                    active particles of each work-group is reduced into
+                    blockOut (min, max, sum, sum of the absolute values) and
+                    countOut
+diagnostics_reduce: reduces blockOut, countOut in a single work-group,
+                    blockOut[numblocks], countOut[numblocks] is the result
+*/
+void drift_combine(Real_t4 *a, int *na, Real_t4 b, int nb)
+{
+   if(nb==0) return;
+   if(*na==0)
+      *a=b;
+   else
+      *a=(Real_t4)(fmin((*a).x,b.x),fmax((*a).y,b.y),(*a).z+b.z,(*a).w+b.w);
+   *na+=nb;
+}
+
+void drift_reduce(__local Real_t4 *sum, __local int *count)
+{
+   int lid=get_local_id(0);
+   int wg=get_local_size(0);
+   for(int d=1;d<wg;d*=2)
+   {
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if(lid%(2*d)==0 && lid+d<wg)
+      {
+         Real_t4 a=sum[lid];
+         int na=count[lid];
+         drift_combine(&a, &na, sum[lid+d], count[lid+d]);
+         sum[lid]=a;
+         count[lid]=na;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+__kernel void diagnostics(
+__global Real_t4 *pIn,
+__global Real_t4 *vIn,
+__global Real_t *jacobiRefIn,
+__global Real_t4 *planeIn,
+__global Real_t *rijIn,
+__global Real_t4 *edgeIn,
+int numpoints,
+int numfaces,
+Real_t omega,
+Real_t gdens,
+__global Real_t4 *diagOut,
+__global Real_t4 *blockOut,
+__global int *countOut,
+__local Real_t4 *sum,  // local work size
+__local int *count     // local work size
+)
+{
+   int m=get_global_id(0);
+   int lid=get_local_id(0);
+   sum[lid]=(Real_t4)(0.0);
+   count[lid]=0;
+   if(m<numpoints)
+   {
+      Real_t4 pos=pIn[m];
+      Real_t4 vel=vIn[m];
+      Real_t phi=0.0;
+      Real_t thetasum=0.0;
+      Real_t4 g=(Real_t4)(0.0,0.0,0.0,0.0);
+      Real_t4 Rm=(Real_t4)(pos.x,pos.y,pos.z,0.0);
+      for(int i=0;i<numfaces;i++)
+      {
+         Real_t4 v[3];
+         Real_t4 e[6];
+         for(int j=0;j<3;j++)
+            v[j]=(Real_t4)(rijIn[(i*4+j)*3+0],rijIn[(i*4+j)*3+1],rijIn[(i*4+j)*3+2],0.0);
+         for(int j=0;j<6;j++)
+            e[j]=edgeIn[6*i+j];
+         face_field_edges(Rm, planeIn[i], v, e, &g, &phi, &thetasum);
+      }
+      // the field is the gradient of phi (without G*density)
+      Real_t potential=-gdens*phi;
+      Real_t jacobi=0.5*(vel.x*vel.x+vel.y*vel.y+vel.z*vel.z)-0.5*omega*omega*(pos.x*pos.x+pos.y*pos.y)+potential;
+      Real_t drift=jacobi-jacobiRefIn[m];
+      diagOut[m]=(Real_t4)(potential,jacobi,drift,vel.w);
+      if(vel.w==0.0) // re-collided particles are not integrated anymore
+      {
+         sum[lid]=(Real_t4)(drift,drift,drift,fabs(drift));
+         count[lid]=1;
+      }
+   }
+   drift_reduce(sum, count);
+   if(lid==0)
+   {
+      blockOut[get_group_id(0)]=sum[0];
+      countOut[get_group_id(0)]=count[0];
+   }
+}
+
+__kernel void diagnostics_reduce(
+__global Real_t4 *blockOut,
+__global int *countOut,
+__local Real_t4 *sum,  // local work size
+__local int *count,    // local work size
+int numblocks
+)
+{
+   int lid=get_local_id(0);
+   int wg=get_local_size(0);
+   Real_t4 a=(Real_t4)(0.0);
+   int na=0;
+   for(int b=lid;b<numblocks;b+=wg)
+      drift_combine(&a, &na, blockOut[b], countOut[b]);
+   sum[lid]=a;
+   count[lid]=na;
+   drift_reduce(sum, count);
+   if(lid==0)
+   {
+      blockOut[numblocks]=sum[0];
+      countOut[numblocks]=count[0];
+   }
+}
+
+/*
+Stream compaction of the active particle list, removes re-collided particles
+(vel.w != 0.0) in three passes:
+
+compact_scan       : exclusive prefix sum of the live flags per work-group
+                     (offsetOut, -1 for removed particles) and the number of
+                     live particles of each work-group (blockOut)
+compact_scan_blocks: exclusive prefix sum over blockOut in a single
+                     work-group, blockOut[numblocks] is the new active count
+compact_scatter    : writes the live particle indices to activeOut
+
+Removed particles are not propagated anymore, compact_scan copies their state
+into the other buffer of the double buffering scheme (pdst, vdst), so that
+both buffers stay valid.
+*/
+__kernel void compact_scan(
+__global Real_t4 *pcur, 
+__global Real_t4 *vcur, 
+__global Real_t4 *pdst, 
+__global Real_t4 *vdst, 
+__global int *activeIn,
+__global int *offsetOut,
+__global int *blockOut,
+__local int *scan, // local work size
+int numpoints
+)
+{
+   int a=get_global_id(0);
+   int lid=get_local_id(0);
+   int wg=get_local_size(0);
+
+   int live=0;
+   if(a<numpoints)
+   {
+      int m=activeIn[a];
+      live=(vcur[m].w==0.0) ? 1 : 0;
+      if(!live)
+      {
+         pdst[m]=pcur[m];
+         vdst[m]=vcur[m];
+      }
+   }
+
+   // inclusive Hillis-Steele scan in local memory
+   scan[lid]=live;
+   barrier(CLK_LOCAL_MEM_FENCE);
+   for(int d=1;d<wg;d*=2)
+   {
+      int x=(lid>=d) ? scan[lid-d] : 0;
+      barrier(CLK_LOCAL_MEM_FENCE);
+      scan[lid]+=x;
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   if(a<numpoints)
+      offsetOut[a]=live ? scan[lid]-1 : -1;
+   if(lid==wg-1)
+      blockOut[get_group_id(0)]=scan[lid];
+}
+
+__kernel void compact_scan_blocks(
+__global int *blockOut,
+__local int *scan, // local work size
+int numblocks
+)
+{
+   int lid=get_local_id(0);
+   int wg=get_local_size(0);
+   int total=0;
+
+   for(int chunk=0;chunk<numblocks;chunk+=wg)
+   {
+      int b=chunk+lid;
+      int count=(b<numblocks) ? blockOut[b] : 0;
+      scan[lid]=count;
+      barrier(CLK_LOCAL_MEM_FENCE);
+      for(int d=1;d<wg;d*=2)
+      {
+         int x=(lid>=d) ? scan[lid-d] : 0;
+         barrier(CLK_LOCAL_MEM_FENCE);
+         scan[lid]+=x;
+         barrier(CLK_LOCAL_MEM_FENCE);
+      }
+      if(b<numblocks)
+         blockOut[b]=total+scan[lid]-count;
+      total+=scan[wg-1];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   if(lid==0)
+      blockOut[numblocks]=total;
+}
+
+__kernel void compact_scatter(
+__global int *activeIn,
+__global int *offsetIn,
+__global int *blockIn,
+__global int *activeOut,
+int numpoints
+)
+{
+   int a=get_global_id(0);
+   if(a>=numpoints) return;
+
+   int offset=offsetIn[a];
+   if(offset>=0)
+      activeOut[blockIn[get_group_id(0)]+offset]=activeIn[a];
 }
@@ -0,0 +1,94 @@
+// Copyright (c) 2015 Tobias Kramer <tobias.kramer@mytum.de>
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/* 
+Triangular mesh of the body loaded from an OBJ file, together with the derived
+quantities used by the gravity computation (normals, vertices, face planes,
+edge tables) and the collision test (bounding volume hierarchy). Which tables
+are prepared depends on GRAVITY_KERNEL, COLLISION_TEST and BACKEND.
+
+The bounding volume hierarchy (COLLISION_TEST=bvh) splits the faces at the
+median centroid along the longest axis until at most BVH_LEAF_SIZE faces are
+left. Nodes are stored depth-first, the left child directly follows its parent:
+hbvh[8*n..]  : lower corner (xyz), first face in hbvhtri (leaf) or right child (w)
+hbvh[8*n+4..]: upper corner (xyz), number of faces (leaf) or 0 (w)
+hbvhtri[12*k..]: vertex 0 (xyz), face index (w), edges v1-v0 and v2-v0 (xyz, w unused)
+
+The prepared tables can be stored in a compiled mesh cache next to the OBJ file
+(67p.obj -> 67p.cmesh), see MESH_CACHE. The cache holds all tables and is keyed
+by size, modification time and hash of the OBJ file. A valid cache is mapped
+into memory instead of parsing the OBJ file, the tables point into the mapping.
+*/
+
+#ifndef BodyMesh_h
+#define BodyMesh_h
+
+#include <cstddef>
+#include <string>
+
+#include "ComputeConfig.h"
+
+#define Real_t double
+
+#define BVH_LEAF_SIZE 4
+#define BVH_STACK_SIZE 32 // max. depth of the hierarchy, see bvh_intersect() in integrate_eom_kernel.cl
+
+class BodyMesh {
+
+public:
+	BodyMesh() {}
+	~BodyMesh();
+	void Load(const ComputeConfig& config);
+	// prepare all tables from the OBJ file and (re)write the mesh cache
+	void BuildCache(const ComputeConfig& config);
+	static std::string CacheFilename(const std::string& obj_file, const char* extension = ".cmesh");
+
+	Real_t *hnv = nullptr;      // normal vectors
+	Real_t *hrij = nullptr;     // 4 vertices per triangle, last=copy of first vertex
+	Real_t *hcm = nullptr;      // center of triangle
+	Real_t *hplane = nullptr;   // face planes, see prepare_edges()
+	Real_t *hedge = nullptr;    // edge table, see prepare_edges()
+	Real_t *hsedge = nullptr;   // unique edges and their dyads, see prepare_shared_edges()
+	Real_t *hvert = nullptr;    // SoA vertices, see prepare_soa()
+	Real_t *hedgesoa = nullptr; // SoA edge table, see prepare_soa()
+	Real_t *hbvh = nullptr;     // bounding volume hierarchy nodes, see above
+	Real_t *hbvhtri = nullptr;  // faces in the order of the leaves
+
+	int NUM_FACES = 0;
+	int NUM_VERTICES_PER_FACE = 0;
+	int NUM_EDGES = 0;
+	int NUM_BVH_NODES = 0;
+
+	// first intersection of the segment p0 -> p1 (xyz) with the surface, returns false if there is none,
+	// otherwise its parameter t in [0,1] and the face index, see bvh_intersect() in integrate_eom_kernel.cl
+	bool IntersectSegment(const Real_t* p0, const Real_t* p1, Real_t* t, int* face) const;
+	// volume of the closed mesh (m^3), the mass of the body is COMET_DENSITY times it
+	double Volume() const;
+
+	BodyMesh(const BodyMesh&) = delete;
+	BodyMesh& operator=(const BodyMesh&) = delete;
+
+	// table bits, see RequiredTables()
+	enum Table : unsigned {
+		TABLE_GRAVITY      = 1, // hnv, hcm, hrij
+		TABLE_EDGES        = 2, // hplane, hedge
+		TABLE_SOA          = 4, // hvert, hedgesoa
+		TABLE_SHARED_EDGES = 8, // hsedge
+		TABLE_BVH          = 16, // hbvh, hbvhtri
+		TABLE_ALL          = 31
+	};
+
+private:
+	static unsigned RequiredTables(const ComputeConfig& config);
+	void LoadObj(const std::string& obj_file, unsigned prepare, unsigned required);
+	bool LoadCache(const std::string& obj_file, unsigned required);
+	bool WriteCache(const std::string& obj_file);
+
+	unsigned tables = 0;        // prepared tables
+	void *mapping = nullptr;    // mapped mesh cache, owns the tables if set
+	size_t mapping_size = 0;
+};
+
+#endif // BodyMesh_h 
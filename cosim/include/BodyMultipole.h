@@ -0,0 +1,65 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/*
+Far-field multipole expansion of the gravity of the homogeneous body, used for
+particles beyond MULTIPOLE_RADIUS body radii from the centre of mass instead of
+the exact sum over all faces (see MULTIPOLE_ORDER).
+
+The body radius is the radius of the sphere around the centre of mass that
+encloses all vertices, outside of it 1/|r-r'| is expanded into the regular
+(R_n^m) and irregular (I_n^m) solid harmonics
+
+1/|r-r'| = sum_n sum_{m=-n}^{n} conj(R_n^m(r')) I_n^m(r)
+R_n^m(r) = r^n P_n^m(cos theta) exp(i m phi) / (n+m)!
+I_n^m(r) = (n-m)! P_n^m(cos theta) exp(i m phi) / r^(n+1)
+
+The moments M_n^m = int conj(R_n^m(r')) dV' of the polyhedron are integrated
+exactly with a Gauss rule over the tetrahedra spanned by the centre and the
+faces. The derivatives of I_n^m are combinations of I_(n+1)^(m-1), I_(n+1)^m and
+I_(n+1)^(m+1), so the field (in units of G*density like in the kernels) is
+
+g = sum_{n=1}^{order+1} sum_{m=0}^{n} Re(G_n^m I_n^m)
+
+with complex coefficients G_n^m for each component prepared from the moments.
+
+getCoefficients() layout (uploaded to the devices as is):
+[0..2]: centre of mass, [3]: 1/body radius, [4]: switching radius^2, [5..7]: unused
+[8+6*(n*(n+1)/2-1+m) ...]: Re, Im of G_n^m for x, y, z
+*/
+
+#ifndef BodyMultipole_h
+#define BodyMultipole_h
+
+#include <vector>
+
+#include "BodyMesh.h"
+
+class BodyMultipole {
+
+public:
+	BodyMultipole() {}
+	// expansion up to degree order, used beyond radius body radii
+	void Compute(const BodyMesh& mesh, int order, double radius);
+
+	bool isEnabled() const { return order >= 0; }
+	int getOrder() const { return order; }
+	double getBodyRadius() const { return body_radius; }
+	double getRadius() const { return radius; } // switching radius in m
+	const Real_t* getCentre() const { return coefficients.data(); }
+	const std::vector<Real_t>& getCoefficients() const { return coefficients; }
+
+	// pos: position (xyz), true if the expansion is used there
+	bool isFar(const Real_t* pos) const;
+	// field at pos (xyz) into g (xyz), see multipole_field() in integrate_eom_kernel.cl
+	void Field(const Real_t* pos, Real_t* g) const;
+
+private:
+	int order = -1; // -1: disabled
+	double body_radius = 0.0;
+	double radius = 0.0;
+	std::vector<Real_t> coefficients;
+};
+
+#endif // BodyMultipole_h
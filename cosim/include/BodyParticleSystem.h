@@ -13,13 +13,17 @@ by triangular mesh cells. Assumes vertices given in meters with
 #ifndef BodyParticleSystem_h
 #define BodyParticleSystem_h
 
-#include <CL/cl.hpp>
 #include <cstdlib>
+#include <string>
+#include <vector>
 
+#include "BodyMesh.h"
+#include "BodyMultipole.h"
+#include "ComputeBackend.h"
 #include "ComputeConfig.h"
-#include "ham/util/time.hpp"
-
-#define Real_t double
+#include "GravityGrid.h"
+#include "ShardedOutput.h"
+#include "SnapshotWriter.h"
 
 class BodyParticleSystem {
 
@@ -27,42 +31,41 @@ public:
 	BodyParticleSystem(ComputeConfig& config);
 	~BodyParticleSystem();
 	void RunSimulation();
+	// one simulation per combination of the values in sweepFilename, see README
+	void RunSweep(const std::string& sweepFilename);
 
 private:
+	// mesh, field tables and backend
 	void Initialize();
-	void InitializeOpenCL();
-	void PropagateStep();
-	void PutParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew );
-	void GetParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew );
-	void WriteState(const std::string& pathPrefix, int it);
+	// initial particle state (or the one of the checkpoint of a restart) in hposold, hvelold
+	void InitialState();
+	// runs the simulation from the initial state, output into directory pathPrefix
+	void Propagate(const std::string& pathPrefix);
+	void WriteState(int it);
+	// impacts collected by the backend since the previous call to the impact log, IMPACT_LOG
+	void LogImpacts();
+	// max. relative error of the multipole expansion at pos (4 values per position), MULTIPOLE_VALIDATION
+	void ValidateMultipole(const std::vector<Real_t>& pos, const char* where);
+	// per-particle divergence of backend and reference, PRECISION_VALIDATION
+	void ValidatePrecision(int it);
+	// Jacobi constants of the start of the run as the reference of the drift, JACOBI_REPORT, JACOBI_OUTPUT
+	void ResetJacobi();
+	// drift of the Jacobi constants of the active particles since the start of the run, computed by the backend
+	void ReportJacobi(int it);
 
 	ComputeConfig& config;
-	size_t step_counter = 0;
-	ham::util::time::statistics stats;
-
-	cl::Context      context;
-	cl::CommandQueue queue;
-	cl::Kernel       kernel_eom;
-	cl::Program      program_eom;
-
-	cl::Buffer gposold; // compute device: positions
-	cl::Buffer gvelold; // compute device: velocities
-	cl::Buffer gposnew; // compute device: store temp positions
-	cl::Buffer gvelnew; // compute device: store temp velocities
-	cl::Buffer gnv;
-	cl::Buffer grij;
-
-	Real_t *hposold;
-	Real_t *hvelold;
-	Real_t *hposnew;
-	Real_t *hvelnew;
-
-	Real_t *hnv;
-	Real_t *hrij;
-	Real_t *hcm;
+	BodyMesh mesh;
+	BodyMultipole multipole;
+	GravityGrid grid;
+	ComputeBackend* backend = nullptr;
+	ComputeBackend* reference = nullptr; // double precision CPU backend of PRECISION_VALIDATION
+	SnapshotWriter* writer = nullptr; // asynchronous output, uses the backend
+	ShardedOutput output; // output files, split by rank in a distributed run
+	int first_particle = 0; // global index of the first particle of this rank
+	int start_step = 0; // step of the checkpoint of a restart
 
-	int NUM_FACES;
-	int NUM_VERTICES_PER_FACE;
+	Real_t *hposold = nullptr;
+	Real_t *hvelold = nullptr;
 };
 
 #endif // BodyParticleSystem_h 
@@ -0,0 +1,74 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/*
+Checkpoints of the exact simulation state (CHECKPOINT_STEP_COUNT), written as
+checkpoint.bin into the output directory (checkpoint.bin.NNNN for rank NNNN
+of a distributed run) and continued with "cosim --restart <checkpoint.bin>".
+
+A checkpoint consists of a fixed size header followed by the positions and
+velocities (4 values per particle each, sizeof(Real_t) bytes per value) of
+the particles of the rank, in the byte order of the writing machine. The
+header holds keys of the configuration values that determine the trajectories
+and of the mesh, a restart with a different configuration or mesh is refused.
+STEP_COUNT, the output, backend and device settings may change.
+
+Checkpoints are written to a temporary file that replaces the previous
+checkpoint only when complete, so a preempted run always leaves a valid one.
+*/
+
+#ifndef Checkpoint_h
+#define Checkpoint_h
+
+#include <cstdint>
+#include <string>
+
+#include "BodyMesh.h"
+#include "ComputeConfig.h"
+
+namespace checkpoint {
+
+const char MAGIC[8] = { 'C', 'O', 'S', 'I', 'M', 'C', 'H', 'K' };
+const uint32_t VERSION = 1;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t real_size;      // bytes per value
+	int32_t rank;
+	int32_t rank_count;
+	uint32_t reserved;
+	int64_t step;            // completed steps
+	int64_t first_particle;  // global index of the first particle of the rank
+	int64_t particle_count;  // particles of the rank
+	uint64_t config_key;     // see ConfigKey()
+	uint64_t mesh_key;       // see MeshKey()
+	char padding[8];
+};
+
+static_assert(sizeof(Header) == 80, "checkpoint header layout changed");
+
+// FNV-1a of the configuration values that determine the trajectories
+uint64_t ConfigKey(const ComputeConfig& config);
+// FNV-1a of the face vertices
+uint64_t MeshKey(const BodyMesh& mesh);
+
+// header of the particles of this rank after step
+Header MakeHeader(const ComputeConfig& config, const BodyMesh& mesh, int first_particle, int step);
+
+// checkpoint file of rank from the name of the one of a single process run
+std::string Filename(const std::string& filename, int rank, int rank_count);
+
+// writes header and state (4*header.particle_count values each) to filename atomically
+bool Write(const std::string& filename, const Header& header, const Real_t* pos, const Real_t* vel);
+// reads a checkpoint that matches header (see MakeHeader(), except the step), sets header.step
+// and fills pos and vel, exits on a mismatch
+void Read(const std::string& filename, Header& header, Real_t* pos, Real_t* vel);
+
+} // namespace checkpoint
+
+#endif // Checkpoint_h
@@ -0,0 +1,106 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/* 
+Interface of the devices the particles are propagated on, selected via the
+BACKEND config key. A backend holds the particle state in its own memory,
+PutParticles() and GetParticles() transfer it from and to the host.
+*/
+
+#ifndef ComputeBackend_h
+#define ComputeBackend_h
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "BodyMesh.h"
+#include "BodyMultipole.h"
+#include "ComputeConfig.h"
+#include "GravityGrid.h"
+#include "ham/util/time.hpp"
+
+// drift of the Jacobi constant of the active particles from their reference, see ComputeBackend::Diagnostics()
+struct JacobiDrift
+{
+	double min = 0.0, max = 0.0; // m^2/s^2
+	double sum = 0.0, sum_abs = 0.0; // of the drift and of its absolute value
+	int count = 0; // active particles
+};
+
+// impact of a re-colliding particle on the surface (IMPACT_LOG), see ComputeBackend::GetImpacts()
+struct ImpactEvent
+{
+	int particle; // index in the particles of the backend
+	int face; // hit face with COLLISION_TEST=bvh, -1 otherwise
+	int step; // during which the particle hit
+	Real_t time; // of the impact since the start of the step in s, interpolated with COLLISION_TEST=bvh
+	Real_t pos[3], vel[3]; // at the impact
+};
+
+class ComputeBackend {
+
+public:
+	ComputeBackend(ComputeConfig& config, const BodyMesh& mesh, const BodyMultipole& multipole, const GravityGrid& grid)
+		: config(config), mesh(mesh), multipole(multipole), grid(grid), stats(config.step_count) {}
+	virtual ~ComputeBackend() {}
+
+	// set up the device and transfer the mesh, called once after the mesh is loaded
+	virtual void Initialize() = 0;
+	// count integration steps of DELTA_T for all active particles, in launches of up to STEPS_PER_LAUNCH steps
+	virtual void PropagateSteps(int count) = 0;
+	// waits for steps still running on the device, their runtime is in getStatistics() afterwards
+	virtual void Synchronize() {}
+	// remove re-collided particles from the active particle list, they are not propagated anymore
+	virtual void CompactParticles() = 0;
+	// DELTA_T, COMET_ANGULAR_FREQUENCY or COMET_DENSITY changed, e.g. between the variants of a sweep
+	virtual void UpdateParameters() {}
+	// step of the current state, advanced by PropagateSteps(), e.g. the step of the checkpoint of a restart
+	virtual void SetStep(int s) { step = s; }
+	// PutParticles() resets the active particle list to all of the NumBodies particles that did not re-collide (vel.w == 0)
+	virtual void PutParticles(int NumBodies, Real_t *pos, Real_t *vel) = 0;
+	virtual void GetParticles(int NumBodies, Real_t *pos, Real_t *vel) = 0;
+	// reference Jacobi constants of the drift in Diagnostics(), one per particle, 0 until set
+	virtual void PutJacobiReference(int NumBodies, const Real_t *jacobi) = 0;
+	// potential and Jacobi constant (energy per mass in the rotating frame, m^2/s^2) of the current state of the
+	// NumBodies particles, computed with the exact field where the particles are, returns the drift of the active
+	// particles; diag (optional, 4 values per particle) receives potential, Jacobi constant, drift and status (vel.w)
+	virtual JacobiDrift Diagnostics(int NumBodies, Real_t *diag) = 0;
+	// appends the impacts since PutParticles() or the previous call to events (IMPACT_LOG), recorded by the
+	// propagation into an append buffer of the backend, a particle impacts once at most
+	virtual void GetImpacts(std::vector<ImpactEvent>& events) = 0;
+
+	// host memory for particle transfers, see SnapshotWriter
+	virtual Real_t* AllocHostBuffer(size_t count) { return new Real_t[count]; }
+	virtual void FreeHostBuffer(Real_t *ptr) { delete[] ptr; }
+	// non-blocking GetParticles(), done is called (possibly from another thread) once pos and vel are valid,
+	// backends without asynchronous transfers copy synchronously
+	virtual void GetParticlesAsync(int NumBodies, Real_t *pos, Real_t *vel, std::function<void()> done)
+	{
+		GetParticles(NumBodies, pos, vel);
+		done();
+	}
+	// used in the output
+	virtual const char* getName() const = 0;
+
+	// runtime per integration step, complete after Synchronize()
+	const ham::util::time::statistics& getStatistics() const { return stats; }
+	// number of particles that are still propagated
+	int getActiveCount() const { return active_count; }
+
+protected:
+	// radius of the escape test (0: none) and G*mass of its energy criterion (0: distance criterion), see ESCAPE_CRITERION
+	double EscapeRadius() const { return (config.escape_criterion != "off") ? config.escape_radius : 0.0; }
+	double EscapeGM() const { return (config.escape_criterion == "energy") ? config.const_gravity * config.comet_density * mesh.Volume() : 0.0; }
+
+	ComputeConfig& config;
+	const BodyMesh& mesh;
+	const BodyMultipole& multipole; // far-field expansion, if enabled
+	const GravityGrid& grid; // near-field grid, if enabled
+	ham::util::time::statistics stats;
+	int active_count = 0;
+	int step = 0; // of the current state, escaped particles record it (see ESCAPE_CRITERION)
+};
+
+#endif // ComputeBackend_h 
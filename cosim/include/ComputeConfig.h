@@ -9,29 +9,64 @@
 
 #include <string>
 #include <ostream>
+#include <utility>
+#include <vector>
 
 class ComputeConfig
 {
 public:
-	ComputeConfig(ConfigParser& configParser);
+	ComputeConfig(const ConfigParser& configParser);
 	const ConfigParser& getConfigParser() const;
-	void read(ConfigParser& configParser);
+	void read(const ConfigParser& configParser);
 	// to print to ostream
 	void write(std::ostream& stream);
 	void write(std::string& filename);
 
+	std::string backend; // opencl (default), cpu
+	int cpu_thread_count; // 0: number of hardware threads
 	int opencl_platform_id;
 	int opencl_device_id;
+	std::string opencl_devices; // platform:device,... to split the particles over several devices, see MultiDeviceBackend
+	std::vector<std::pair<int, int>> opencl_device_list; // parsed opencl_devices
+	double opencl_rebalance; // split the particles again if the slowest device needs this factor more than a perfect split, 0: never
+	int opencl_work_group_size; // 0: implementation defined
+	std::string opencl_program_cache; // directory of compiled programs, off: always compile the kernel source
 	int step_count;
 	int output_step_count;
+	std::string output_format; // text (default), binary
+	int output_ring_depth; // snapshots in flight before the propagation waits for the output
+	int steps_per_launch; // 0: all steps up to the next output or compaction
+	int compaction_step_count; // 0: never remove re-collided particles from the active list
+	int checkpoint_step_count; // 0: no checkpoints, see Checkpoint.h
 	//std::string output_path;
 	std::string comet_obj_file;
+	std::string mesh_cache; // read (default): use a valid mesh cache, auto: also (re)write it, off
 	double comet_density; // kg/m³
 	double comet_angular_frequency; // 1/s
 	int particle_count;
 	double particle_initial_velocity; // m/s
 	double particle_initial_height; // m
 	double delta_t; // s
+	double adaptive_tolerance; // m, position error per step of the per-particle step size control, 0: fixed steps of delta_t
+	std::string integrator; // kick_drift (default), verlet, yoshida4, rk4, rkf45
+	int jacobi_report; // 1: report the drift of the Jacobi constant of the active particles at each output
+	int jacobi_output; // 1: write potential, Jacobi constant and its drift of each particle at each output
+	std::string escape_criterion; // off (default), distance, energy: positive energy in the inertial frame beyond escape_radius
+	double escape_radius; // m, from the centre of mass
+	int impact_log; // 1: log the impacts of the re-colliding particles to impacts.bin
+	std::string gravity_kernel; // face (default), edge, shared_edge, tiled
+	std::string precision; // double (default), float, mixed: single precision face-relative geometry (OpenCL backend)
+	int precision_validation; // 1: propagate a double precision CPU reference alongside and report the divergence at each output
+	std::string collision_test; // solid_angle (default): position inside the body, bvh: segment of the step crosses the surface
+	double multipole_radius; // in body radii, 0: exact field everywhere
+	int multipole_order;
+	int multipole_validation; // 1: report the error of the multipole expansion at each output
+	int gravity_grid_levels; // 0: no gravity grid
+	int gravity_grid_size; // nodes per axis and level
+	std::string gravity_grid_file; // default: next to COMET_OBJ_FILE
+	int rank = 0; // process of a distributed run, from the command line or the MPI launcher, see ShardedOutput
+	int rank_count = 1;
+	std::string restart; // checkpoint to continue from (--restart), empty: start at step 0
 	
 	const double const_gravity = 6.67384E-11;
 	const double const_pi = 3.1415926535897932385;
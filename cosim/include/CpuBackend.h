@@ -0,0 +1,100 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/*
+Propagates the particles on the host CPU without OpenCL (BACKEND=cpu).
+
+Active particles are processed in blocks of COSIM_CPU_SIMD_WIDTH, each block
+performs all STEPS_PER_LAUNCH steps of a launch at once. The inner loops
+run over the particles of a block (structure-of-arrays) and are written to be
+vectorised by the compiler, the math functions via libmvec
+(COSIM_CPU_VECTOR_MATH). Blocks are distributed dynamically over
+CPU_THREAD_COUNT persistent worker threads via an atomic block counter.
+
+The gravity computation mirrors the OpenCL kernels: GRAVITY_KERNEL=shared_edge
+uses the shared-edge formulation, all other values use the per-edge table of
+face_field_edges(). Particles beyond the multipole radius use the far-field
+expansion, particles inside the gravity grid (away from the surface) the
+interpolated field, blocks of such particles skip the sum over the faces.
+COLLISION_TEST=bvh tests the segment of each step against the surface with
+BodyMesh::IntersectSegment() instead of summing the solid angles. With
+IMPACT_LOG the worker threads append the impacts to a buffer via an atomic
+counter, like the kernels.
+*/
+
+#ifndef CpuBackend_h
+#define CpuBackend_h
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ComputeBackend.h"
+
+#ifndef COSIM_CPU_SIMD_WIDTH
+#define COSIM_CPU_SIMD_WIDTH 8 // particles per block, multiple of the SIMD width (in doubles)
+#endif
+
+class CpuBackend : public ComputeBackend {
+
+public:
+	CpuBackend(ComputeConfig& config, const BodyMesh& mesh, const BodyMultipole& multipole, const GravityGrid& grid) : ComputeBackend(config, mesh, multipole, grid) {}
+	~CpuBackend();
+
+	void Initialize() override;
+	void PropagateSteps(int count) override;
+	void CompactParticles() override;
+	void UpdateParameters() override;
+	void PutParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew) override;
+	void GetParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew) override;
+	void PutJacobiReference(int NumBodies, const Real_t *jacobi) override;
+	JacobiDrift Diagnostics(int NumBodies, Real_t *diag) override;
+	void GetImpacts(std::vector<ImpactEvent>& events) override;
+	const char* getName() const override { return "CPU backend"; }
+
+private:
+	void WorkerLoop();
+	// runs ProcessBlocks() of block_count blocks on all worker threads and waits for them
+	void RunBlocks();
+	void ProcessBlocks();
+	void PropagateBlock(int first, int numsteps);
+	// potential, Jacobi constant, drift and status of the particles first .. first+W-1 into diagnostics
+	void DiagnoseBlock(int first);
+
+	// particle state, 4 values per particle as on the OpenCL devices, swapped after each step
+	std::vector<Real_t> posold;
+	std::vector<Real_t> velold;
+	std::vector<Real_t> posnew;
+	std::vector<Real_t> velnew;
+	std::vector<int> active; // indices of the active particles
+	std::vector<Real_t> jacobi_reference; // see PutJacobiReference()
+	std::vector<Real_t> diagnostics; // 4 values per particle, see Diagnostics()
+	std::vector<ImpactEvent> impacts; // append buffer of IMPACT_LOG, one event per particle at most
+	std::atomic<int> impact_count{0}; // events in impacts
+	int impacts_read = 0; // events returned by GetImpacts()
+
+	// thread pool
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start_cv;
+	std::condition_variable done_cv;
+	size_t generation = 0; // incremented for every step
+	int active_workers = 0;
+	bool shutdown = false;
+
+	std::atomic<int> next_block;
+	int block_count = 0;
+	int launch_steps = 0; // integration steps of the current launch
+	Real_t escape_radius = 0.0, escape_gm = 0.0; // see UpdateParameters()
+	bool diagnose = false; // the blocks are those of Diagnostics(), not of a launch
+	int diag_count = 0; // particles of Diagnostics()
+};
+
+// exact field (xyz, 3 values per position) and solid angle sum at count positions (xyz, 4 values per position)
+// with the shared-edge or the per-edge formulation, without the multipole expansion
+void cpu_exact_field(const BodyMesh& mesh, bool shared_edge, const Real_t* pos, int count, Real_t* g, Real_t* thetasum);
+
+#endif // CpuBackend_h
@@ -0,0 +1,77 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/*
+Precomputed gravity field of the body on nested Cartesian grids
+(GRAVITY_GRID_LEVELS, GRAVITY_GRID_SIZE). The field of the rigid body does not
+change in the body-fixed frame, so it is computed once with the exact
+formulation of the CPU backend and interpolated afterwards.
+
+All levels have GRAVITY_GRID_SIZE^3 nodes around the centre of the bounding box
+of the mesh. Level 0 encloses the mesh, each further level doubles the extent
+and the node spacing h. A node holds the field (xyz, in units of G*density like
+in the kernels) and the signed distance to the surface (w, negative inside,
+clamped to +-6h).
+
+A position is sampled on the finest level where the 4x4x4 stencil of the
+tricubic (Catmull-Rom) interpolation is inside the grid. The interpolated
+signed distance decides: beyond 4h outside the whole stencil is outside the
+body and the interpolated field is used, beyond 4h inside the position is
+inside the body, in between the exact field is needed. Positions outside of
+all levels use the exact field, too.
+
+The grid is stored in GRAVITY_GRID_FILE together with a key of the mesh and the
+grid parameters, and only recomputed if the key does not match or a node is not
+finite. Nodes where the exact field is not finite are recomputed at slightly
+nudged positions, a built grid with non-finite nodes or samples fails the
+validation and cosim exits.
+
+getParameters() layout (uploaded to the devices as is):
+[0]: GRAVITY_GRID_SIZE, [1..7]: unused
+[8+8*k ..]: origin of level k (xyz), 1/h, h, unused
+getNodes(): level-major, node (x,y,z) of level k at 4*((k*size+z)*size+y)*size+x)
+*/
+
+#ifndef GravityGrid_h
+#define GravityGrid_h
+
+#include <string>
+#include <vector>
+
+#include "BodyMesh.h"
+
+class GravityGrid {
+
+public:
+	GravityGrid() {}
+	// load the grid from filename if it matches mesh and parameters, build and write it otherwise
+	void Initialize(const BodyMesh& mesh, bool shared_edge, int levels, int size, const std::string& filename, int thread_count);
+
+	bool isEnabled() const { return levels > 0; }
+	int getLevels() const { return levels; }
+	const std::vector<Real_t>& getParameters() const { return parameters; }
+	const std::vector<Real_t>& getNodes() const { return nodes; }
+
+	// pos: position (xyz), returns true if g (xyz) and thetasum are valid without the exact field,
+	// see grid_field() in integrate_eom_kernel.cl
+	bool Sample(const Real_t* pos, Real_t* g, Real_t* thetasum) const;
+
+private:
+	void Layout(const BodyMesh& mesh);
+	void Build(const BodyMesh& mesh, bool shared_edge, int thread_count);
+	bool Load(const std::string& filename, unsigned long long key);
+	bool Write(const std::string& filename, unsigned long long key) const;
+	unsigned long long Key(const BodyMesh& mesh, bool shared_edge) const;
+	// nodes with a non-finite field or signed distance
+	int NonFiniteNodes() const;
+	// compares the grid with the exact field, false if a node or sample is not finite
+	bool Validate(const BodyMesh& mesh, bool shared_edge) const;
+
+	int levels = 0; // 0: disabled
+	int size = 0;
+	std::vector<Real_t> parameters;
+	std::vector<Real_t> nodes;
+};
+
+#endif // GravityGrid_h
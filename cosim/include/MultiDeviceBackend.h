@@ -0,0 +1,72 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/*
+Splits the particles over several devices (OPENCL_DEVICES), each device is a
+backend of its own with its queue, buffers and copy of the mesh and propagates a
+contiguous range of particle indices. The transfers gather the ranges, so the
+host sees the particles in the order of their index.
+
+The ranges are chosen so that the number of active particles on each device is
+proportional to its throughput (particle steps per second). The throughput is
+measured with a short calibration run on an equal split in the first
+PutParticles() and updated with every PropagateSteps(), the devices run
+concurrently. As particles re-collide the split drifts, after each compaction
+the particles are gathered and split again if the slowest device needs more than
+OPENCL_REBALANCE times the time of a perfect split.
+*/
+
+#ifndef MultiDeviceBackend_h
+#define MultiDeviceBackend_h
+
+#include <string>
+#include <vector>
+
+#include "ComputeBackend.h"
+
+class MultiDeviceBackend : public ComputeBackend {
+
+public:
+	// takes ownership of the devices, names are used in the output
+	MultiDeviceBackend(ComputeConfig& config, const BodyMesh& mesh, const BodyMultipole& multipole, const GravityGrid& grid,
+	                   const std::vector<ComputeBackend*>& devices, const std::vector<std::string>& names);
+	~MultiDeviceBackend();
+
+	void Initialize() override;
+	void PropagateSteps(int count) override;
+	void Synchronize() override;
+	void CompactParticles() override;
+	void UpdateParameters() override;
+	void SetStep(int s) override;
+	void PutParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew) override;
+	void GetParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew) override;
+	void GetParticlesAsync(int NumBodies, Real_t *hposnew, Real_t *hvelnew, std::function<void()> done) override;
+	void PutJacobiReference(int NumBodies, const Real_t *jacobi) override;
+	JacobiDrift Diagnostics(int NumBodies, Real_t *diag) override;
+	void GetImpacts(std::vector<ImpactEvent>& events) override;
+	const char* getName() const override { return name.c_str(); }
+
+private:
+	// propagates all devices concurrently and updates their throughput, returns the time of the slowest one
+	ham::util::time::rep RunDevices(int count);
+	// ranges of the particles of vel with the active particles proportional to the throughput
+	void Split(int NumBodies, const Real_t *vel);
+	void PutDevices(Real_t *pos, Real_t *vel);
+	void Calibrate(Real_t *pos, Real_t *vel);
+	void PrintSplit() const;
+
+	std::vector<ComputeBackend*> devices;
+	std::vector<std::string> names;
+	std::vector<int> first; // particles first[d] .. first[d+1]-1 are on device d
+	std::vector<double> throughput; // active particle steps per second of each device
+	std::vector<Real_t> hpos; // host copy of the particles for rebalancing
+	std::vector<Real_t> hvel;
+	std::vector<Real_t> jacobi_reference; // host copy, the ranges of the devices change when rebalancing
+	std::vector<ImpactEvent> impacts; // of the devices before rebalancing, not returned by GetImpacts() yet
+	std::string name;
+	int num_bodies = 0;
+	bool calibrated = false;
+};
+
+#endif // MultiDeviceBackend_h
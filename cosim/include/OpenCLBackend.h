@@ -0,0 +1,134 @@
+// Copyright (c) 2015 Tobias Kramer <tobias.kramer@mytum.de>
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/* 
+Propagates the particles with the OpenCL kernels in cl/integrate_eom_kernel.cl
+on the device selected by OPENCL_PLATFORM_ID and OPENCL_DEVICE_ID (BACKEND=opencl),
+or on one of the OPENCL_DEVICES of a MultiDeviceBackend.
+PRECISION selects the precision of the kernels with build options, for
+PRECISION=float all floating point data is converted on the transfers.
+Compiled programs are cached per device, driver, kernel source and build
+options in OPENCL_PROGRAM_CACHE.
+*/
+
+#ifndef OpenCLBackend_h
+#define OpenCLBackend_h
+
+#include <CL/cl.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <string>
+
+#include "ComputeBackend.h"
+
+class OpenCLBackend : public ComputeBackend {
+
+public:
+	OpenCLBackend(ComputeConfig& config, const BodyMesh& mesh, const BodyMultipole& multipole, const GravityGrid& grid)
+		: OpenCLBackend(config, mesh, multipole, grid, config.opencl_platform_id, config.opencl_device_id) {}
+	// on device_id of platform_id instead of OPENCL_PLATFORM_ID, OPENCL_DEVICE_ID, see MultiDeviceBackend
+	OpenCLBackend(ComputeConfig& config, const BodyMesh& mesh, const BodyMultipole& multipole, const GravityGrid& grid, int platform_id, int device_id)
+		: ComputeBackend(config, mesh, multipole, grid), platform_id(platform_id), device_id(device_id) {}
+
+	void Initialize() override;
+	void PropagateSteps(int count) override;
+	void Synchronize() override;
+	void CompactParticles() override;
+	void UpdateParameters() override;
+	void PutParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew) override;
+	void GetParticles(int NumBodies, Real_t *hposnew, Real_t *hvelnew) override;
+	void PutJacobiReference(int NumBodies, const Real_t *jacobi) override;
+	JacobiDrift Diagnostics(int NumBodies, Real_t *diag) override;
+	void GetImpacts(std::vector<ImpactEvent>& events) override;
+	Real_t* AllocHostBuffer(size_t count) override;
+	void FreeHostBuffer(Real_t *ptr) override;
+	void GetParticlesAsync(int NumBodies, Real_t *hposnew, Real_t *hvelnew, std::function<void()> done) override;
+	const char* getName() const override { return "OpenCL kernel"; }
+
+	// compiles the kernels for all COLLISION_TEST and PRECISION variants into the program binary cache
+	void BuildProgramCache();
+
+private:
+	// creates the context of the platform, returns the device
+	cl::Device SelectDevice();
+	// program for device from the program binary cache (OPENCL_PROGRAM_CACHE) or compiled and cached
+	cl::Program BuildProgram(const cl::Device& device, const std::string& options);
+	// cache file of the program, empty if the cache is disabled, key identifies device, driver, source and options
+	std::string ProgramCacheFilename(const cl::Device& device, const std::string& options, uint64_t& key) const;
+	// adds the runtime of the completed launches to the statistics in launch order, wait: of all launches
+	void HarvestLaunches(bool wait);
+	static void CL_CALLBACK TransferComplete(cl_event event, cl_int status, void *user_data);
+
+	// floating point kernel arguments and transfers in the precision of the device (real_size, PRECISION)
+	void SetRealArg(cl::Kernel& kernel, int index, double value);
+	void WriteReals(cl::Buffer& buffer, const Real_t* data, size_t count);
+	// count values from offset (in values) of buffer
+	void ReadReals(cl::Buffer& buffer, Real_t* data, size_t count, size_t offset = 0);
+
+	int platform_id;
+	int device_id;
+	size_t launch_counter = 0; // kernel launches, selects the buffers of the double buffering scheme
+
+	struct Launch
+	{
+		cl::Event event;
+		int steps;
+	};
+	std::deque<Launch> launches; // enqueued launches not in the statistics yet, oldest first
+	static const size_t MAX_LAUNCHES = 64; // launches in flight, PropagateSteps() waits for the oldest beyond
+
+	cl::Context      context;
+	cl::CommandQueue queue;
+	cl::Kernel       kernel_eom;
+	cl::Kernel       kernel_compact_scan;
+	cl::Kernel       kernel_compact_scan_blocks;
+	cl::Kernel       kernel_compact_scatter;
+	cl::Kernel       kernel_diagnostics;
+	cl::Kernel       kernel_diagnostics_reduce;
+	cl::Program      program_eom;
+
+	cl::Buffer gposold; // compute device: positions
+	cl::Buffer gvelold; // compute device: velocities
+	cl::Buffer gposnew; // compute device: store temp positions
+	cl::Buffer gvelnew; // compute device: store temp velocities
+	cl::Buffer gnv;
+	cl::Buffer grij;
+	cl::Buffer gplane; // compute device: face planes (GRAVITY_KERNEL=edge, diagnostics)
+	cl::Buffer gedge;  // compute device: edge table (GRAVITY_KERNEL=edge, diagnostics)
+	cl::Buffer gsedge; // compute device: unique edges and their dyads (GRAVITY_KERNEL=shared_edge)
+	cl::Buffer gvert;    // compute device: SoA vertices (GRAVITY_KERNEL=tiled)
+	cl::Buffer gedgesoa; // compute device: SoA edge table (GRAVITY_KERNEL=tiled)
+	cl::Buffer gmultipole; // compute device: multipole coefficients, see BodyMultipole
+	cl::Buffer ggridnodes; // compute device: gravity grid nodes, see GravityGrid
+	cl::Buffer ggridparams; // compute device: gravity grid parameters
+	cl::Buffer gbvh; // compute device: bounding volume hierarchy, see BodyMesh
+	cl::Buffer gbvhtri; // compute device: faces in the order of the hierarchy
+	cl::Buffer gactive;    // compute device: indices of the active particles
+	cl::Buffer gactivetmp; // compute device: compacted indices, swapped with gactive
+	cl::Buffer goffset;    // compute device: compaction offsets within a work-group
+	cl::Buffer gblock;     // compute device: compaction offsets of the work-groups
+	cl::Buffer gjacobiref;   // compute device: reference Jacobi constants (JACOBI_REPORT, JACOBI_OUTPUT)
+	cl::Buffer gdiag;        // compute device: potential, Jacobi constant, drift and status per particle
+	cl::Buffer gdiagblock;   // compute device: drift statistics of the work-groups
+	cl::Buffer gdiagcount;   // compute device: active particles of the work-groups
+	cl::Buffer gimpactid;    // compute device: particle, face and step of the impacts (IMPACT_LOG), see log_impact()
+	cl::Buffer gimpact;      // compute device: position, time and velocity of the impacts
+	cl::Buffer gimpactcount; // compute device: atomic counter of the impacts
+	int max_impacts = 0; // capacity of the impact buffers, one impact per particle at most
+	int impacts_read = 0; // impacts returned by GetImpacts()
+	size_t real_size = sizeof(Real_t); // bytes per floating point value on the device, sizeof(cl_float) for PRECISION=float
+	size_t local_size = 0; // 0: let the OpenCL implementation decide
+	size_t compact_size = 0; // work-group size of the compaction kernels
+	size_t diag_size = 0; // work-group size of the diagnostics kernels
+	int numpoints_arg = 0; // kernel argument index of numpoints
+	int numsteps_arg = 0;  // kernel argument index of numsteps
+	int parameters_arg = 0; // kernel argument index of dt, followed by omega, G*density and the adaptive tolerance
+
+	std::map<Real_t*, cl::Buffer> host_buffers; // pinned host memory (CL_MEM_ALLOC_HOST_PTR) by mapped pointer
+};
+
+#endif // OpenCLBackend_h 
@@ -0,0 +1,54 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/*
+Output of a run split over several cooperating processes (ranks, see
+--rank/--ranks in the README). Each rank propagates a contiguous range of the
+particles and writes its part of every output file into the shards
+subdirectory of the output directory, file name plus ".NNNN" (the rank).
+
+The ranks coordinate via the shared file system only, no rank ever waits for
+another one: after its last output a rank atomically writes its marker
+shards/rankNNNN.done (number of ranks and list of written files). The rank that
+sees the markers of all ranks afterwards and wins the exclusive creation of
+shards/merge.lock merges the shards of each file in rank order into the output
+directory and removes the shards. Downstream tools see the same files as from a
+single process run.
+
+If a rank fails, the shards of the others are kept; after re-running it,
+"cosim --merge <config>" merges them.
+*/
+
+#ifndef ShardedOutput_h
+#define ShardedOutput_h
+
+#include <set>
+#include <string>
+
+class ShardedOutput {
+
+public:
+	ShardedOutput() {}
+	// creates the shards subdirectory of directory for rank_count > 1, shards of this rank
+	// already in it (from before a restart) are merged with the new ones, the marker of this rank and
+	// a merge lock left behind by an interrupted run are removed
+	void Initialize(const std::string& directory, int rank, int rank_count);
+
+	bool isSharded() const { return rank_count > 1; }
+	// path to write the output file name (relative to the output directory) of this rank to
+	std::string Path(const std::string& name);
+	// marks the output of this rank as complete, the last rank merges the output of all ranks
+	void Finish();
+
+	// merges the shards in directory if all ranks are complete, returns false otherwise
+	static bool Merge(const std::string& directory);
+
+private:
+	std::string directory;
+	int rank = 0;
+	int rank_count = 1;
+	std::set<std::string> names; // files written by this rank
+};
+
+#endif // ShardedOutput_h
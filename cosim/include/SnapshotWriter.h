@@ -0,0 +1,115 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+/*
+Writes particle snapshots without stalling the propagation.
+
+A ring of OUTPUT_RING_DEPTH host buffers (pinned for the OpenCL backend)
+receives the particle state via non-blocking transfers. A dedicated writer
+thread formats and writes the snapshots in the order they were requested,
+while the next steps are computed. Write() blocks when all buffers of the
+ring are in flight (back-pressure).
+
+OUTPUT_FORMAT=text writes 8 columns per particle (position, velocity, the
+last column is 1.0 for re-collided and 2.0 for escaped particles),
+OUTPUT_FORMAT=binary writes the columnar format described in
+covis/include/SnapshotFormat.h.
+
+With ESCAPE_CRITERION, the writer thread also appends the particles that
+escaped since the previous snapshot or checkpoint to the escape log
+(escapes.dat).
+With IMPACT_LOG it appends the impacts collected from the backend to the
+binary impact log (impacts.bin, see covis/include/ImpactFormat.h), in order
+with the snapshots.
+
+Checkpoints (see Checkpoint.h) use the same ring and writer thread, so they do
+not stall the propagation either.
+*/
+
+#ifndef SnapshotWriter_h
+#define SnapshotWriter_h
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Checkpoint.h"
+#include "ComputeBackend.h"
+
+class SnapshotWriter {
+
+public:
+	SnapshotWriter(ComputeBackend& backend, int particle_count, int depth, bool binary);
+	~SnapshotWriter();
+
+	// request a snapshot of the current backend state written to filename
+	void Write(const std::string& filename, int step, double time);
+	// request a checkpoint of the current backend state, header without the state
+	void WriteCheckpoint(const std::string& filename, const checkpoint::Header& header);
+	// log the particles escaping in the following snapshots to filename, first: index of the first particle,
+	// particles escaped in vel already are not logged, restart_step: continue the log of a run restarted at
+	// this step without the escapes after it (logged before the interruption), -1: new log
+	void LogEscapes(const std::string& filename, int first, const Real_t* vel, int restart_step);
+	// log impacts to filename (see ImpactFormat.h), first: index of the first particle, restart_step: continue the
+	// log of a run restarted at this step without the impacts from it on (logged before the interruption), -1: new log
+	void LogImpacts(const std::string& filename, int first, double delta_t, int restart_step);
+	// request appending events to the impact log, takes the events
+	void WriteImpacts(std::vector<ImpactEvent>& events);
+	// wait until all requested snapshots are written, closes the escape and impact logs
+	void Finish();
+
+private:
+	struct Slot
+	{
+		Real_t *pos = nullptr;
+		Real_t *vel = nullptr;
+		std::string filename;
+		int step = 0;
+		double time = 0.0;
+		bool transferred = false;
+		enum { SNAPSHOT, CHECKPOINT, IMPACTS } kind = SNAPSHOT;
+		checkpoint::Header checkpoint;
+		std::vector<ImpactEvent> impacts;
+	};
+
+	// wait until the writer thread is idle, all requested slots are written
+	void WaitPending();
+	// takes a free slot, blocks if there is none
+	Slot* Acquire();
+	// starts the transfer into slot
+	void Request(Slot* slot);
+
+	void WriterLoop();
+	void WriteText(const Slot& slot);
+	void WriteBinary(const Slot& slot);
+	void WriteEscapes(const Slot& slot);
+	void WriteImpacts(const Slot& slot);
+
+	ComputeBackend& backend;
+	const int particle_count;
+	const bool binary;
+
+	FILE* escape_log = nullptr; // see LogEscapes(), used by the writer thread only
+	int escape_first = 0;
+	std::vector<uint8_t> escaped; // logged already
+	FILE* impact_log = nullptr; // see LogImpacts(), used by the writer thread only
+	int impact_first = 0;
+	double impact_delta_t = 0.0;
+
+	std::vector<Slot> slots;
+	std::deque<Slot*> free_slots;
+	std::deque<Slot*> pending_slots; // in request order
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool shutdown = false;
+	std::thread writer;
+};
+
+#endif // SnapshotWriter_h
@@ -0,0 +1,792 @@
+// Copyright (c) 2015 Tobias Kramer <tobias.kramer@mytum.de>
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "BodyMesh.h"
+
+#include <iostream>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tiny_obj_loader.h"
+
+void triangle_normal(double *aIn, double *bIn, double *cIn, double *nv)
+{
+	double a[3],b[3],c[3];
+	
+	a[0]=bIn[0]-aIn[0];
+	a[1]=bIn[1]-aIn[1];
+	a[2]=bIn[2]-aIn[2];
+	
+	b[0]=cIn[0]-aIn[0];
+	b[1]=cIn[1]-aIn[1];
+	b[2]=cIn[2]-aIn[2];
+	
+
+	c[0] = (a[1] * b[2]) - (a[2] * b[1]);
+	c[1] = (a[2] * b[0]) - (a[0] * b[2]);
+	c[2] = (a[0] * b[1]) - (a[1] * b[0]);
+
+    double norm = sqrt(c[0]*c[0]+c[1]*c[1]+c[2]*c[2]);
+	
+	nv[0] = c[0]/norm;
+	nv[1] = c[1]/norm;
+	nv[2] = c[2]/norm;
+}
+
+void prepare_gravity(Real_t nv[], Real_t rij[], Real_t cm[], int numfaces, std::vector<unsigned int>& fi, std::vector<float>& ev)
+{
+	for(int i = 0; i < numfaces; i++)
+	{
+		double a[3], b[3], c[3], d[3], nu[3];
+
+		int ain = fi[i*3+0];
+		int bin = fi[i*3+1];
+		int cin = fi[i*3+2];
+		
+		a[0] = ev[ain*3+0];
+		a[1] = ev[ain*3+1];
+		a[2] = ev[ain*3+2];
+		
+		b[0] = ev[bin*3+0];
+		b[1] = ev[bin*3+1];
+		b[2] = ev[bin*3+2];
+		
+		c[0] = ev[cin*3+0];
+		c[1] = ev[cin*3+1];
+		c[2] = ev[cin*3+2];
+		
+		d[0] = (a[0]+b[0]+c[0])/3.0;
+		d[1] = (a[1]+b[1]+c[1])/3.0;
+		d[2] = (a[2]+b[2]+c[2])/3.0;
+		
+		// face center
+		cm[i*3+0] = d[0];
+		cm[i*3+1] = d[1];
+		cm[i*3+2] = d[2];
+		
+		triangle_normal(a, b, c, nu);
+		
+		nv[i*3+0] = nu[0];
+		nv[i*3+1] = nu[1];
+		nv[i*3+2] = nu[2];
+
+		rij[(i*4+0)*3+0] = a[0];
+		rij[(i*4+0)*3+1] = a[1];
+		rij[(i*4+0)*3+2] = a[2];
+
+		rij[(i*4+1)*3+0] = b[0];
+		rij[(i*4+1)*3+1] = b[1];
+		rij[(i*4+1)*3+2] = b[2];
+
+		rij[(i*4+2)*3+0] = c[0];
+		rij[(i*4+2)*3+1] = c[1];
+		rij[(i*4+2)*3+2] = c[2];
+
+		rij[(i*4+3)*3+0] = a[0];
+		rij[(i*4+3)*3+1] = a[1];
+		rij[(i*4+3)*3+2] = a[2];
+	}
+}
+
+void prepare_edges(Real_t plane[], Real_t edge[], Real_t nv[], Real_t rij[], int numfaces)
+{
+	for(int i = 0; i < numfaces; i++)
+	{
+		// face normal and plane offset dot(nv,ri0)
+		plane[i*4+0] = nv[i*3+0];
+		plane[i*4+1] = nv[i*3+1];
+		plane[i*4+2] = nv[i*3+2];
+		plane[i*4+3] = nv[i*3+0]*rij[(i*4+0)*3+0] + nv[i*3+1]*rij[(i*4+0)*3+1] + nv[i*3+2]*rij[(i*4+0)*3+2];
+
+		for(int j = 0; j < 3; j++)
+		{
+			double e[3], en[3];
+
+			// edge from vertex j to j+1 (rij holds a copy of the first vertex as 4th entry)
+			e[0] = rij[(i*4+j+1)*3+0] - rij[(i*4+j)*3+0];
+			e[1] = rij[(i*4+j+1)*3+1] - rij[(i*4+j)*3+1];
+			e[2] = rij[(i*4+j+1)*3+2] - rij[(i*4+j)*3+2];
+
+			double norm = sqrt(e[0]*e[0]+e[1]*e[1]+e[2]*e[2]);
+
+			// cross(edge, nv) / norm, i.e. the in-plane edge normal
+			en[0] = ((e[1] * nv[i*3+2]) - (e[2] * nv[i*3+1])) / norm;
+			en[1] = ((e[2] * nv[i*3+0]) - (e[0] * nv[i*3+2])) / norm;
+			en[2] = ((e[0] * nv[i*3+1]) - (e[1] * nv[i*3+0])) / norm;
+
+			edge[(2*(i*3+j)+0)*4+0] = e[0];
+			edge[(2*(i*3+j)+0)*4+1] = e[1];
+			edge[(2*(i*3+j)+0)*4+2] = e[2];
+			edge[(2*(i*3+j)+0)*4+3] = 1.0 / norm;
+
+			edge[(2*(i*3+j)+1)*4+0] = en[0];
+			edge[(2*(i*3+j)+1)*4+1] = en[1];
+			edge[(2*(i*3+j)+1)*4+2] = en[2];
+			edge[(2*(i*3+j)+1)*4+3] = 0.0;
+		}
+	}
+}
+
+// structure-of-arrays copies of the vertices and the edge table (see prepare_edges()),
+// block j holds entry j of all faces
+void prepare_soa(Real_t vert[], Real_t edgesoa[], Real_t rij[], Real_t edge[], int numfaces)
+{
+	for(int i = 0; i < numfaces; i++)
+	{
+		for(int j = 0; j < 3; j++)
+		{
+			vert[(j*numfaces+i)*4+0] = rij[(i*4+j)*3+0];
+			vert[(j*numfaces+i)*4+1] = rij[(i*4+j)*3+1];
+			vert[(j*numfaces+i)*4+2] = rij[(i*4+j)*3+2];
+			vert[(j*numfaces+i)*4+3] = 0.0;
+		}
+		for(int j = 0; j < 6; j++)
+			for(int k = 0; k < 4; k++)
+				edgesoa[(j*numfaces+i)*4+k] = edge[(i*6+j)*4+k];
+	}
+}
+
+// unique edges of a closed triangle mesh with the edge dyad E_e of its two adjacent faces,
+// returns false if the mesh is not a closed, consistently oriented manifold
+bool prepare_shared_edges(Real_t sedge[], Real_t nv[], int numfaces, int numedges, std::vector<unsigned int>& fi, std::vector<float>& ev)
+{
+	// edge key (lower, higher vertex index) -> index in sedge
+	std::unordered_map<unsigned long long, int> edge_index;
+	edge_index.reserve(numedges);
+	std::vector<int> face_count(numedges, 0);
+	int count = 0;
+
+	for(int i = 0; i < numfaces; i++)
+	{
+		for(int j = 0; j < 3; j++)
+		{
+			unsigned int vi = fi[i*3+j];
+			unsigned int vj = fi[i*3+(j+1)%3];
+			double e[3], en[3];
+
+			// NOTE: vertices are read as floats, compute derived quantities in double
+			e[0] = static_cast<double>(ev[vj*3+0]) - ev[vi*3+0];
+			e[1] = static_cast<double>(ev[vj*3+1]) - ev[vi*3+1];
+			e[2] = static_cast<double>(ev[vj*3+2]) - ev[vi*3+2];
+			double norm = sqrt(e[0]*e[0]+e[1]*e[1]+e[2]*e[2]);
+
+			// outward in-plane edge normal cross(edge, nv) / norm
+			en[0] = ((e[1] * nv[i*3+2]) - (e[2] * nv[i*3+1])) / norm;
+			en[1] = ((e[2] * nv[i*3+0]) - (e[0] * nv[i*3+2])) / norm;
+			en[2] = ((e[0] * nv[i*3+1]) - (e[1] * nv[i*3+0])) / norm;
+
+			unsigned long long key = (static_cast<unsigned long long>(std::min(vi, vj)) << 32) | std::max(vi, vj);
+			auto it = edge_index.find(key);
+			int k;
+			if (it == edge_index.end())
+			{
+				if (count == numedges)
+					return false;
+				k = count++;
+				edge_index[key] = k;
+
+				Real_t* e0 = &sedge[(5*k+0)*4];
+				Real_t* e1 = &sedge[(5*k+1)*4];
+				e0[0] = ev[vi*3+0];
+				e0[1] = ev[vi*3+1];
+				e0[2] = ev[vi*3+2];
+				e0[3] = norm;
+				e1[0] = ev[vj*3+0];
+				e1[1] = ev[vj*3+1];
+				e1[2] = ev[vj*3+2];
+				e1[3] = 0.0;
+				for (int r = 0; r < 3; ++r)
+					for (int c = 0; c < 4; ++c)
+						sedge[(5*k+2+r)*4+c] = 0.0;
+			}
+			else
+			{
+				k = it->second;
+			}
+			++face_count[k];
+
+			// E_e += nv * en^T
+			for (int r = 0; r < 3; ++r)
+				for (int c = 0; c < 3; ++c)
+					sedge[(5*k+2+r)*4+c] += nv[i*3+r] * en[c];
+		}
+	}
+
+	// every edge must be shared by exactly two faces
+	if (count != numedges)
+		return false;
+	for (int k = 0; k < numedges; ++k)
+		if (face_count[k] != 2)
+			return false;
+
+	return true;
+}
+
+// number of nodes of the bounding volume hierarchy over count faces, see prepare_bvh()
+int bvh_node_count(int count)
+{
+	if (count <= BVH_LEAF_SIZE)
+		return 1;
+	return 1 + bvh_node_count(count / 2) + bvh_node_count(count - count / 2);
+}
+
+// node for the faces order[first..first+count), the children are appended depth-first,
+// returns the depth of the subtree
+int prepare_bvh_node(Real_t bvh[], int& numnodes, Real_t bvhtri[], std::vector<int>& order, const std::vector<double>& centroid, Real_t rij[], int first, int count)
+{
+	const int node = numnodes++;
+	double lo[3] = { 1.0e300, 1.0e300, 1.0e300 }, hi[3] = { -1.0e300, -1.0e300, -1.0e300 };
+	double clo[3] = { 1.0e300, 1.0e300, 1.0e300 }, chi[3] = { -1.0e300, -1.0e300, -1.0e300 };
+	for (int i = first; i < first + count; ++i)
+	{
+		const int f = order[i];
+		for (int k = 0; k < 3; ++k)
+		{
+			for (int j = 0; j < 3; ++j)
+			{
+				lo[k] = std::min(lo[k], rij[(f*4+j)*3+k]);
+				hi[k] = std::max(hi[k], rij[(f*4+j)*3+k]);
+			}
+			clo[k] = std::min(clo[k], centroid[f*3+k]);
+			chi[k] = std::max(chi[k], centroid[f*3+k]);
+		}
+	}
+	for (int k = 0; k < 3; ++k)
+	{
+		bvh[node*8+k] = lo[k];
+		bvh[node*8+4+k] = hi[k];
+	}
+
+	if (count <= BVH_LEAF_SIZE)
+	{
+		bvh[node*8+3] = first;
+		bvh[node*8+7] = count;
+		for (int i = first; i < first + count; ++i)
+		{
+			const int f = order[i];
+			for (int k = 0; k < 3; ++k)
+			{
+				bvhtri[i*12+0+k] = rij[(f*4+0)*3+k];
+				bvhtri[i*12+4+k] = rij[(f*4+1)*3+k] - rij[(f*4+0)*3+k];
+				bvhtri[i*12+8+k] = rij[(f*4+2)*3+k] - rij[(f*4+0)*3+k];
+			}
+			bvhtri[i*12+3] = f;
+			bvhtri[i*12+7] = 0.0;
+			bvhtri[i*12+11] = 0.0;
+		}
+		return 1;
+	}
+
+	// median split along the longest axis of the centroids
+	int axis = 0;
+	for (int k = 1; k < 3; ++k)
+		if (chi[k] - clo[k] > chi[axis] - clo[axis])
+			axis = k;
+	const int half = count / 2;
+	std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+		[&](int a, int b) { return centroid[a*3+axis] < centroid[b*3+axis]; });
+
+	const int left_depth = prepare_bvh_node(bvh, numnodes, bvhtri, order, centroid, rij, first, half);
+	bvh[node*8+3] = numnodes; // right child
+	bvh[node*8+7] = 0.0;
+	const int right_depth = prepare_bvh_node(bvh, numnodes, bvhtri, order, centroid, rij, first + half, count - half);
+	return 1 + std::max(left_depth, right_depth);
+}
+
+// bounding volume hierarchy over the faces with bvh_node_count(numfaces) nodes, see BodyMesh.h,
+// returns its depth
+int prepare_bvh(Real_t bvh[], Real_t bvhtri[], Real_t rij[], int numfaces)
+{
+	std::vector<int> order(numfaces);
+	std::iota(order.begin(), order.end(), 0);
+	std::vector<double> centroid(3*numfaces);
+	for (int i = 0; i < numfaces; i++)
+		for (int k = 0; k < 3; k++)
+			centroid[i*3+k] = (rij[(i*4+0)*3+k] + rij[(i*4+1)*3+k] + rij[(i*4+2)*3+k]) / 3.0;
+	int numnodes = 0;
+	return prepare_bvh_node(bvh, numnodes, bvhtri, order, centroid, rij, 0, numfaces);
+}
+
+namespace {
+
+const char CACHE_MAGIC[8] = { 'C', 'O', 'S', 'I', 'M', 'M', 'S', 'H' };
+const uint32_t CACHE_VERSION = 2;
+const uint32_t CACHE_BYTE_ORDER_MARK = 0x01020304;
+const size_t CACHE_ALIGNMENT = 64; // of each table in the file
+
+// tables in the order they are stored in the mesh cache
+Real_t* BodyMesh::* const cache_arrays[] = {
+	&BodyMesh::hnv, &BodyMesh::hcm, &BodyMesh::hrij,
+	&BodyMesh::hplane, &BodyMesh::hedge,
+	&BodyMesh::hvert, &BodyMesh::hedgesoa,
+	&BodyMesh::hsedge,
+	&BodyMesh::hbvh, &BodyMesh::hbvhtri
+};
+const int CACHE_ARRAY_COUNT = sizeof(cache_arrays) / sizeof(cache_arrays[0]);
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t real_size;   // sizeof(Real_t)
+	uint32_t tables;      // BodyMesh::Table bits
+	int32_t num_faces;
+	int32_t num_edges;
+	int32_t num_bvh_nodes;
+	// key of the OBJ file the tables were prepared from
+	uint64_t obj_size;
+	int64_t obj_mtime;    // ns since the epoch
+	uint64_t obj_hash;    // FNV-1a of the file contents
+	uint64_t offset[CACHE_ARRAY_COUNT]; // of each table in bytes, 0: not present
+};
+
+struct CacheKey
+{
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	uint64_t hash = 0;
+};
+
+// table bit and number of values of cache_arrays[a]
+unsigned array_table(int a)
+{
+	static const unsigned table[CACHE_ARRAY_COUNT] = {
+		BodyMesh::TABLE_GRAVITY, BodyMesh::TABLE_GRAVITY, BodyMesh::TABLE_GRAVITY,
+		BodyMesh::TABLE_EDGES, BodyMesh::TABLE_EDGES,
+		BodyMesh::TABLE_SOA, BodyMesh::TABLE_SOA,
+		BodyMesh::TABLE_SHARED_EDGES,
+		BodyMesh::TABLE_BVH, BodyMesh::TABLE_BVH
+	};
+	return table[a];
+}
+
+size_t array_size(int a, size_t numfaces, size_t numedges, size_t numnodes)
+{
+	static const size_t per_face[CACHE_ARRAY_COUNT] = { 3, 3, 3*4, 4, 2*4*3, 3*4, 2*4*3, 0, 0, 3*4 };
+	static const size_t per_edge[CACHE_ARRAY_COUNT] = { 0, 0, 0, 0, 0, 0, 0, 5*4, 0, 0 };
+	static const size_t per_node[CACHE_ARRAY_COUNT] = { 0, 0, 0, 0, 0, 0, 0, 0, 2*4, 0 };
+	return per_face[a] * numfaces + per_edge[a] * numedges + per_node[a] * numnodes;
+}
+
+bool obj_key(const std::string& obj_file, CacheKey& key)
+{
+	struct stat st;
+	if (stat(obj_file.c_str(), &st) != 0)
+		return false;
+	key.size = st.st_size;
+	key.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+	FILE *fd = fopen(obj_file.c_str(), "rb");
+	if (!fd)
+		return false;
+	uint64_t hash = 14695981039346656037ull;
+	std::vector<unsigned char> buffer(1 << 20);
+	size_t n;
+	while ((n = fread(buffer.data(), 1, buffer.size(), fd)) > 0)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			hash ^= buffer[i];
+			hash *= 1099511628211ull;
+		}
+	}
+	fclose(fd);
+	key.hash = hash;
+	return true;
+}
+
+} // namespace
+
+BodyMesh::~BodyMesh()
+{
+	if (mapping)
+	{
+		munmap(mapping, mapping_size);
+		return;
+	}
+	delete[] hnv;
+	delete[] hcm;
+	delete[] hrij;
+	delete[] hplane;
+	delete[] hedge;
+	delete[] hsedge;
+	delete[] hvert;
+	delete[] hedgesoa;
+	delete[] hbvh;
+	delete[] hbvhtri;
+}
+
+std::string BodyMesh::CacheFilename(const std::string& obj_file, const char* extension)
+{
+	size_t dot = obj_file.find_last_of('.');
+	size_t slash = obj_file.find_last_of('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return obj_file + extension;
+	return obj_file.substr(0, dot) + extension;
+}
+
+unsigned BodyMesh::RequiredTables(const ComputeConfig& config)
+{
+	unsigned required = TABLE_GRAVITY;
+	if (config.gravity_kernel != "face" || config.backend == "cpu" || config.precision_validation || config.jacobi_report || config.jacobi_output)
+		required |= TABLE_EDGES; // NOTE: the precision validation runs a CPU reference, the diagnostics use the per-edge tables
+	if (config.gravity_kernel == "tiled" && config.backend == "opencl")
+		required |= TABLE_SOA;
+	if (config.gravity_grid_levels > 0)
+		required |= TABLE_EDGES; // NOTE: the gravity grid is built with the CPU field
+	if (config.gravity_kernel == "shared_edge" || config.multipole_validation)
+		required |= TABLE_EDGES | TABLE_SHARED_EDGES; // NOTE: the multipole validation uses the shared-edge field
+	if (config.collision_test == "bvh")
+		required |= TABLE_BVH;
+	return required;
+}
+
+void BodyMesh::Load(const ComputeConfig& config)
+{
+	const unsigned required = RequiredTables(config);
+
+	if (config.mesh_cache != "off" && LoadCache(config.comet_obj_file, required))
+		return;
+
+	if (config.mesh_cache == "auto")
+	{
+		LoadObj(config.comet_obj_file, TABLE_ALL, required);
+		WriteCache(config.comet_obj_file);
+	}
+	else
+	{
+		LoadObj(config.comet_obj_file, required, required);
+	}
+}
+
+void BodyMesh::BuildCache(const ComputeConfig& config)
+{
+	LoadObj(config.comet_obj_file, TABLE_ALL, TABLE_GRAVITY);
+	if (!WriteCache(config.comet_obj_file))
+		exit(EXIT_FAILURE);
+}
+
+void BodyMesh::LoadObj(const std::string& obj_file, unsigned prepare, unsigned required)
+{
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+
+	std::string err = tinyobj::LoadObj(shapes, materials, obj_file.c_str());
+
+	if (!err.empty()) {
+	  std::cerr << err << std::endl;
+	  exit(1);
+	}
+
+	std::cout << "# of shapes    : " << shapes.size() << std::endl;
+	std::cout << "# of materials : " << materials.size() << std::endl;
+
+    // float reads, but all derived and used quantities are doubles
+	std::vector<unsigned int> fi = shapes[0].mesh.indices; // face indices MatheMatica
+	std::vector<float> ev = shapes[0].mesh.positions; // vertices MatheMatica
+
+	NUM_VERTICES_PER_FACE = 3;
+	NUM_FACES = shapes[0].mesh.indices.size() / NUM_VERTICES_PER_FACE;
+
+	assert(NUM_VERTICES_PER_FACE == 3);
+	assert(NUM_VERTICES_PER_FACE % NUM_VERTICES_PER_FACE == 0);
+
+	hnv      = new Real_t[3*NUM_FACES];
+	hcm      = new Real_t[3*NUM_FACES];
+	hrij     = new Real_t[3*4*NUM_FACES];
+
+    // hnv: normal vectors, hrij: collect 4 vertices per triangle last=copy op first vertex, hcm: center of triangle
+	prepare_gravity(hnv, hrij, hcm, NUM_FACES, fi, ev);
+	tables = TABLE_GRAVITY;
+
+	// mesh invariants per face and edge, computed once instead of on every step by every work-item
+	if (prepare & (TABLE_EDGES | TABLE_SOA))
+	{
+		hplane   = new Real_t[4*NUM_FACES];
+		hedge    = new Real_t[2*4*3*NUM_FACES];
+		prepare_edges(hplane, hedge, hnv, hrij, NUM_FACES);
+		tables |= TABLE_EDGES;
+	}
+
+	// aligned structure-of-arrays layout for cooperative loads into local memory
+	if (prepare & TABLE_SOA)
+	{
+		hvert    = new Real_t[3*4*NUM_FACES];
+		hedgesoa = new Real_t[2*4*3*NUM_FACES];
+		prepare_soa(hvert, hedgesoa, hrij, hedge, NUM_FACES);
+		tables |= TABLE_SOA;
+	}
+
+	// unique edges of the closed mesh, each one shared by two faces
+	if (prepare & TABLE_SHARED_EDGES)
+	{
+		NUM_EDGES = 3 * NUM_FACES / 2;
+		hsedge   = new Real_t[5*4*NUM_EDGES];
+		if ((3 * NUM_FACES) % 2 != 0 || !prepare_shared_edges(hsedge, hnv, NUM_FACES, NUM_EDGES, fi, ev))
+		{
+			if (required & TABLE_SHARED_EDGES)
+			{
+				std::cerr << "GRAVITY_KERNEL=shared_edge and MULTIPOLE_VALIDATION require a closed, consistently oriented triangle mesh, exiting." << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			// not required, the mesh cache is written without it
+			delete[] hsedge;
+			hsedge = nullptr;
+			NUM_EDGES = 0;
+		}
+		else
+		{
+			tables |= TABLE_SHARED_EDGES;
+			std::cout << "# of edges     : " << NUM_EDGES << std::endl;
+		}
+	}
+
+	// bounding volume hierarchy for the segment collision test
+	if (prepare & TABLE_BVH)
+	{
+		NUM_BVH_NODES = bvh_node_count(NUM_FACES);
+		hbvh     = new Real_t[2*4*NUM_BVH_NODES];
+		hbvhtri  = new Real_t[3*4*NUM_FACES];
+		if (prepare_bvh(hbvh, hbvhtri, hrij, NUM_FACES) > BVH_STACK_SIZE)
+		{
+			std::cerr << "Bounding volume hierarchy deeper than BVH_STACK_SIZE, exiting." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		tables |= TABLE_BVH;
+		std::cout << "# of BVH nodes : " << NUM_BVH_NODES << std::endl;
+	}
+}
+
+double BodyMesh::Volume() const
+{
+	// sum of the signed volumes of the tetrahedra spanned by the origin and the faces
+	double volume = 0.0;
+	for (int i = 0; i < NUM_FACES; ++i)
+	{
+		const Real_t* a = &hrij[(i*4+0)*3];
+		const Real_t* b = &hrij[(i*4+1)*3];
+		const Real_t* c = &hrij[(i*4+2)*3];
+		volume += (a[0] * (b[1]*c[2] - b[2]*c[1]) + a[1] * (b[2]*c[0] - b[0]*c[2]) + a[2] * (b[0]*c[1] - b[1]*c[0])) / 6.0;
+	}
+	// independent of the orientation of the faces
+	return std::fabs(volume);
+}
+
+bool BodyMesh::IntersectSegment(const Real_t* p0, const Real_t* p1, Real_t* t, int* face) const
+{
+	auto dot = [](const double* a, const double* b) { return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; };
+	auto cross = [](const double* a, const double* b, double* c) {
+		c[0] = a[1]*b[2] - a[2]*b[1];
+		c[1] = a[2]*b[0] - a[0]*b[2];
+		c[2] = a[0]*b[1] - a[1]*b[0];
+	};
+	const double d[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+	const double inv[3] = { 1.0 / d[0], 1.0 / d[1], 1.0 / d[2] };
+
+	double tmax = 1.0;
+	*face = -1;
+	int stack[BVH_STACK_SIZE];
+	int sp = 0;
+	int node = 0;
+	for (;;)
+	{
+		// slab test of the node bounds against the remaining segment [0,tmax],
+		// fmin()/fmax() drop the NaN of 0*inf on a bound parallel to the segment
+		const Real_t* b = &hbvh[node*8];
+		double tn = 0.0, tf = tmax;
+		for (int k = 0; k < 3; ++k)
+		{
+			const double t0 = (b[k] - p0[k]) * inv[k];
+			const double t1 = (b[4+k] - p0[k]) * inv[k];
+			tn = std::fmax(tn, std::fmin(t0, t1));
+			tf = std::fmin(tf, std::fmax(t0, t1));
+		}
+		if (tn <= tf && b[7] == 0.0) // inner node, visit the left child first
+		{
+			stack[sp++] = static_cast<int>(b[3]);
+			++node;
+			continue;
+		}
+		if (tn <= tf) // leaf, Moeller-Trumbore test of its faces (both sides)
+		{
+			const int first = static_cast<int>(b[3]);
+			for (int i = first; i < first + static_cast<int>(b[7]); ++i)
+			{
+				const Real_t* tri = &hbvhtri[i*12];
+				double pvec[3], qvec[3];
+				cross(d, &tri[8], pvec);
+				const double det = dot(&tri[4], pvec);
+				if (det == 0.0)
+					continue;
+				const double inv_det = 1.0 / det;
+				const double tvec[3] = { p0[0] - tri[0], p0[1] - tri[1], p0[2] - tri[2] };
+				const double u = dot(tvec, pvec) * inv_det;
+				if (u < 0.0 || u > 1.0)
+					continue;
+				cross(tvec, &tri[4], qvec);
+				const double v = dot(d, qvec) * inv_det;
+				if (v < 0.0 || u + v > 1.0)
+					continue;
+				const double ti = dot(&tri[8], qvec) * inv_det;
+				if (ti >= 0.0 && ti <= tmax)
+				{
+					tmax = ti;
+					*face = static_cast<int>(tri[3]);
+				}
+			}
+		}
+		if (sp == 0)
+			break;
+		node = stack[--sp];
+	}
+	*t = tmax;
+	return *face >= 0;
+}
+
+bool BodyMesh::LoadCache(const std::string& obj_file, unsigned required)
+{
+	const std::string cache_file = CacheFilename(obj_file);
+	int fd = open(cache_file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CacheHeader))
+	{
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+	void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping stays valid
+	if (data == MAP_FAILED)
+		return false;
+
+	const CacheHeader& header = *static_cast<const CacheHeader*>(data);
+	CacheKey key;
+	bool valid = std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+		&& header.version == CACHE_VERSION
+		&& header.byte_order == CACHE_BYTE_ORDER_MARK
+		&& header.header_size == sizeof(CacheHeader)
+		&& header.real_size == sizeof(Real_t)
+		&& (header.tables & required) == required
+		&& header.num_faces > 0 && header.num_edges >= 0 && header.num_bvh_nodes >= 0
+		&& obj_key(obj_file, key)
+		&& header.obj_size == key.size && header.obj_mtime == key.mtime && header.obj_hash == key.hash;
+
+	for (int a = 0; valid && a < CACHE_ARRAY_COUNT; ++a)
+	{
+		if (!(header.tables & array_table(a)))
+			continue;
+		size_t bytes = array_size(a, header.num_faces, header.num_edges, header.num_bvh_nodes) * sizeof(Real_t);
+		valid = header.offset[a] >= sizeof(CacheHeader) && header.offset[a] % CACHE_ALIGNMENT == 0
+			&& header.offset[a] <= size && bytes <= size - header.offset[a];
+	}
+
+	if (!valid)
+	{
+		std::cout << "Ignoring outdated or invalid mesh cache '" << cache_file << "'." << std::endl;
+		munmap(data, size);
+		return false;
+	}
+
+	// the tables are used in place
+	mapping = data;
+	mapping_size = size;
+	tables = header.tables;
+	NUM_VERTICES_PER_FACE = 3;
+	NUM_FACES = header.num_faces;
+	NUM_EDGES = header.num_edges;
+	NUM_BVH_NODES = header.num_bvh_nodes;
+	for (int a = 0; a < CACHE_ARRAY_COUNT; ++a)
+	{
+		if (header.tables & array_table(a))
+			this->*cache_arrays[a] = reinterpret_cast<Real_t*>(static_cast<char*>(data) + header.offset[a]);
+	}
+
+	std::cout << "mesh cache     : " << cache_file << std::endl;
+	if (tables & TABLE_SHARED_EDGES)
+		std::cout << "# of edges     : " << NUM_EDGES << std::endl;
+	if (tables & TABLE_BVH)
+		std::cout << "# of BVH nodes : " << NUM_BVH_NODES << std::endl;
+	return true;
+}
+
+bool BodyMesh::WriteCache(const std::string& obj_file)
+{
+	const std::string cache_file = CacheFilename(obj_file);
+	CacheHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.byte_order = CACHE_BYTE_ORDER_MARK;
+	header.header_size = sizeof(CacheHeader);
+	header.real_size = sizeof(Real_t);
+	header.tables = tables;
+	header.num_faces = NUM_FACES;
+	header.num_edges = NUM_EDGES;
+	header.num_bvh_nodes = NUM_BVH_NODES;
+
+	CacheKey key;
+	if (!obj_key(obj_file, key))
+	{
+		std::cerr << "Could not read '" << obj_file << "'." << std::endl;
+		return false;
+	}
+	header.obj_size = key.size;
+	header.obj_mtime = key.mtime;
+	header.obj_hash = key.hash;
+
+	size_t offset = (sizeof(CacheHeader) + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+	for (int a = 0; a < CACHE_ARRAY_COUNT; ++a)
+	{
+		if (!(tables & array_table(a)))
+			continue;
+		header.offset[a] = offset;
+		offset += array_size(a, NUM_FACES, NUM_EDGES, NUM_BVH_NODES) * sizeof(Real_t);
+		offset = (offset + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+	}
+
+	// written to a temporary file of this process first, concurrent runs never map a partial cache
+	const std::string tmp_file = cache_file + ".tmp." + std::to_string(getpid());
+	FILE *fd = fopen(tmp_file.c_str(), "wb");
+	if (!fd)
+	{
+		std::cerr << "Could not write mesh cache '" << cache_file << "'." << std::endl;
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fd) == 1;
+	for (int a = 0; ok && a < CACHE_ARRAY_COUNT; ++a)
+	{
+		if (!(tables & array_table(a)))
+			continue;
+		ok = fseek(fd, header.offset[a], SEEK_SET) == 0;
+		size_t count = array_size(a, NUM_FACES, NUM_EDGES, NUM_BVH_NODES);
+		ok = ok && fwrite(this->*cache_arrays[a], sizeof(Real_t), count, fd) == count;
+	}
+	ok = (fclose(fd) == 0) && ok;
+	if (!ok || rename(tmp_file.c_str(), cache_file.c_str()) != 0)
+	{
+		std::cerr << "Could not write mesh cache '" << cache_file << "'." << std::endl;
+		remove(tmp_file.c_str());
+		return false;
+	}
+	std::cout << "Wrote mesh cache '" << cache_file << "'." << std::endl;
+	return true;
+}
@@ -0,0 +1,238 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "BodyMultipole.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+typedef std::complex<double> complex_t;
+
+// index of (n,m) in a triangular array over n=0..order, m=0..n
+inline int tri(int n, int m) { return n*(n+1)/2 + m; }
+
+// Gauss-Legendre nodes and weights on [0,1]
+void gauss_legendre(int count, std::vector<double>& x, std::vector<double>& w)
+{
+	x.resize(count);
+	w.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		// Newton iteration for the i-th root of P_count, starting from the Chebyshev estimate
+		double z = std::cos(3.1415926535897932385 * (i + 0.75) / (count + 0.5));
+		double dp = 1.0;
+		for (int iter = 0; iter < 100; ++iter)
+		{
+			double p0 = 1.0, p1 = z;
+			for (int k = 2; k <= count; ++k)
+			{
+				double p2 = ((2*k - 1) * z * p1 - (k - 1) * p0) / k;
+				p0 = p1;
+				p1 = p2;
+			}
+			dp = count * (z * p1 - p0) / (z * z - 1.0);
+			double dz = p1 / dp;
+			z -= dz;
+			if (std::fabs(dz) < 1.0e-16)
+				break;
+		}
+		x[i] = 0.5 * (1.0 - z);
+		w[i] = 1.0 / ((1.0 - z * z) * dp * dp);
+	}
+}
+
+// regular solid harmonics R_n^m(p) for n=0..order, m=0..n
+void regular_harmonics(const double* p, int order, std::vector<complex_t>& R)
+{
+	const double r2 = p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+	const complex_t xy(p[0], p[1]);
+	complex_t diag(1.0, 0.0); // R_m^m
+	for (int m = 0; m <= order; ++m)
+	{
+		if (m > 0)
+			diag *= -xy / (2.0 * m);
+		R[tri(m, m)] = diag;
+		for (int n = m + 1; n <= order; ++n)
+		{
+			complex_t prev2 = (n - 2 >= m) ? R[tri(n-2, m)] : complex_t(0.0, 0.0);
+			R[tri(n, m)] = ((2.0*n - 1.0) * p[2] * R[tri(n-1, m)] - r2 * prev2) / (double)((n + m) * (n - m));
+		}
+	}
+}
+
+} // namespace
+
+void BodyMultipole::Compute(const BodyMesh& mesh, int order, double radius)
+{
+	this->order = order;
+
+	// volume and centre of mass of the homogeneous polyhedron
+	double volume = 0.0;
+	double centre[3] = { 0.0, 0.0, 0.0 };
+	for (int i = 0; i < mesh.NUM_FACES; ++i)
+	{
+		const Real_t* a = &mesh.hrij[(i*4+0)*3];
+		const Real_t* b = &mesh.hrij[(i*4+1)*3];
+		const Real_t* c = &mesh.hrij[(i*4+2)*3];
+		const double v = (a[0] * (b[1]*c[2] - b[2]*c[1]) + a[1] * (b[2]*c[0] - b[0]*c[2]) + a[2] * (b[0]*c[1] - b[1]*c[0])) / 6.0;
+		volume += v;
+		for (int k = 0; k < 3; ++k)
+			centre[k] += v * (a[k] + b[k] + c[k]) / 4.0;
+	}
+	for (int k = 0; k < 3; ++k)
+		centre[k] /= volume;
+
+	body_radius = 0.0;
+	for (int i = 0; i < 3*mesh.NUM_FACES; ++i)
+	{
+		const Real_t* v = &mesh.hrij[((i/3)*4+i%3)*3];
+		const double d[3] = { v[0] - centre[0], v[1] - centre[1], v[2] - centre[2] };
+		body_radius = std::max(body_radius, std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]));
+	}
+	this->radius = radius * body_radius;
+
+	// moments in coordinates relative to the centre in units of the body radius,
+	// int_tet f dV = triple/(n+3) * int_0^1 int_0^1 f(a + u(b-a) + uv(c-b)) u du dv for f homogeneous of degree n
+	std::vector<double> gx, gw;
+	gauss_legendre(order/2 + 2, gx, gw); // exact up to degree order+1 in u
+	std::vector<complex_t> M(tri(order+1, 0), complex_t(0.0, 0.0));
+	std::vector<complex_t> R(tri(order+1, 0));
+	const double s = 1.0 / body_radius;
+	for (int i = 0; i < mesh.NUM_FACES; ++i)
+	{
+		double v[3][3];
+		for (int j = 0; j < 3; ++j)
+			for (int k = 0; k < 3; ++k)
+				v[j][k] = (mesh.hrij[(i*4+j)*3+k] - centre[k]) * s;
+		const double triple = v[0][0] * (v[1][1]*v[2][2] - v[1][2]*v[2][1])
+		                    + v[0][1] * (v[1][2]*v[2][0] - v[1][0]*v[2][2])
+		                    + v[0][2] * (v[1][0]*v[2][1] - v[1][1]*v[2][0]);
+
+		for (size_t iu = 0; iu < gx.size(); ++iu)
+		{
+			for (size_t iv = 0; iv < gx.size(); ++iv)
+			{
+				const double u = gx[iu], w = gx[iv];
+				double p[3];
+				for (int k = 0; k < 3; ++k)
+					p[k] = v[0][k] + u * (v[1][k] - v[0][k]) + u * w * (v[2][k] - v[1][k]);
+				regular_harmonics(p, order, R);
+				const double weight = gw[iu] * gw[iv] * u * triple;
+				for (int n = 0; n <= order; ++n)
+					for (int m = 0; m <= n; ++m)
+						M[tri(n, m)] += std::conj(R[tri(n, m)]) * (weight / (n + 3));
+			}
+		}
+	}
+
+	// coefficients of the gradient, with d/dz I_n^m = -I_(n+1)^m, (d/dx + i d/dy) I_n^m = I_(n+1)^(m+1),
+	// (d/dx - i d/dy) I_n^m = -I_(n+1)^(m-1) and the factor body_radius^3 (volume) / body_radius^2 (gradient)
+	std::vector<complex_t> G[3];
+	for (int k = 0; k < 3; ++k)
+		G[k].assign(tri(order+2, 0), complex_t(0.0, 0.0));
+	const complex_t I(0.0, 1.0);
+	for (int n = 0; n <= order; ++n)
+	{
+		for (int m = 0; m <= n; ++m)
+		{
+			const complex_t Mnm = M[tri(n, m)] * body_radius;
+			if (m == 0)
+			{
+				// d/dx I_n^0 = Re(I_(n+1)^1), d/dy I_n^0 = Im(I_(n+1)^1)
+				G[0][tri(n+1, 1)] += Mnm.real();
+				G[1][tri(n+1, 1)] += -I * Mnm.real();
+				G[2][tri(n+1, 0)] += -Mnm.real();
+			}
+			else
+			{
+				// the terms of -m and m are complex conjugates, both are included via Re() and a factor of 2
+				G[0][tri(n+1, m+1)] += Mnm;
+				G[0][tri(n+1, m-1)] -= Mnm;
+				G[1][tri(n+1, m+1)] += -I * Mnm;
+				G[1][tri(n+1, m-1)] += -I * Mnm;
+				G[2][tri(n+1, m)] += -2.0 * Mnm;
+			}
+		}
+	}
+
+	coefficients.assign(8 + 6 * (tri(order+2, 0) - 1), 0.0);
+	coefficients[0] = centre[0];
+	coefficients[1] = centre[1];
+	coefficients[2] = centre[2];
+	coefficients[3] = s;
+	coefficients[4] = this->radius * this->radius;
+	for (int n = 1; n <= order+1; ++n)
+	{
+		for (int m = 0; m <= n; ++m)
+		{
+			Real_t* c = &coefficients[8 + 6 * (tri(n, m) - 1)];
+			for (int k = 0; k < 3; ++k)
+			{
+				c[2*k+0] = G[k][tri(n, m)].real();
+				c[2*k+1] = G[k][tri(n, m)].imag();
+			}
+		}
+	}
+
+	std::cout << "multipole      : order " << order << ", body radius " << body_radius << " m, used beyond " << this->radius << " m" << std::endl;
+}
+
+bool BodyMultipole::isFar(const Real_t* pos) const
+{
+	if (order < 0)
+		return false;
+	const double d[3] = { pos[0] - coefficients[0], pos[1] - coefficients[1], pos[2] - coefficients[2] };
+	return d[0]*d[0] + d[1]*d[1] + d[2]*d[2] >= coefficients[4];
+}
+
+void BodyMultipole::Field(const Real_t* pos, Real_t* g) const
+{
+	const double x = (pos[0] - coefficients[0]) * coefficients[3];
+	const double y = (pos[1] - coefficients[1]) * coefficients[3];
+	const double z = (pos[2] - coefficients[2]) * coefficients[3];
+	const double q = 1.0 / (x*x + y*y + z*z);
+
+	g[0] = g[1] = g[2] = 0.0;
+	// I_m^m, starting with I_0^0 = 1/r
+	double dre = std::sqrt(q), dim = 0.0;
+	for (int m = 0; m <= order+1; ++m)
+	{
+		if (m > 0)
+		{
+			const double f = -(2*m - 1) * q;
+			const double t = f * (x * dre - y * dim);
+			dim = f * (x * dim + y * dre);
+			dre = t;
+		}
+		double pre = dre, pim = dim;   // I_(n-1)^m
+		double ppre = 0.0, ppim = 0.0; // I_(n-2)^m
+		for (int n = m; n <= order+1; ++n)
+		{
+			double ire = dre, iim = dim;
+			if (n > m)
+			{
+				const double a = (2*n - 1) * z * q;
+				const double b = (n + m - 1) * (n - m - 1) * q;
+				ire = a * pre - b * ppre;
+				iim = a * pim - b * ppim;
+				ppre = pre;
+				ppim = pim;
+				pre = ire;
+				pim = iim;
+			}
+			if (n > 0)
+			{
+				const Real_t* c = &coefficients[8 + 6 * (tri(n, m) - 1)];
+				g[0] += c[0] * ire - c[1] * iim;
+				g[1] += c[2] * ire - c[3] * iim;
+				g[2] += c[4] * ire - c[5] * iim;
+			}
+		}
+	}
+}
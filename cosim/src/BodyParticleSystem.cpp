@@ -5,7 +5,7 @@
 
 #include "BodyParticleSystem.h"
 
-#include <CL/cl.hpp>
+#include <algorithm>
 #include <utility>
 #include <iostream>
 #include <fstream>
@@ -13,332 +13,482 @@
 #include <cstdio>
 #include <cmath>
 #include <cstdlib>
-#include <cassert>
+#include <cerrno>
+#include <sstream>
 #include <sys/stat.h> // mkdir()
-#include "tiny_obj_loader.h"
+#include "Checkpoint.h"
 #include "ComputeConfig.h"
-
-#include "integrate_eom_kernel.h" // generated kernel header
-
-#define Real_t double
-
-void triangle_normal(double *aIn, double *bIn, double *cIn, double *nv)
-{
-	double a[3],b[3],c[3];
-	
-	a[0]=bIn[0]-aIn[0];
-	a[1]=bIn[1]-aIn[1];
-	a[2]=bIn[2]-aIn[2];
-	
-	b[0]=cIn[0]-aIn[0];
-	b[1]=cIn[1]-aIn[1];
-	b[2]=cIn[2]-aIn[2];
-	
-
-	c[0] = (a[1] * b[2]) - (a[2] * b[1]);
-	c[1] = (a[2] * b[0]) - (a[0] * b[2]);
-	c[2] = (a[0] * b[1]) - (a[1] * b[0]);
-
-    double norm = sqrt(c[0]*c[0]+c[1]*c[1]+c[2]*c[2]);
-	
-	nv[0] = c[0]/norm;
-	nv[1] = c[1]/norm;
-	nv[2] = c[2]/norm;
-}
-
-void prepare_gravity(Real_t nv[], Real_t rij[], Real_t cm[], int numfaces, std::vector<unsigned int>& fi, std::vector<float>& ev)
-{
-	for(int i = 0; i < numfaces; i++)
-	{
-		double a[3], b[3], c[3], d[3], nu[3];
-
-		int ain = fi[i*3+0];
-		int bin = fi[i*3+1];
-		int cin = fi[i*3+2];
-		
-		a[0] = ev[ain*3+0];
-		a[1] = ev[ain*3+1];
-		a[2] = ev[ain*3+2];
-		
-		b[0] = ev[bin*3+0];
-		b[1] = ev[bin*3+1];
-		b[2] = ev[bin*3+2];
-		
-		c[0] = ev[cin*3+0];
-		c[1] = ev[cin*3+1];
-		c[2] = ev[cin*3+2];
-		
-		d[0] = (a[0]+b[0]+c[0])/3.0;
-		d[1] = (a[1]+b[1]+c[1])/3.0;
-		d[2] = (a[2]+b[2]+c[2])/3.0;
-		
-		// face center
-		cm[i*3+0] = d[0];
-		cm[i*3+1] = d[1];
-		cm[i*3+2] = d[2];
-		
-		triangle_normal(a, b, c, nu);
-		
-		nv[i*3+0] = nu[0];
-		nv[i*3+1] = nu[1];
-		nv[i*3+2] = nu[2];
-
-		rij[(i*4+0)*3+0] = a[0];
-		rij[(i*4+0)*3+1] = a[1];
-		rij[(i*4+0)*3+2] = a[2];
-
-		rij[(i*4+1)*3+0] = b[0];
-		rij[(i*4+1)*3+1] = b[1];
-		rij[(i*4+1)*3+2] = b[2];
-
-		rij[(i*4+2)*3+0] = c[0];
-		rij[(i*4+2)*3+1] = c[1];
-		rij[(i*4+2)*3+2] = c[2];
-
-		rij[(i*4+3)*3+0] = a[0];
-		rij[(i*4+3)*3+1] = a[1];
-		rij[(i*4+3)*3+2] = a[2];
-	}
-}
+#include "CpuBackend.h"
+#include "MultiDeviceBackend.h"
+#ifdef COSIM_WITH_OPENCL
+#include "OpenCLBackend.h"
+#endif
 
 BodyParticleSystem::BodyParticleSystem(ComputeConfig& config)
-	: config(config), stats(config.step_count)
+	: config(config)
 {
 }
 
 BodyParticleSystem::~BodyParticleSystem()
 {
+	delete writer;
+	delete backend;
+	delete reference;
+
 	delete[] hposold;
 	delete[] hvelold;
-	delete[] hposnew;
-	delete[] hvelnew;
-
-	delete[] hnv;
-	delete[] hcm;
-	delete[] hrij;
 }
 
 void BodyParticleSystem::Initialize()
 {
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
+	mesh.Load(config);
+	if (config.multipole_radius > 0.0)
+		multipole.Compute(mesh, config.multipole_order, config.multipole_radius);
+	if (config.gravity_grid_levels > 0)
+		grid.Initialize(mesh, config.gravity_kernel == "shared_edge", config.gravity_grid_levels, config.gravity_grid_size,
+		                config.gravity_grid_file, config.cpu_thread_count);
 
-	std::string err = tinyobj::LoadObj(shapes, materials, config.comet_obj_file.c_str());
+	if (config.particle_count <= 0)
+		config.particle_count = mesh.NUM_FACES;
 
-	if (!err.empty()) {
-	  std::cerr << err << std::endl;
-	  exit(1);
+	// a distributed run propagates a contiguous range of the particles on each rank,
+	// from here on config.particle_count is the number of particles of this rank
+	if (config.particle_count < config.rank_count)
+	{
+		std::cerr << "PARTICLE_COUNT must be at least the number of ranks, exiting." << std::endl;
+		exit(EXIT_FAILURE);
 	}
-
-	std::cout << "# of shapes    : " << shapes.size() << std::endl;
-	std::cout << "# of materials : " << materials.size() << std::endl;
-
-    // float reads, but all derived and used quantities are doubles
-	std::vector<unsigned int> fi = shapes[0].mesh.indices; // face indices MatheMatica
-	std::vector<float> ev = shapes[0].mesh.positions; // vertices MatheMatica
-
-	NUM_VERTICES_PER_FACE = 3;
-	NUM_FACES = shapes[0].mesh.indices.size() / NUM_VERTICES_PER_FACE;
-
-	assert(NUM_VERTICES_PER_FACE == 3);
-	assert(NUM_VERTICES_PER_FACE % NUM_VERTICES_PER_FACE == 0);
-
-	if (config.particle_count <= 0)
-		config.particle_count = NUM_FACES;
+	const long long total_count = config.particle_count;
+	first_particle = static_cast<int>(total_count * config.rank / config.rank_count);
+	config.particle_count = static_cast<int>(total_count * (config.rank + 1) / config.rank_count) - first_particle;
+	if (config.rank_count > 1)
+		std::cout << "rank " << config.rank << " of " << config.rank_count << ": particles " << first_particle << " .. "
+		          << first_particle + config.particle_count - 1 << " of " << total_count << std::endl;
 
 	hposold  = new Real_t[4*config.particle_count];
 	hvelold  = new Real_t[4*config.particle_count];
-	hposnew  = new Real_t[4*config.particle_count];
-	hvelnew  = new Real_t[4*config.particle_count];
 
-	hnv      = new Real_t[3*NUM_FACES];
-	hcm      = new Real_t[3*NUM_FACES];
-	hrij     = new Real_t[3*4*NUM_FACES];
+	// compute backend, the mesh is transferred once
+#ifdef COSIM_WITH_OPENCL
+	if (config.backend == "opencl" && config.opencl_device_list.size() > 1)
+	{
+		std::vector<ComputeBackend*> devices;
+		std::vector<std::string> names;
+		for (const auto& device : config.opencl_device_list)
+		{
+			devices.push_back(new OpenCLBackend(config, mesh, multipole, grid, device.first, device.second));
+			names.push_back(std::to_string(device.first) + ":" + std::to_string(device.second));
+		}
+		backend = new MultiDeviceBackend(config, mesh, multipole, grid, devices, names);
+	}
+	else if (config.backend == "opencl")
+		backend = new OpenCLBackend(config, mesh, multipole, grid);
+#endif
+	if (config.backend == "cpu")
+		backend = new CpuBackend(config, mesh, multipole, grid);
+	if (!backend)
+	{
+		std::cerr << "BACKEND=" << config.backend << " is not available in this build, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	backend->Initialize();
+
+	if (config.precision_validation)
+	{
+		// same particles, field shortcuts and collision test, but in double precision
+		reference = new CpuBackend(config, mesh, multipole, grid);
+		reference->Initialize();
+	}
 
-    // hnv: normal vectors, hrij: collect 4 vertices per triangle last=copy op first vertex, hcm: center of triangle
-	prepare_gravity(hnv, hrij, hcm, NUM_FACES, fi, ev);
+	if (config.multipole_validation && multipole.isEnabled())
+	{
+		// worst case: points on the sphere where the expansion is switched on
+		const int count = 1000;
+		std::vector<Real_t> sphere(4 * count, 0.0);
+		for (int i = 0; i < count; ++i)
+		{
+			const double z = 1.0 - (2.0 * i + 1.0) / count;
+			const double rho = std::sqrt(1.0 - z * z);
+			const double phi = i * 2.399963229728653; // golden angle
+			sphere[i*4+0] = multipole.getCentre()[0] + multipole.getRadius() * rho * std::cos(phi);
+			sphere[i*4+1] = multipole.getCentre()[1] + multipole.getRadius() * rho * std::sin(phi);
+			sphere[i*4+2] = multipole.getCentre()[2] + multipole.getRadius() * z;
+		}
+		ValidateMultipole(sphere, "at the multipole radius");
+	}
+
+	writer = new SnapshotWriter(*backend, config.particle_count, config.output_ring_depth, config.output_format == "binary");
+}
 
+void BodyParticleSystem::InitialState()
+{
     // initial positions and velocities
 	for(int ip = 0; ip < config.particle_count; ip++)
 	{
-		hposold[ip*4+0] = hcm[ip*3+0]+config.particle_initial_height*hnv[ip*3+0];
-		hposold[ip*4+1] = hcm[ip*3+1]+config.particle_initial_height*hnv[ip*3+1];
-		hposold[ip*4+2] = hcm[ip*3+2]+config.particle_initial_height*hnv[ip*3+2];
+		const int face = first_particle + ip;
+		hposold[ip*4+0] = mesh.hcm[face*3+0]+config.particle_initial_height*mesh.hnv[face*3+0];
+		hposold[ip*4+1] = mesh.hcm[face*3+1]+config.particle_initial_height*mesh.hnv[face*3+1];
+		hposold[ip*4+2] = mesh.hcm[face*3+2]+config.particle_initial_height*mesh.hnv[face*3+2];
 		hposold[ip*4+3] = 0.0;
 
-		hvelold[ip*4+0] = hnv[ip*3+0]*config.particle_initial_velocity;
-		hvelold[ip*4+1] = hnv[ip*3+1]*config.particle_initial_velocity;
-		hvelold[ip*4+2] = hnv[ip*3+2]*config.particle_initial_velocity;
+		hvelold[ip*4+0] = mesh.hnv[face*3+0]*config.particle_initial_velocity;
+		hvelold[ip*4+1] = mesh.hnv[face*3+1]*config.particle_initial_velocity;
+		hvelold[ip*4+2] = mesh.hnv[face*3+2]*config.particle_initial_velocity;
 		hvelold[ip*4+3] = 0.0;
 	}
-}
 
-void BodyParticleSystem::InitializeOpenCL()
-{
-	// Get available platforms
-	std::vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-
-	// Select platform from config and create a context
-	cl_context_properties cps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[config.opencl_platform_id])(), 0 };
-	context = cl::Context(CL_DEVICE_TYPE_ALL, cps);
-
-	// Get a list of devices on this platform
-	std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
-
-	// Create a command queue and use the device from config
-	queue = cl::CommandQueue(context, devices[config.opencl_device_id], CL_QUEUE_PROFILING_ENABLE);
-
-	// Read source file
-//	std::ifstream sourceFile_eom("cl/integrate_eom_kernel.cl");
-//	std::string sourceCode_eom(std::istreambuf_iterator<char>(sourceFile_eom),(std::istreambuf_iterator<char>()));
-//	Program::Sources source_eom(1, std::make_pair(sourceCode_eom.c_str(), sourceCode_eom.length()+1));
-	// NOTE: use kernel string from generated include file
-	cl::Program::Sources source_eom(1, std::make_pair((const char*)integrate_eom_kernel_cl, integrate_eom_kernel_cl_len));
-	// Make program of the source code in the context
-	program_eom = cl::Program(context, source_eom);
-	// Build program for these specific devices, compiler argument to include local directory for header files (.h)
-	program_eom.build(devices, "");
-	cl_int err = 0;
-	std::string buildInfo = program_eom.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[config.opencl_device_id], &err);
-	std::cout << "BuildInfo: " << buildInfo << std::endl;
-
-	if (err != CL_SUCCESS)
+	// continue from the exact state of a checkpoint
+	if (!config.restart.empty())
 	{
-		std::cout << "OpenCL kernel build failed, exiting." << std::endl;
-		exit(EXIT_FAILURE);
+		const std::string filename = checkpoint::Filename(config.restart, config.rank, config.rank_count);
+		checkpoint::Header header = checkpoint::MakeHeader(config, mesh, first_particle, 0);
+		checkpoint::Read(filename, header, hposold, hvelold);
+		start_step = static_cast<int>(header.step);
+		std::cout << "Restarting from step " << start_step << " of checkpoint '" << filename << "'" << std::endl;
 	}
-	
-	// Make kernel
-	kernel_eom = cl::Kernel(program_eom, "integrate_eom");
-	fprintf(stderr,"building integrate_eom done\n");
-
-
-	// Create memory buffers on OpenCL device and populate them with the initial data
-	gposold  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * sizeof(Real_t));
-	gvelold  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * sizeof(Real_t));
-	gposnew  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * sizeof(Real_t));
-	gvelnew  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * sizeof(Real_t));
-	gnv      = cl::Buffer(context, CL_MEM_READ_ONLY,  3*NUM_FACES * sizeof(Real_t));
-	grij     = cl::Buffer(context, CL_MEM_READ_ONLY,  4*3*NUM_FACES * sizeof(Real_t));
-
-	// Set invariant kernel arguments
-	kernel_eom.setArg( 4, gnv);
-	kernel_eom.setArg( 5, grij);
-	kernel_eom.setArg( 6, config.particle_count);
-	kernel_eom.setArg( 7, NUM_FACES);
-	kernel_eom.setArg( 8, NUM_VERTICES_PER_FACE );	
-	kernel_eom.setArg( 9, config.delta_t);
-	kernel_eom.setArg(10, config.comet_angular_frequency);
-	kernel_eom.setArg(11, config.const_gravity * config.comet_density);
-
-	// transfer initial data
-	queue.enqueueWriteBuffer(gposold, CL_TRUE, 0, 4*config.particle_count * sizeof(Real_t), hposold);
-	queue.enqueueWriteBuffer(gvelold, CL_TRUE, 0, 4*config.particle_count * sizeof(Real_t), hvelold);
-	queue.enqueueWriteBuffer(gnv    , CL_TRUE, 0, 3*NUM_FACES * sizeof(Real_t), hnv);
-	queue.enqueueWriteBuffer(grij   , CL_TRUE, 0, 4*3*NUM_FACES * sizeof(Real_t), hrij);
 }
 
-void BodyParticleSystem::PropagateStep()
+void BodyParticleSystem::WriteState(int it)
+{
+	// generate filename
+	char name[500];
+	sprintf(name, (config.output_format == "binary") ? "p%06d.bin" : "p%06d.dat", it);
+	const std::string filename = output.Path(name);
+	std::cout << "Writing to: " << filename << std::endl;
+
+	// transfer memory back to CPU and write the file while the propagation continues
+	writer->Write(filename, it, it * config.delta_t);
+}
+
+void BodyParticleSystem::LogImpacts()
+{
+	std::vector<ImpactEvent> events;
+	backend->GetImpacts(events);
+	if (!events.empty())
+		writer->WriteImpacts(events);
+}
+
+void BodyParticleSystem::ValidateMultipole(const std::vector<Real_t>& pos, const char* where)
 {
-	// double buffering scheme
-	if (step_counter % 2 == 0)
+	const int count = pos.size() / 4;
+	if (count == 0)
 	{
-		kernel_eom.setArg( 0, gposold);
-		kernel_eom.setArg( 1, gvelold);
-		kernel_eom.setArg( 2, gposnew);
-		kernel_eom.setArg( 3, gvelnew);
+		std::cout << "Multipole validation " << where << ": no positions" << std::endl;
+		return;
 	}
-	else
+	std::vector<Real_t> g(3 * count), thetasum(count);
+	// NOTE: the shared-edge formulation is the reference, the per-face terms of the other formulations cancel far away
+	cpu_exact_field(mesh, true, pos.data(), count, g.data(), thetasum.data());
+
+	double max_error = 0.0;
+	for (int i = 0; i < count; ++i)
 	{
-		kernel_eom.setArg(0, gposnew);
-		kernel_eom.setArg(1, gvelnew);
-		kernel_eom.setArg(2, gposold);
-		kernel_eom.setArg(3, gvelold);
+		Real_t gm[3];
+		multipole.Field(&pos[i*4], gm);
+		const double d[3] = { gm[0] - g[i*3+0], gm[1] - g[i*3+1], gm[2] - g[i*3+2] };
+		const double error = std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2])
+		                   / std::sqrt(g[i*3+0]*g[i*3+0] + g[i*3+1]*g[i*3+1] + g[i*3+2]*g[i*3+2]);
+		max_error = std::max(max_error, error);
 	}
-	// Run the kernel on specific ND range
-	cl::NDRange global(config.particle_count);
-	cl::Event event;
-
-	queue.enqueueNDRangeKernel(kernel_eom, cl::NullRange, global, cl::NullRange, 0, &event);
-	event.wait();
-
-	double t_start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-	double t_end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-	stats.add(static_cast<ham::util::time::rep>(t_end - t_start));
-	
-	++step_counter;
+	const std::streamsize precision = std::cout.precision(3);
+	const std::ios_base::fmtflags flags = std::cout.setf(std::ios_base::scientific, std::ios_base::floatfield);
+	std::cout << "Multipole validation " << where << ": max. relative error " << max_error << " at " << count << " positions" << std::endl;
+	std::cout.flags(flags);
+	std::cout.precision(precision);
 }
 
-void BodyParticleSystem::WriteState(const std::string& pathPrefix, int it)
+void BodyParticleSystem::ValidatePrecision(int it)
 {
-	// generate filename
-	char filename[500];
-	sprintf(filename, "%s/p%06d.dat", pathPrefix.c_str(), it);
-	std::cout << "Writing to: " << filename << std::endl;
-
-	// transfer memory back to CPU
-	queue.enqueueReadBuffer(gposold, CL_TRUE, 0, 4*config.particle_count*sizeof(Real_t), hposold);
-	queue.enqueueReadBuffer(gvelold, CL_TRUE, 0, 4*config.particle_count*sizeof(Real_t), hvelold);
-	FILE *fd = fopen(filename,"w");
-	for(int i = 0; i < config.particle_count; ++i)
+	std::vector<Real_t> pos(4 * config.particle_count), vel(4 * config.particle_count);
+	std::vector<Real_t> rpos(4 * config.particle_count), rvel(4 * config.particle_count);
+	backend->GetParticles(config.particle_count, pos.data(), vel.data());
+	reference->GetParticles(config.particle_count, rpos.data(), rvel.data());
+
+	char name[500];
+	sprintf(name, "precision_%06d.dat", it);
+	std::ofstream file(output.Path(name));
+	file.precision(9);
+	file << std::scientific;
+	file << "# particle, |position - reference| (m), |velocity - reference| (m/s), status, reference status" << std::endl;
+
+	double max_dpos = 0.0, sum_dpos = 0.0, max_dvel = 0.0;
+	int status_mismatch = 0;
+	for (int i = 0; i < config.particle_count; ++i)
 	{
-		fprintf(fd,"%f %f %f %f"   , hposold[i*4+0], hposold[i*4+1], hposold[i*4+2], hposold[i*4+3]);
-		fprintf(fd," %f %f %f %f\n", hvelold[i*4+0], hvelold[i*4+1], hvelold[i*4+2], hvelold[i*4+3]);
+		const Real_t* p = &pos[i*4];
+		const Real_t* v = &vel[i*4];
+		const Real_t* rp = &rpos[i*4];
+		const Real_t* rv = &rvel[i*4];
+		const double dpos = std::sqrt((p[0]-rp[0])*(p[0]-rp[0]) + (p[1]-rp[1])*(p[1]-rp[1]) + (p[2]-rp[2])*(p[2]-rp[2]));
+		const double dvel = std::sqrt((v[0]-rv[0])*(v[0]-rv[0]) + (v[1]-rv[1])*(v[1]-rv[1]) + (v[2]-rv[2])*(v[2]-rv[2]));
+		file << first_particle + i << " " << dpos << " " << dvel << " " << v[3] << " " << rv[3] << std::endl;
+		// NOTE: particles re-collided in only one of the runs do not count towards the divergence
+		if (v[3] != rv[3])
+		{
+			++status_mismatch;
+			continue;
+		}
+		max_dpos = std::max(max_dpos, dpos);
+		max_dvel = std::max(max_dvel, dvel);
+		sum_dpos += dpos;
 	}
-	fclose(fd);
+	const int count = config.particle_count - status_mismatch;
+	const std::streamsize precision = std::cout.precision(3);
+	const std::ios_base::fmtflags flags = std::cout.setf(std::ios_base::scientific, std::ios_base::floatfield);
+	std::cout << "Precision validation (" << config.precision << " vs. double): max. divergence " << max_dpos << " m, mean "
+	          << ((count > 0) ? sum_dpos / count : 0.0) << " m, max. velocity divergence " << max_dvel << " m/s, "
+	          << status_mismatch << " particles with a different status" << std::endl;
+	std::cout.flags(flags);
+	std::cout.precision(precision);
 }
 
-void BodyParticleSystem::GetParticles(int NumBodies, Real_t *pos, Real_t *vel )
+void BodyParticleSystem::ResetJacobi()
 {
-	// transfer memory from OpenCL device to CPU
-	queue.enqueueReadBuffer(gposold, CL_TRUE, 0, 4*NumBodies*sizeof(Real_t), pos);
-	queue.enqueueReadBuffer(gvelold, CL_TRUE, 0, 4*NumBodies*sizeof(Real_t), vel);
-	queue.finish();
+	// NOTE: the reference is 0 before, the drift is the Jacobi constant itself
+	std::vector<Real_t> diag(4 * config.particle_count), jacobi(config.particle_count);
+	backend->Diagnostics(config.particle_count, diag.data());
+	for (int i = 0; i < config.particle_count; ++i)
+		jacobi[i] = diag[i*4+1];
+	backend->PutJacobiReference(config.particle_count, jacobi.data());
 }
 
-void BodyParticleSystem::PutParticles(int NumBodies, Real_t *pos, Real_t *vel )
+void BodyParticleSystem::ReportJacobi(int it)
 {
-	// transfer memory from CPU to OpenCL device
-	queue.enqueueWriteBuffer(gposold, CL_TRUE, 0, 4*NumBodies * sizeof(Real_t), pos);
-	queue.enqueueWriteBuffer(gvelold, CL_TRUE, 0, 4*NumBodies * sizeof(Real_t), vel);
-	queue.finish();
+	// the per-particle values are only transferred for the output
+	std::vector<Real_t> diag(config.jacobi_output ? 4 * config.particle_count : 0);
+	const JacobiDrift drift = backend->Diagnostics(config.particle_count, config.jacobi_output ? diag.data() : nullptr);
+	if (config.jacobi_output)
+	{
+		char name[500];
+		sprintf(name, "jacobi_%06d.dat", it);
+		std::ofstream file(output.Path(name));
+		file.precision(9);
+		file << std::scientific;
+		file << "# particle, potential (m^2/s^2), Jacobi constant (m^2/s^2), drift since the start (m^2/s^2), status" << std::endl;
+		for (int i = 0; i < config.particle_count; ++i)
+			file << first_particle + i << " " << diag[i*4+0] << " " << diag[i*4+1] << " " << diag[i*4+2] << " " << diag[i*4+3] << std::endl;
+	}
+	if (!config.jacobi_report)
+		return;
+
+	const std::streamsize precision = std::cout.precision(3);
+	const std::ios_base::fmtflags flags = std::cout.setf(std::ios_base::scientific, std::ios_base::floatfield);
+	std::cout << "Jacobi constant drift (" << config.integrator << "): min. " << drift.min << " m^2/s^2, max. " << drift.max
+	          << " m^2/s^2, mean " << ((drift.count > 0) ? drift.sum / drift.count : 0.0) << " m^2/s^2, mean absolute "
+	          << ((drift.count > 0) ? drift.sum_abs / drift.count : 0.0) << " m^2/s^2 of " << drift.count << " active particles" << std::endl;
+	std::cout.flags(flags);
+	std::cout.precision(precision);
 }
 
 void BodyParticleSystem::RunSimulation()
 {
 	Initialize();
-	InitializeOpenCL();
-	PutParticles(config.particle_count, hposold, hvelold);
+	InitialState();
 
 	const std::string& configFilename = config.getConfigParser().getFilename();
-	const std::string& pathPrefix = configFilename.substr(0, configFilename.find_last_of('.'));
+	Propagate(configFilename.substr(0, configFilename.find_last_of('.')));
+}
 
-    if (mkdir(pathPrefix.c_str(), 0755) == -1) {
+void BodyParticleSystem::RunSweep(const std::string& sweepFilename)
+{
+	// swept keys, they do not change the mesh, field tables, buffers or device programs
+	const std::pair<const char*, double ComputeConfig::*> sweepable[] = {
+		{ "PARTICLE_INITIAL_VELOCITY", &ComputeConfig::particle_initial_velocity },
+		{ "PARTICLE_INITIAL_HEIGHT", &ComputeConfig::particle_initial_height },
+		{ "COMET_DENSITY", &ComputeConfig::comet_density },
+		{ "COMET_ANGULAR_FREQUENCY", &ComputeConfig::comet_angular_frequency },
+		{ "DELTA_T", &ComputeConfig::delta_t } };
+
+	// KEY=value,value,... per line, all combinations are run
+	ConfigParser sweepParser(sweepFilename);
+	if (!sweepParser.isValid())
+	{
+		std::cerr << "Sweep file '" << sweepFilename << "' not found, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector<std::string> keys = sweepParser.getKeys();
+	std::vector<double ComputeConfig::*> members;
+	std::vector<std::vector<double>> values;
+	size_t variant_count = 1;
+	for (const std::string& key : keys)
+	{
+		auto entry = std::find_if(std::begin(sweepable), std::end(sweepable), [&](const std::pair<const char*, double ComputeConfig::*>& s) { return key == s.first; });
+		if (entry == std::end(sweepable))
+		{
+			std::cerr << "Key " << key << " cannot be swept, only PARTICLE_INITIAL_VELOCITY, PARTICLE_INITIAL_HEIGHT, COMET_DENSITY, "
+			          << "COMET_ANGULAR_FREQUENCY and DELTA_T, exiting." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		members.push_back(entry->second);
+		values.emplace_back();
+		std::istringstream list(sweepParser.getStringKeyValue(key));
+		std::string value;
+		while (std::getline(list, value, ','))
+		{
+			char* end = nullptr;
+			values.back().push_back(strtod(value.c_str(), &end));
+			if (end == value.c_str() || *end != '\0')
+			{
+				std::cerr << "Invalid value '" << value << "' of " << key << " in '" << sweepFilename << "', exiting." << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		variant_count *= values.back().size();
+	}
+	if (keys.empty() || variant_count == 0)
+	{
+		std::cerr << "No variants in sweep file '" << sweepFilename << "', exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (!config.restart.empty())
+	{
+		std::cerr << "A sweep cannot be restarted, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// mesh, field tables and backend are set up once for all variants
+	Initialize();
+	const std::string& configFilename = config.getConfigParser().getFilename();
+	const std::string pathPrefix = configFilename.substr(0, configFilename.find_last_of('.'));
+	if (mkdir(pathPrefix.c_str(), 0755) == -1 && (errno != EEXIST || config.rank_count == 1))
+	{
+		std::cout << "Could not create directory '" << pathPrefix << "', exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::ofstream manifest;
+	if (config.rank == 0)
+	{
+		manifest.open(pathPrefix + "/sweep.txt");
+		manifest << "# directory";
+		for (const std::string& key : keys)
+			manifest << " " << key;
+		manifest << std::endl;
+	}
+
+	for (size_t v = 0; v < variant_count; ++v)
+	{
+		// the last key varies fastest
+		char name[32];
+		sprintf(name, "v%04d", static_cast<int>(v));
+		size_t index = v;
+		for (size_t k = keys.size(); k-- > 0; )
+		{
+			config.*members[k] = values[k][index % values[k].size()];
+			index /= values[k].size();
+		}
+		std::ostringstream assignments, columns;
+		assignments.precision(17);
+		columns.precision(17);
+		for (size_t k = 0; k < keys.size(); ++k)
+		{
+			assignments << " " << keys[k] << "=" << config.*members[k];
+			columns << " " << config.*members[k];
+		}
+		std::cout << "Sweep variant " << name << " (" << v + 1 << " of " << variant_count << "):" << assignments.str() << std::endl;
+		if (manifest.is_open())
+			manifest << name << columns.str() << std::endl;
+
+		backend->UpdateParameters();
+		if (reference)
+			reference->UpdateParameters();
+		InitialState();
+		Propagate(pathPrefix + "/" + name);
+	}
+}
+
+void BodyParticleSystem::Propagate(const std::string& pathPrefix)
+{
+	backend->PutParticles(config.particle_count, hposold, hvelold);
+	if (reference)
+		reference->PutParticles(config.particle_count, hposold, hvelold);
+	// escaped particles record their step
+	backend->SetStep(start_step);
+	if (reference)
+		reference->SetStep(start_step);
+	if (config.jacobi_report || config.jacobi_output)
+		ResetJacobi();
+
+    // the ranks of a distributed run share the directory, a restart continues in it
+    if (mkdir(pathPrefix.c_str(), 0755) == -1 && (errno != EEXIST || (config.rank_count == 1 && config.restart.empty()))) {
 	    std::cout << "Could not create directory '" << pathPrefix << "', exiting." << std::endl;
         exit(EXIT_FAILURE);
     }
+	output.Initialize(pathPrefix, config.rank, config.rank_count);
+	if (config.escape_criterion != "off")
+		writer->LogEscapes(output.Path("escapes.dat"), first_particle, hvelold, config.restart.empty() ? -1 : start_step);
+	if (config.impact_log)
+		writer->LogImpacts(output.Path("impacts.bin"), first_particle, config.delta_t, config.restart.empty() ? -1 : start_step);
     
     std::cout.precision(8);
 	std::cout << std::fixed;
     
 	time_t c0, c1;
 	time(&c0);
-	int it = 0;
-	WriteState(pathPrefix, it); // write initial state
-	for(it = 1; it <= config.step_count; ++it) // main propagation loop
+	int it = start_step;
+	if (it % config.output_step_count == 0)
+		WriteState(it); // write initial state
+	while (it < config.step_count) // main propagation loop
 	{
-		PropagateStep();
+		// propagate without synchronisation up to the next output or compaction step
+		int steps = config.output_step_count - it % config.output_step_count;
+		if (config.compaction_step_count > 0)
+			steps = std::min(steps, config.compaction_step_count - it % config.compaction_step_count);
+		if (config.checkpoint_step_count > 0)
+			steps = std::min(steps, config.checkpoint_step_count - it % config.checkpoint_step_count);
+		steps = std::min(steps, config.step_count - it);
+		backend->PropagateSteps(steps);
+		if (reference)
+			reference->PropagateSteps(steps);
+		it += steps;
+
+		if (config.compaction_step_count > 0 && it % config.compaction_step_count == 0)
+		{
+			backend->CompactParticles();
+			if (reference)
+				reference->CompactParticles();
+		}
 		if ((it) % config.output_step_count == 0)
 		{
-			WriteState(pathPrefix, it);
-			// output current statistics
-			auto avg_s = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1>>>(stats.average());
-			std::cout << "Average OpenCL kernel runtime per iteration: " << avg_s.count() << " s" << std::endl;
+			WriteState(it);
+			if (reference)
+				ValidatePrecision(it);
+			if (config.multipole_validation && multipole.isEnabled())
+			{
+				// active particles beyond the multipole radius
+				backend->GetParticles(config.particle_count, hposold, hvelold);
+				std::vector<Real_t> far;
+				for (int i = 0; i < config.particle_count; ++i)
+					if (hvelold[i*4+3] == 0.0 && multipole.isFar(&hposold[i*4]))
+						far.insert(far.end(), &hposold[i*4], &hposold[i*4+4]);
+				ValidateMultipole(far, "of the particles");
+			}
+			if (config.jacobi_report || config.jacobi_output)
+				ReportJacobi(it);
+			// output current statistics, including the launches still running
+			backend->Synchronize();
+			if (config.impact_log)
+				LogImpacts();
+			auto avg_s = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1>>>(backend->getStatistics().average());
+			std::cout << "Average " << backend->getName() << " runtime per iteration: " << avg_s.count() << " s, active particles: " << backend->getActiveCount() << std::endl;
+		}
+		if (config.checkpoint_step_count > 0 && it % config.checkpoint_step_count == 0)
+		{
+			// a restart keeps the logged impacts before the checkpoint step, log them ahead of the checkpoint
+			if (config.impact_log)
+			{
+				backend->Synchronize();
+				LogImpacts();
+			}
+			// written by the output thread while the propagation continues
+			const std::string filename = checkpoint::Filename(pathPrefix + "/checkpoint.bin", config.rank, config.rank_count);
+			writer->WriteCheckpoint(filename, checkpoint::MakeHeader(config, mesh, first_particle, it));
 		}
 	}
 	// NOTE: no final write, to have only equidistant simulation time intervalls between output values
+	if (config.impact_log)
+		LogImpacts();
+	writer->Finish();
+	output.Finish();
 	time(&c1);
 	fprintf(stderr, "Simulation for %d particles over %d steps took %.0f s\n", config.particle_count, config.step_count, difftime(c1, c0));
 }
-
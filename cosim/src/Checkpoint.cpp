@@ -0,0 +1,152 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "Checkpoint.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <unistd.h> // fsync()
+
+namespace checkpoint {
+
+namespace {
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t bytes)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < bytes; ++i)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+} // namespace
+
+uint64_t ConfigKey(const ComputeConfig& config)
+{
+	std::ostringstream values;
+	values.precision(17);
+	values << config.comet_density << " " << config.comet_angular_frequency << " " << config.particle_initial_velocity << " "
+	       << config.particle_initial_height << " " << config.delta_t << " " << config.gravity_kernel << " " << config.precision << " "
+	       << config.collision_test << " " << config.multipole_radius << " " << config.multipole_order << " "
+	       << config.gravity_grid_levels << " " << config.gravity_grid_size;
+	if (config.adaptive_tolerance > 0.0) // keys of fixed step runs stay valid
+		values << " " << config.adaptive_tolerance;
+	if (config.integrator != "kick_drift")
+		values << " " << config.integrator;
+	if (config.escape_criterion != "off")
+		values << " " << config.escape_criterion << " " << config.escape_radius;
+	const std::string s = values.str();
+	return fnv1a(14695981039346656037ull, s.data(), s.size());
+}
+
+uint64_t MeshKey(const BodyMesh& mesh)
+{
+	return fnv1a(14695981039346656037ull, mesh.hrij, 4*3*mesh.NUM_FACES * sizeof(Real_t));
+}
+
+Header MakeHeader(const ComputeConfig& config, const BodyMesh& mesh, int first_particle, int step)
+{
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.byte_order = BYTE_ORDER_MARK;
+	header.real_size = sizeof(Real_t);
+	header.rank = config.rank;
+	header.rank_count = config.rank_count;
+	header.step = step;
+	header.first_particle = first_particle;
+	header.particle_count = config.particle_count;
+	header.config_key = ConfigKey(config);
+	header.mesh_key = MeshKey(mesh);
+	return header;
+}
+
+std::string Filename(const std::string& filename, int rank, int rank_count)
+{
+	if (rank_count == 1)
+		return filename;
+	char suffix[16];
+	sprintf(suffix, ".%04d", rank);
+	return filename + suffix;
+}
+
+bool Write(const std::string& filename, const Header& header, const Real_t* pos, const Real_t* vel)
+{
+	// written and synced to a temporary file first, replaces the previous checkpoint only when complete
+	const std::string tmp_file = filename + ".tmp";
+	FILE *fd = fopen(tmp_file.c_str(), "wb");
+	if (!fd)
+	{
+		std::cerr << "Could not write checkpoint '" << filename << "'." << std::endl;
+		return false;
+	}
+	const size_t count = 4 * header.particle_count;
+	bool ok = fwrite(&header, sizeof(header), 1, fd) == 1
+		&& fwrite(pos, sizeof(Real_t), count, fd) == count
+		&& fwrite(vel, sizeof(Real_t), count, fd) == count;
+	ok = ok && fflush(fd) == 0 && fsync(fileno(fd)) == 0;
+	ok = (fclose(fd) == 0) && ok;
+	if (!ok || rename(tmp_file.c_str(), filename.c_str()) != 0)
+	{
+		std::cerr << "Could not write checkpoint '" << filename << "'." << std::endl;
+		remove(tmp_file.c_str());
+		return false;
+	}
+	return true;
+}
+
+void Read(const std::string& filename, Header& header, Real_t* pos, Real_t* vel)
+{
+	FILE *fd = fopen(filename.c_str(), "rb");
+	if (!fd)
+	{
+		std::cerr << "Could not read checkpoint '" << filename << "', exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	Header stored;
+	const bool valid = fread(&stored, sizeof(stored), 1, fd) == 1
+		&& std::memcmp(stored.magic, MAGIC, sizeof(MAGIC)) == 0
+		&& stored.version == VERSION
+		&& stored.byte_order == BYTE_ORDER_MARK
+		&& stored.real_size == sizeof(Real_t);
+	if (!valid)
+	{
+		std::cerr << "'" << filename << "' is not a valid checkpoint, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (stored.rank != header.rank || stored.rank_count != header.rank_count)
+	{
+		std::cerr << "Checkpoint '" << filename << "' is of rank " << stored.rank << " of " << stored.rank_count << ", exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (stored.config_key != header.config_key || stored.particle_count != header.particle_count
+		|| stored.first_particle != header.first_particle)
+	{
+		std::cerr << "Checkpoint '" << filename << "' was written with a different configuration, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (stored.mesh_key != header.mesh_key)
+	{
+		std::cerr << "Checkpoint '" << filename << "' was written for a different mesh, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	const size_t count = 4 * stored.particle_count;
+	if (fread(pos, sizeof(Real_t), count, fd) != count || fread(vel, sizeof(Real_t), count, fd) != count)
+	{
+		std::cerr << "Checkpoint '" << filename << "' is truncated, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	fclose(fd);
+	header = stored;
+}
+
+} // namespace checkpoint
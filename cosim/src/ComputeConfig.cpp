@@ -4,13 +4,24 @@
 
 #include "ComputeConfig.h"
 
+#include "BodyMesh.h"
+
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 
-ComputeConfig::ComputeConfig(ConfigParser& configParser) : configParser(configParser)
+ComputeConfig::ComputeConfig(const ConfigParser& configParser) : configParser(configParser)
 {
-	read(configParser);
+	try
+	{
+		read(configParser);
+	}
+	catch (const ConfigParser::Error& e)
+	{
+		std::cerr << e.what() << std::endl;
+		exit(-1);
+	}
 }
 
 const ConfigParser& ComputeConfig::getConfigParser() const
@@ -18,10 +29,48 @@ const ConfigParser& ComputeConfig::getConfigParser() const
 	return configParser;
 }
 
-void ComputeConfig::read(ConfigParser& configParser)
+void ComputeConfig::read(const ConfigParser& configParser)
 {
-	opencl_platform_id = configParser.getIntKeyValue("OPENCL_PLATFORM_ID");
-	opencl_device_id = configParser.getIntKeyValue("OPENCL_DEVICE_ID");
+	backend = configParser.getStringKeyValueOr("BACKEND", "opencl");
+	if (backend != "opencl" && backend != "cpu")
+	{
+		std::cerr << "Unknown BACKEND: " << backend << std::endl;
+		exit(-1);
+	}
+
+	// several OpenCL devices as platform:device,platform:device,...
+	opencl_devices = configParser.getStringKeyValueOr("OPENCL_DEVICES", "");
+	opencl_device_list.clear();
+	std::istringstream devices(opencl_devices);
+	std::string device;
+	while (std::getline(devices, device, ','))
+	{
+		std::istringstream entry(device);
+		int platform_id = -1, device_id = -1;
+		char colon = 0;
+		if (!(entry >> platform_id >> colon >> device_id) || colon != ':' || !(entry >> std::ws).eof())
+		{
+			std::cerr << "Invalid OPENCL_DEVICES entry: '" << device << "', expected platform:device." << std::endl;
+			exit(-1);
+		}
+		opencl_device_list.push_back(std::make_pair(platform_id, device_id));
+	}
+	opencl_rebalance = configParser.getDoubleKeyValueOr("OPENCL_REBALANCE", 1.1);
+	if (opencl_rebalance != 0.0 && opencl_rebalance < 1.0)
+	{
+		std::cerr << "OPENCL_REBALANCE must be 0 or at least 1." << std::endl;
+		exit(-1);
+	}
+
+	// OpenCL device selection is only required for the OpenCL backend without OPENCL_DEVICES
+	const bool single_device = (backend == "opencl" && opencl_device_list.empty());
+	opencl_platform_id = single_device ? configParser.getIntKeyValue("OPENCL_PLATFORM_ID") : configParser.getIntKeyValueOr("OPENCL_PLATFORM_ID", 0);
+	opencl_device_id = single_device ? configParser.getIntKeyValue("OPENCL_DEVICE_ID") : configParser.getIntKeyValueOr("OPENCL_DEVICE_ID", 0);
+	if (opencl_device_list.size() == 1)
+	{
+		opencl_platform_id = opencl_device_list[0].first;
+		opencl_device_id = opencl_device_list[0].second;
+	}
 	step_count = configParser.getIntKeyValue("STEP_COUNT");
 	output_step_count = configParser.getIntKeyValue("OUTPUT_STEP_COUNT");
 
@@ -40,6 +89,124 @@ void ComputeConfig::read(ConfigParser& configParser)
 	particle_initial_velocity = configParser.getDoubleKeyValue("PARTICLE_INITIAL_VELOCITY");
 	particle_initial_height = configParser.getDoubleKeyValue("PARTICLE_INITIAL_HEIGHT");
 	delta_t = configParser.getDoubleKeyValue("DELTA_T");
+
+	// optional keys
+	output_format = configParser.getStringKeyValueOr("OUTPUT_FORMAT", "text");
+	if (output_format != "text" && output_format != "binary")
+	{
+		std::cerr << "Unknown OUTPUT_FORMAT: " << output_format << std::endl;
+		exit(-1);
+	}
+	output_ring_depth = configParser.getIntKeyValueOr("OUTPUT_RING_DEPTH", 2);
+	if (output_ring_depth < 1)
+	{
+		std::cerr << "OUTPUT_RING_DEPTH must be at least 1." << std::endl;
+		exit(-1);
+	}
+	steps_per_launch = configParser.getIntKeyValueOr("STEPS_PER_LAUNCH", 1);
+	adaptive_tolerance = configParser.getDoubleKeyValueOr("ADAPTIVE_TOLERANCE", 0.0);
+	if (adaptive_tolerance < 0.0)
+	{
+		std::cerr << "ADAPTIVE_TOLERANCE must not be negative." << std::endl;
+		exit(-1);
+	}
+	integrator = configParser.getStringKeyValueOr("INTEGRATOR", "kick_drift");
+	if (integrator != "kick_drift" && integrator != "verlet" && integrator != "yoshida4" && integrator != "rk4" && integrator != "rkf45")
+	{
+		std::cerr << "Unknown INTEGRATOR: " << integrator << std::endl;
+		exit(-1);
+	}
+	if (integrator == "rkf45" && adaptive_tolerance == 0.0)
+	{
+		std::cerr << "INTEGRATOR=rkf45 requires ADAPTIVE_TOLERANCE." << std::endl;
+		exit(-1);
+	}
+	if (integrator != "kick_drift" && integrator != "rkf45" && adaptive_tolerance > 0.0)
+	{
+		std::cerr << "ADAPTIVE_TOLERANCE requires INTEGRATOR=kick_drift or rkf45." << std::endl;
+		exit(-1);
+	}
+	jacobi_report = configParser.getIntKeyValueOr("JACOBI_REPORT", 0);
+	jacobi_output = configParser.getIntKeyValueOr("JACOBI_OUTPUT", 0);
+	escape_criterion = configParser.getStringKeyValueOr("ESCAPE_CRITERION", "off");
+	if (escape_criterion != "off" && escape_criterion != "distance" && escape_criterion != "energy")
+	{
+		std::cerr << "Unknown ESCAPE_CRITERION: " << escape_criterion << std::endl;
+		exit(-1);
+	}
+	escape_radius = configParser.getDoubleKeyValueOr("ESCAPE_RADIUS", 0.0);
+	if (escape_criterion != "off" && escape_radius <= 0.0)
+	{
+		std::cerr << "ESCAPE_CRITERION requires a positive ESCAPE_RADIUS." << std::endl;
+		exit(-1);
+	}
+	impact_log = configParser.getIntKeyValueOr("IMPACT_LOG", 0);
+	compaction_step_count = configParser.getIntKeyValueOr("COMPACTION_STEP_COUNT", 100);
+	checkpoint_step_count = configParser.getIntKeyValueOr("CHECKPOINT_STEP_COUNT", 0);
+	cpu_thread_count = configParser.getIntKeyValueOr("CPU_THREAD_COUNT", 0);
+	opencl_work_group_size = configParser.getIntKeyValueOr("OPENCL_WORK_GROUP_SIZE", 0);
+	// compiled OpenCL programs, by default in the user's cache directory
+	const char* cache_home = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	const std::string default_program_cache = (cache_home && *cache_home) ? std::string(cache_home) + "/cosim"
+	                                        : (home && *home) ? std::string(home) + "/.cache/cosim" : "off";
+	opencl_program_cache = configParser.getStringKeyValueOr("OPENCL_PROGRAM_CACHE", default_program_cache);
+	mesh_cache = configParser.getStringKeyValueOr("MESH_CACHE", "read");
+	if (mesh_cache != "read" && mesh_cache != "auto" && mesh_cache != "off")
+	{
+		std::cerr << "Unknown MESH_CACHE: " << mesh_cache << std::endl;
+		exit(-1);
+	}
+	gravity_kernel = configParser.getStringKeyValueOr("GRAVITY_KERNEL", "face");
+	if (gravity_kernel != "face" && gravity_kernel != "edge" && gravity_kernel != "shared_edge" && gravity_kernel != "tiled")
+	{
+		std::cerr << "Unknown GRAVITY_KERNEL: " << gravity_kernel << std::endl;
+		exit(-1);
+	}
+	precision = configParser.getStringKeyValueOr("PRECISION", "double");
+	if (precision != "double" && precision != "float" && precision != "mixed")
+	{
+		std::cerr << "Unknown PRECISION: " << precision << std::endl;
+		exit(-1);
+	}
+	if (precision != "double" && backend != "opencl")
+	{
+		std::cerr << "PRECISION=" << precision << " requires BACKEND=opencl." << std::endl;
+		exit(-1);
+	}
+	precision_validation = configParser.getIntKeyValueOr("PRECISION_VALIDATION", 0);
+	collision_test = configParser.getStringKeyValueOr("COLLISION_TEST", "solid_angle");
+	if (collision_test != "solid_angle" && collision_test != "bvh")
+	{
+		std::cerr << "Unknown COLLISION_TEST: " << collision_test << std::endl;
+		exit(-1);
+	}
+	multipole_radius = configParser.getDoubleKeyValueOr("MULTIPOLE_RADIUS", 0.0);
+	multipole_order = configParser.getIntKeyValueOr("MULTIPOLE_ORDER", 10);
+	multipole_validation = configParser.getIntKeyValueOr("MULTIPOLE_VALIDATION", 0);
+	if (multipole_radius != 0.0 && multipole_radius <= 1.0)
+	{
+		std::cerr << "MULTIPOLE_RADIUS must be 0 or larger than 1 (body radii)." << std::endl;
+		exit(-1);
+	}
+	if (multipole_order < 0 || multipole_order > 40)
+	{
+		std::cerr << "MULTIPOLE_ORDER must be between 0 and 40." << std::endl;
+		exit(-1);
+	}
+	gravity_grid_levels = configParser.getIntKeyValueOr("GRAVITY_GRID_LEVELS", 0);
+	gravity_grid_size = configParser.getIntKeyValueOr("GRAVITY_GRID_SIZE", 64);
+	gravity_grid_file = configParser.getStringKeyValueOr("GRAVITY_GRID_FILE", BodyMesh::CacheFilename(comet_obj_file, ".ggrid"));
+	if (gravity_grid_levels < 0 || gravity_grid_levels > 8)
+	{
+		std::cerr << "GRAVITY_GRID_LEVELS must be between 0 and 8." << std::endl;
+		exit(-1);
+	}
+	if (gravity_grid_size < 16)
+	{
+		std::cerr << "GRAVITY_GRID_SIZE must be at least 16." << std::endl;
+		exit(-1);
+	}
 }
 
 
@@ -47,10 +214,18 @@ void ComputeConfig::write(std::ostream& os)
 {
 	writeKey(os, "OPENCL_PLATFORM_ID", opencl_platform_id);
 	writeKey(os, "OPENCL_DEVICE_ID", opencl_device_id);
+	writeKey(os, "OPENCL_DEVICES", opencl_devices);
+	writeKey(os, "OPENCL_REBALANCE", opencl_rebalance);
 	writeKey(os, "STEP_COUNT", step_count);
 	writeKey(os, "OUTPUT_STEP_COUNT", output_step_count);
+	writeKey(os, "OUTPUT_FORMAT", output_format);
+	writeKey(os, "OUTPUT_RING_DEPTH", output_ring_depth);
+	writeKey(os, "STEPS_PER_LAUNCH", steps_per_launch);
+	writeKey(os, "COMPACTION_STEP_COUNT", compaction_step_count);
+	writeKey(os, "CHECKPOINT_STEP_COUNT", checkpoint_step_count);
 
 	writeKey(os, "COMET_OBJ_FILE", comet_obj_file);
+	writeKey(os, "MESH_CACHE", mesh_cache);
 	//writeKey(os, "OUTPUT_PATH", output_path);
 
 	writeKey(os, "COMET_DENSITY", comet_density);
@@ -59,6 +234,27 @@ void ComputeConfig::write(std::ostream& os)
 	writeKey(os, "PARTICLE_INITIAL_VELOCITY", particle_initial_velocity);
 	writeKey(os, "PARTICLE_INITIAL_HEIGHT", particle_initial_height);
 	writeKey(os, "DELTA_T", delta_t);
+	writeKey(os, "ADAPTIVE_TOLERANCE", adaptive_tolerance);
+	writeKey(os, "INTEGRATOR", integrator);
+	writeKey(os, "JACOBI_REPORT", jacobi_report);
+	writeKey(os, "JACOBI_OUTPUT", jacobi_output);
+	writeKey(os, "ESCAPE_CRITERION", escape_criterion);
+	writeKey(os, "ESCAPE_RADIUS", escape_radius);
+	writeKey(os, "IMPACT_LOG", impact_log);
+	writeKey(os, "BACKEND", backend);
+	writeKey(os, "CPU_THREAD_COUNT", cpu_thread_count);
+	writeKey(os, "OPENCL_WORK_GROUP_SIZE", opencl_work_group_size);
+	writeKey(os, "OPENCL_PROGRAM_CACHE", opencl_program_cache);
+	writeKey(os, "GRAVITY_KERNEL", gravity_kernel);
+	writeKey(os, "PRECISION", precision);
+	writeKey(os, "PRECISION_VALIDATION", precision_validation);
+	writeKey(os, "COLLISION_TEST", collision_test);
+	writeKey(os, "MULTIPOLE_RADIUS", multipole_radius);
+	writeKey(os, "MULTIPOLE_ORDER", multipole_order);
+	writeKey(os, "MULTIPOLE_VALIDATION", multipole_validation);
+	writeKey(os, "GRAVITY_GRID_LEVELS", gravity_grid_levels);
+	writeKey(os, "GRAVITY_GRID_SIZE", gravity_grid_size);
+	writeKey(os, "GRAVITY_GRID_FILE", gravity_grid_file);
 }
 
 void ComputeConfig::write(std::string& filename)
@@ -0,0 +1,968 @@
+// Copyright (c) 2015 Tobias Kramer <tobias.kramer@mytum.de>
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "CpuBackend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#if defined(COSIM_CPU_VECTOR_MATH) && defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__GLIBC__) && !defined(__FAST_MATH__)
+#if __GLIBC_PREREQ(2, 35)
+// glibc declares the libmvec variants of the math functions only with __FAST_MATH__, which
+// -fno-finite-math-only turns off, without them the loops over the particles of a block stay scalar
+extern "C" {
+__attribute__((__simd__("notinbranch"))) double acos(double) __THROW;
+__attribute__((__simd__("notinbranch"))) double atan(double) __THROW;
+__attribute__((__simd__("notinbranch"))) double atan2(double, double) __THROW;
+__attribute__((__simd__("notinbranch"))) double log(double) __THROW;
+}
+#endif
+#endif
+
+namespace {
+
+const int W = COSIM_CPU_SIMD_WIDTH;
+
+// NOTE: everything inside the loops over the particles of a block (l) uses scalars and
+// inline functions only, so that the compiler can vectorise them including the math calls,
+// conditionals are selects (no std::min/max, they keep branches without -ffinite-math-only),
+// test/CpuVectorisation.cmake checks that every omp simd loop is vectorised
+
+struct Vec3
+{
+	Real_t x, y, z;
+};
+
+inline Vec3 operator+(const Vec3& a, const Vec3& b) { return Vec3{ a.x + b.x, a.y + b.y, a.z + b.z }; }
+inline Vec3 operator-(const Vec3& a, const Vec3& b) { return Vec3{ a.x - b.x, a.y - b.y, a.z - b.z }; }
+inline Vec3 operator*(const Vec3& a, Real_t s) { return Vec3{ a.x * s, a.y * s, a.z * s }; }
+inline Real_t dot(const Vec3& a, const Vec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vec3 cross(const Vec3& a, const Vec3& b) { return Vec3{ a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+inline Real_t norm(const Vec3& a) { return std::sqrt(dot(a, a)); }
+inline Real_t sign(Real_t x) { return (x > 0.0) ? 1.0 : ((x < 0.0) ? -1.0 : 0.0); }
+inline Vec3 load3(const Real_t* p) { return Vec3{ p[0], p[1], p[2] }; }
+
+// solid angle of a triangle seen from the origin, r: vertices, nr: their norms, triple: dot(r1,cross(r2,r3))
+inline Real_t solid_angle(Real_t triple, const Vec3& r1, const Vec3& r2, const Vec3& r3, Real_t nr1, Real_t nr2, Real_t nr3)
+{
+	return 2.0 * std::atan2(triple, nr1 * nr2 * nr3 + dot(r1, r2) * nr3 + dot(r1, r3) * nr2 + dot(r2, r3) * nr1);
+}
+
+// Iij + Kij of one edge, see face_field_edges() in integrate_eom_kernel.cl
+inline Real_t edge_term(const Vec3& nv, Real_t h, const Vec3& r, Real_t nr, const Vec3& s, Real_t ns, const Vec3& sp1, Real_t nsp1, const Vec3& e, Real_t inrijp1rij, const Vec3& en)
+{
+	const Real_t aux_norm = ns * nsp1;
+	const Real_t arg = dot(s, sp1) / aux_norm;
+	Real_t aux = std::acos((arg < -1.0) ? -1.0 : ((arg > 1.0) ? 1.0 : arg));
+	aux = (std::fabs(arg - 1.0) < 1.0e-12) ? 0.0 : aux;
+	aux = (std::fabs(arg + 1.0) < 1.0e-12) ? 3.1415926535897932385 : aux;
+	const Real_t theta = -sign(dot(nv, cross(s, sp1))) * ((aux_norm != 0.0) ? aux : 1.0);
+
+	// NOTE: vsub_Rm_rij = -r
+	const Real_t Kij = -std::fabs(h) * theta;
+	const Real_t a = nr * inrijp1rij;
+	const Real_t b = -dot(r, e) * inrijp1rij * inrijp1rij;
+	const Real_t c = h * inrijp1rij;
+	const Real_t dij = -dot(r, en);
+
+	const Real_t epa2m2b = (1.0 + a * a - 2.0 * b);
+	const Real_t a2mb2mc2 = (a * a - b * b - c * c);
+	const Real_t sepa2m2b = (epa2m2b < 0.0) ? 1.0 : std::sqrt(epa2m2b);
+	// a2mb2mc2 = (dij/l)^2 cancels to 0 at some points with |dij| > 1e-5, the divisions by its root then give NaN
+	const Real_t sa2mb2mc2 = (a2mb2mc2 <= 0.0) ? 1.0 : std::sqrt(a2mb2mc2);
+	const Real_t Iij = dij * ((c * std::atan((b * c) / (a * sa2mb2mc2))) / sa2mb2mc2 + (c * std::atan(((1.0 - b) * c) / (sa2mb2mc2 * sepa2m2b))) / sa2mb2mc2 + std::log((1.0 - b + sepa2m2b) / (a - b)));
+	return ((std::fabs(dij) > 1.0e-5) ? Iij : 0.0) + Kij;
+}
+
+// per-face field with the edge table, see face_field_edges() in integrate_eom_kernel.cl,
+// the solid angle is only needed for the inside test of COLLISION_TEST=solid_angle
+template <bool with_thetasum>
+void field_block_edges(const BodyMesh& mesh, const Real_t* Rx, const Real_t* Ry, const Real_t* Rz, Real_t* gx, Real_t* gy, Real_t* gz, Real_t* phi, Real_t* thetasum)
+{
+	for (int i = 0; i < mesh.NUM_FACES; ++i)
+	{
+		const Vec3 nv = load3(&mesh.hplane[i*4]);
+		const Real_t d = mesh.hplane[i*4+3];
+		const Vec3 v1 = load3(&mesh.hrij[(i*4+0)*3]);
+		const Vec3 v2 = load3(&mesh.hrij[(i*4+1)*3]);
+		const Vec3 v3 = load3(&mesh.hrij[(i*4+2)*3]);
+		const Real_t* edge = &mesh.hedge[i*6*4];
+		const Vec3 e1 = load3(&edge[0*4]), en1 = load3(&edge[1*4]);
+		const Vec3 e2 = load3(&edge[2*4]), en2 = load3(&edge[3*4]);
+		const Vec3 e3 = load3(&edge[4*4]), en3 = load3(&edge[5*4]);
+		const Real_t il1 = edge[0*4+3], il2 = edge[2*4+3], il3 = edge[4*4+3];
+
+		#pragma omp simd
+		for (int l = 0; l < W; ++l)
+		{
+			const Vec3 Rm{ Rx[l], Ry[l], Rz[l] };
+			const Real_t h = dot(nv, Rm) - d; // = dot(nv,Rm-rij) for all vertices of the face
+
+			// vertices relative to Rm (r) and to its projection onto the face plane (s)
+			const Vec3 r1 = v1 - Rm, r2 = v2 - Rm, r3 = v3 - Rm;
+			const Vec3 s1 = r1 + nv * h, s2 = r2 + nv * h, s3 = r3 + nv * h;
+			const Real_t nr1 = norm(r1), nr2 = norm(r2), nr3 = norm(r3);
+			const Real_t ns1 = norm(s1), ns2 = norm(s2), ns3 = norm(s3);
+
+			// solid angle to determine if position is inside the comet or outside
+			if (with_thetasum)
+				thetasum[l] += solid_angle(dot(r1, cross(r2, r3)), r1, r2, r3, nr1, nr2, nr3);
+
+			const Real_t IKsum = edge_term(nv, h, r1, nr1, s1, ns1, s2, ns2, e1, il1, en1)
+			                   + edge_term(nv, h, r2, nr2, s2, ns2, s3, ns3, e2, il2, en2)
+			                   + edge_term(nv, h, r3, nr3, s3, ns3, s1, ns1, e3, il3, en3);
+			phi[l] += 0.5 * h * IKsum;
+			gx[l] += nv.x * IKsum;
+			gy[l] += nv.y * IKsum;
+			gz[l] += nv.z * IKsum;
+		}
+	}
+}
+
+// shared-edge formulation, see integrate_eom_shared_edges in integrate_eom_kernel.cl
+void field_block_shared_edges(const BodyMesh& mesh, const Real_t* Rx, const Real_t* Ry, const Real_t* Rz, Real_t* gx, Real_t* gy, Real_t* gz, Real_t* phi, Real_t* thetasum)
+{
+	// face terms: solid angle omega_f and F_f*r_f = nv*dot(nv,r_f)
+	for (int i = 0; i < mesh.NUM_FACES; ++i)
+	{
+		const Vec3 nv = load3(&mesh.hplane[i*4]);
+		const Real_t d = mesh.hplane[i*4+3];
+		const Vec3 v1 = load3(&mesh.hrij[(i*4+0)*3]);
+		const Vec3 v2 = load3(&mesh.hrij[(i*4+1)*3]);
+		const Vec3 v3 = load3(&mesh.hrij[(i*4+2)*3]);
+		const Vec3 n2A = cross(v2 - v1, v3 - v1);
+
+		#pragma omp simd
+		for (int l = 0; l < W; ++l)
+		{
+			const Vec3 Rm{ Rx[l], Ry[l], Rz[l] };
+			const Real_t nr_f = d - dot(nv, Rm); // = dot(nv,rij-Rm) for all vertices of the face
+			const Vec3 r1 = v1 - Rm, r2 = v2 - Rm, r3 = v3 - Rm;
+			const Real_t omega_f = solid_angle(dot(r1, n2A), r1, r2, r3, norm(r1), norm(r2), norm(r3));
+			thetasum[l] += omega_f;
+			phi[l] -= 0.5 * nr_f * nr_f * omega_f;
+			gx[l] += nv.x * (nr_f * omega_f);
+			gy[l] += nv.y * (nr_f * omega_f);
+			gz[l] += nv.z * (nr_f * omega_f);
+		}
+	}
+
+	// edge terms: E_e*r_e*L_e
+	for (int k = 0; k < mesh.NUM_EDGES; ++k)
+	{
+		const Real_t* se = &mesh.hsedge[k*5*4];
+		const Vec3 vi = load3(&se[0]);
+		const Vec3 vj = load3(&se[4]);
+		const Real_t len = se[3];
+		const Vec3 E1 = load3(&se[8]), E2 = load3(&se[12]), E3 = load3(&se[16]);
+
+		#pragma omp simd
+		for (int l = 0; l < W; ++l)
+		{
+			const Vec3 Rm{ Rx[l], Ry[l], Rz[l] };
+			const Vec3 ri = vi - Rm, rj = vj - Rm;
+			const Real_t nri_nrj = norm(ri) + norm(rj);
+			const Real_t Le = (nri_nrj - len > 0.0) ? std::log((nri_nrj + len) / (nri_nrj - len)) : 0.0;
+			const Vec3 Er{ dot(E1, ri), dot(E2, ri), dot(E3, ri) };
+			phi[l] += 0.5 * dot(ri, Er) * Le;
+			gx[l] -= Er.x * Le;
+			gy[l] -= Er.y * Le;
+			gz[l] -= Er.z * Le;
+		}
+	}
+}
+
+// acceleration a in the rotating frame of the comet, gb: field of the body (without G*density),
+// see acceleration() in integrate_eom_kernel.cl
+inline void acceleration(const Real_t* gb, const Real_t* p, const Real_t* v, Real_t omega, Real_t gdens, Real_t* a)
+{
+	a[0] = gb[0] * gdens + (+2.0 * omega * v[1] + p[0] * omega * omega);
+	a[1] = gb[1] * gdens + (-2.0 * omega * v[0] + p[1] * omega * omega);
+	a[2] = gb[2] * gdens;
+}
+
+// kick-drift step of h in the rotating frame of the comet, gb: field of the body (without G*density),
+// see kick_drift() in integrate_eom_kernel.cl
+inline void kick_drift(const Real_t* gb, Real_t* p, Real_t* v, Real_t h, Real_t omega, Real_t gdens)
+{
+	Real_t g[3];
+	acceleration(gb, p, v, omega, gdens, g);
+	for (int k = 0; k < 3; ++k)
+	{
+		v[k] = v[k] + g[k] * h;
+		p[k] = p[k] + v[k] * h + g[k] * h * h * 0.5;
+	}
+}
+
+// kick of h of the symplectic integrators, the Coriolis term rotates the velocity exactly,
+// see kick() in integrate_eom_kernel.cl
+inline void kick(const Real_t* gb, const Real_t* p, Real_t* v, Real_t h, Real_t omega, Real_t gdens)
+{
+	const Real_t g[3] = { gb[0] * gdens + p[0] * omega * omega, gb[1] * gdens + p[1] * omega * omega, gb[2] * gdens };
+	const Real_t vx = v[0] + g[0] * (0.5 * h);
+	const Real_t vy = v[1] + g[1] * (0.5 * h);
+	const Real_t c = std::cos(2.0 * omega * h);
+	const Real_t s = std::sin(2.0 * omega * h);
+	v[0] = vx * c + vy * s + g[0] * (0.5 * h);
+	v[1] = -vx * s + vy * c + g[1] * (0.5 * h);
+	v[2] = v[2] + g[2] * h;
+}
+
+// stop at the impact point if the segment to pnew crosses the surface, mask vel.w as a hit (1.0),
+// t: fraction of the segment up to the impact point (1.0 without a hit), see move_checked() in integrate_eom_kernel.cl
+bool move_checked(const BodyMesh& mesh, Real_t* p, Real_t* v, const Real_t* pnew, const Real_t* vnew, Real_t* t)
+{
+	int face;
+	if (mesh.IntersectSegment(p, pnew, t, &face))
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			p[k] = p[k] + (pnew[k] - p[k]) * *t;
+			v[k] = v[k] + (vnew[k] - v[k]) * *t;
+		}
+		p[3] = face;
+		v[3] = 1.0;
+		return true;
+	}
+	std::memcpy(p, pnew, 3 * sizeof(Real_t));
+	std::memcpy(v, vnew, 3 * sizeof(Real_t));
+	*t = 1.0;
+	return false;
+}
+
+// see ADAPTIVE_MIN_STEP etc. in integrate_eom_kernel.cl
+const Real_t ADAPTIVE_MIN_STEP = 1.0e-3;
+const Real_t ADAPTIVE_MAX_GROWTH = 4.0;
+const Real_t ADAPTIVE_SAFETY = 0.9;
+
+// see SYMPLECTIC_STAGES, symplectic_kick() and symplectic_drift() in integrate_eom_kernel.cl
+const Real_t VERLET_KICK[2] = { 0.5, 0.5 };
+const Real_t VERLET_DRIFT[1] = { 1.0 };
+const Real_t YOSHIDA4_KICK[4] = { 0.6756035959798289, -0.17560359597982889, -0.17560359597982889, 0.6756035959798289 };
+const Real_t YOSHIDA4_DRIFT[3] = { 1.3512071919596578, -1.7024143839193155, 1.3512071919596578 };
+
+// Butcher tableaux, see rk_a, rk_b, rk_e in integrate_eom_kernel.cl
+const int RK_MAX_STAGES = 6;
+const Real_t RK4_A[6] = {
+	1.0/2.0,
+	0.0, 1.0/2.0,
+	0.0, 0.0, 1.0 };
+const Real_t RK4_B[4] = { 1.0/6.0, 1.0/3.0, 1.0/3.0, 1.0/6.0 };
+const Real_t RKF45_A[15] = {
+	1.0/4.0,
+	3.0/32.0, 9.0/32.0,
+	1932.0/2197.0, -7200.0/2197.0, 7296.0/2197.0,
+	439.0/216.0, -8.0, 3680.0/513.0, -845.0/4104.0,
+	-8.0/27.0, 2.0, -3544.0/2565.0, 1859.0/4104.0, -11.0/40.0 };
+const Real_t RKF45_B[6] = { 25.0/216.0, 0.0, 1408.0/2565.0, 2197.0/4104.0, -1.0/5.0, 0.0 };
+const Real_t RKF45_E[6] = { 1.0/360.0, 0.0, -128.0/4275.0, -2197.0/75240.0, 1.0/50.0, 2.0/55.0 };
+
+enum Integrator { KICK_DRIFT, VERLET, YOSHIDA4, RK4, RKF45 };
+
+struct StepParameters
+{
+	Real_t dt, omega, gdens;
+	Real_t tolerance; // 0: fixed steps of dt
+	bool segment_test; // COLLISION_TEST=bvh
+	Integrator integrator;
+	Real_t escape_radius, escape_gm; // see escape_test()
+	int endstep; // step at the end of the launch
+};
+
+// time stepping of a launch of one particle, see step_update() in integrate_eom_kernel.cl
+struct StepState
+{
+	int steps;                  // fixed steps left
+	Real_t p0[4], v0[4], g0[3]; // start of the current attempt and the field there
+	Real_t p1[4], v1[4];        // result of the full step of the attempt
+	Real_t h, next, hmin;       // step size of the attempt, proposed size of the next step
+	Real_t remaining;           // time to the end of the launch
+	Real_t time;                // of the start of the step or attempt, of a hit: the impact time (see step_state)
+	bool half;                  // p, v are the midpoint of the attempt
+	int stage;                  // next kick of the symplectic integrators, stage p, v belong to of the Runge-Kutta ones
+	Real_t kp[RK_MAX_STAGES][3], kv[RK_MAX_STAGES][3]; // stage derivatives of position and velocity
+};
+
+void step_begin(StepState& s, Real_t* p, const Real_t* v, const StepParameters& par, int numsteps)
+{
+	s.steps = numsteps;
+	s.stage = 0;
+	s.h = par.dt;
+	s.time = 0.0;
+	if (par.tolerance <= 0.0)
+		return;
+	// h of active particles is kept in pos.w between launches
+	s.next = (p[3] > 0.0) ? p[3] : par.dt;
+	s.hmin = par.dt * ADAPTIVE_MIN_STEP;
+	s.remaining = numsteps * par.dt;
+	s.half = false;
+	if (v[3] == 0.0) // p[3] of removed particles holds the hit face or escape step
+		p[3] = 0.0;
+}
+
+bool step_continue(const StepState& s, const Real_t* v, const StepParameters& par)
+{
+	return v[3] == 0.0 && ((par.tolerance > 0.0) ? s.remaining > 0.0 : s.steps > 0);
+}
+
+void step_end(const StepState& s, Real_t* p, const Real_t* v, const StepParameters& par)
+{
+	if (par.tolerance > 0.0 && v[3] == 0.0)
+		p[3] = s.next;
+}
+
+// escape test at the end of a launch, see escape_test() in integrate_eom_kernel.cl
+void escape_test(const StepParameters& par, Real_t* p, Real_t* v)
+{
+	if (v[3] != 0.0 || par.escape_radius <= 0.0)
+		return;
+	const Real_t r2 = p[0]*p[0] + p[1]*p[1] + p[2]*p[2];
+	if (r2 < par.escape_radius * par.escape_radius)
+		return;
+	if (par.escape_gm > 0.0)
+	{
+		// velocity in the inertial frame
+		const Real_t vx = v[0] - par.omega * p[1];
+		const Real_t vy = v[1] + par.omega * p[0];
+		if (0.5 * (vx*vx + vy*vy + v[2]*v[2]) - par.escape_gm / std::sqrt(r2) <= 0.0)
+			return;
+	}
+	v[3] = 2.0;
+	p[3] = par.endstep;
+}
+
+// see step_update() of INTEGRATOR_VERLET and INTEGRATOR_YOSHIDA4 in integrate_eom_kernel.cl
+void step_update_symplectic(const BodyMesh& mesh, const StepParameters& par, const Real_t* g, Real_t thetasum, Real_t* p, Real_t* v, StepState& s)
+{
+	const bool yoshida = par.integrator == YOSHIDA4;
+	const int stages = yoshida ? 3 : 1;
+	const Real_t* kicks = yoshida ? YOSHIDA4_KICK : VERLET_KICK;
+	const Real_t* drifts = yoshida ? YOSHIDA4_DRIFT : VERLET_DRIFT;
+	if (!par.segment_test && (s.stage == 0 || s.stage == stages) && thetasum >= 0.1) // inside the comet at the start or the end of a step
+	{
+		if (s.stage == stages)
+			s.time += par.dt;
+		v[3] = 1.0;
+		return;
+	}
+	kick(g, p, v, kicks[s.stage] * par.dt, par.omega, par.gdens);
+	if (s.stage == stages)
+	{
+		// last kick of the step, the first one of the next step has the same field
+		s.stage = 0;
+		s.time += par.dt;
+		if (--s.steps == 0)
+			return;
+		kick(g, p, v, kicks[0] * par.dt, par.omega, par.gdens);
+	}
+	if (s.stage == 0)
+	{
+		std::memcpy(s.p0, p, 4 * sizeof(Real_t));
+		std::memcpy(s.v0, v, 4 * sizeof(Real_t));
+	}
+	const Real_t h = drifts[s.stage] * par.dt;
+	const Real_t pnew[4] = { p[0] + v[0] * h, p[1] + v[1] * h, p[2] + v[2] * h, p[3] };
+	if (par.segment_test && s.stage == stages - 1)
+	{
+		// the chord of the whole step is tested against the surface
+		const Real_t vnew[4] = { v[0], v[1], v[2], v[3] };
+		Real_t t;
+		std::memcpy(p, s.p0, 4 * sizeof(Real_t));
+		std::memcpy(v, s.v0, 4 * sizeof(Real_t));
+		if (move_checked(mesh, p, v, pnew, vnew, &t))
+			s.time += t * par.dt;
+	}
+	else
+		std::memcpy(p, pnew, 3 * sizeof(Real_t));
+	++s.stage;
+}
+
+// pos, vel of stage j of the step, see rk_stage() in integrate_eom_kernel.cl
+void rk_stage(StepState& s, const Real_t* a, int j, Real_t* p, Real_t* v)
+{
+	std::memcpy(p, s.p0, 4 * sizeof(Real_t));
+	std::memcpy(v, s.v0, 4 * sizeof(Real_t));
+	for (int i = 0; i < j; ++i)
+	{
+		const Real_t aij = a[j*(j-1)/2+i] * s.h;
+		for (int k = 0; k < 3; ++k)
+		{
+			p[k] += s.kp[i][k] * aij;
+			v[k] += s.kv[i][k] * aij;
+		}
+	}
+	s.stage = j;
+}
+
+// see step_update() of INTEGRATOR_RK4 and INTEGRATOR_RKF45 in integrate_eom_kernel.cl
+void step_update_rk(const BodyMesh& mesh, const StepParameters& par, const Real_t* g, Real_t thetasum, Real_t* p, Real_t* v, StepState& s)
+{
+	if (!par.segment_test && s.stage == 0 && thetasum >= 0.1) // inside the comet at the end of the last step
+	{
+		v[3] = 1.0;
+		return;
+	}
+	const bool fehlberg = par.integrator == RKF45;
+	const int stages = fehlberg ? 6 : 4;
+	const Real_t* a = fehlberg ? RKF45_A : RK4_A;
+	const Real_t* b = fehlberg ? RKF45_B : RK4_B;
+	if (s.stage == 0)
+	{
+		std::memcpy(s.p0, p, 4 * sizeof(Real_t));
+		std::memcpy(s.v0, v, 4 * sizeof(Real_t));
+		if (fehlberg)
+			s.h = std::min(s.next, s.remaining);
+	}
+	std::memcpy(s.kp[s.stage], v, 3 * sizeof(Real_t));
+	acceleration(g, p, v, par.omega, par.gdens, s.kv[s.stage]);
+	if (s.stage < stages - 1)
+	{
+		rk_stage(s, a, s.stage + 1, p, v);
+		return;
+	}
+
+	Real_t pnew[4], vnew[4];
+	std::memcpy(pnew, s.p0, 4 * sizeof(Real_t));
+	std::memcpy(vnew, s.v0, 4 * sizeof(Real_t));
+	for (int i = 0; i < stages; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			pnew[k] += s.kp[i][k] * (b[i] * s.h);
+			vnew[k] += s.kv[i][k] * (b[i] * s.h);
+		}
+	}
+	if (fehlberg)
+	{
+		Real_t perr[3] = { 0.0, 0.0, 0.0 };
+		for (int i = 0; i < stages; ++i)
+			for (int k = 0; k < 3; ++k)
+				perr[k] += s.kp[i][k] * (RKF45_E[i] * s.h);
+		const Real_t err = std::sqrt(perr[0] * perr[0] + perr[1] * perr[1] + perr[2] * perr[2]);
+		Real_t scale = (err > 0.0) ? ADAPTIVE_SAFETY * std::pow(par.tolerance / err, 0.2) : ADAPTIVE_MAX_GROWTH;
+		scale = std::min(std::max(scale, 1.0 / ADAPTIVE_MAX_GROWTH), ADAPTIVE_MAX_GROWTH);
+		if (err > par.tolerance && s.h > s.hmin)
+		{
+			// rejected, retried from the start of the step, the first stage is known
+			s.h = std::max(s.h * scale, s.hmin);
+			s.next = s.h;
+			rk_stage(s, a, 1, p, v);
+			return;
+		}
+		// a step clamped to the end of the launch does not shrink the proposal
+		s.next = (s.h < s.next) ? std::max(s.next, s.h * scale) : s.h * scale;
+		s.remaining -= s.h;
+	}
+	else
+		--s.steps;
+	s.stage = 0;
+	Real_t t = 1.0;
+	if (par.segment_test)
+	{
+		std::memcpy(p, s.p0, 4 * sizeof(Real_t));
+		std::memcpy(v, s.v0, 4 * sizeof(Real_t));
+		move_checked(mesh, p, v, pnew, vnew, &t);
+	}
+	else
+	{
+		std::memcpy(p, pnew, 4 * sizeof(Real_t));
+		std::memcpy(v, vnew, 4 * sizeof(Real_t));
+	}
+	s.time += t * s.h;
+}
+
+// freeze a particle with a non-finite field and mask it as a hit without a face, returns true if it was retired,
+// see retire_non_finite() in integrate_eom_kernel.cl
+bool retire_non_finite(const Real_t* g, Real_t thetasum, Real_t* p, Real_t* v)
+{
+	if (std::isfinite(g[0]) && std::isfinite(g[1]) && std::isfinite(g[2]) && std::isfinite(thetasum))
+		return false;
+	p[3] = -1.0;
+	v[3] = 1.0;
+	return true;
+}
+
+void step_update(const BodyMesh& mesh, const StepParameters& par, const Real_t* g, Real_t thetasum, Real_t* p, Real_t* v, StepState& s)
+{
+	if (retire_non_finite(g, thetasum, p, v))
+		return;
+	if (par.integrator == VERLET || par.integrator == YOSHIDA4)
+	{
+		step_update_symplectic(mesh, par, g, thetasum, p, v, s);
+		return;
+	}
+	if (par.integrator == RK4 || par.integrator == RKF45)
+	{
+		step_update_rk(mesh, par, g, thetasum, p, v, s);
+		return;
+	}
+
+	if (par.tolerance <= 0.0) // see update_particle() in integrate_eom_kernel.cl
+	{
+		--s.steps;
+		Real_t t = 1.0;
+		if (par.segment_test)
+		{
+			Real_t pnew[4], vnew[4];
+			std::memcpy(pnew, p, 4 * sizeof(Real_t));
+			std::memcpy(vnew, v, 4 * sizeof(Real_t));
+			kick_drift(g, pnew, vnew, par.dt, par.omega, par.gdens);
+			move_checked(mesh, p, v, pnew, vnew, &t);
+		}
+		else if (thetasum < 0.1) // position outside the comet
+			kick_drift(g, p, v, par.dt, par.omega, par.gdens);
+		else // we re-collided with the comet, do not update position, but mask vel.w as a hit (1.0)
+		{
+			v[3] = 1.0;
+			t = 0.0;
+		}
+		s.time += t * par.dt;
+		return;
+	}
+
+	if (!par.segment_test && thetasum >= 0.1) // inside the comet at the start or the midpoint of an attempt
+	{
+		if (s.half)
+			s.time += 0.5 * s.h;
+		v[3] = 1.0;
+		return;
+	}
+	const Real_t* gs = g;
+	if (!s.half)
+	{
+		std::memcpy(s.p0, p, 4 * sizeof(Real_t));
+		std::memcpy(s.v0, v, 4 * sizeof(Real_t));
+		std::memcpy(s.g0, g, 3 * sizeof(Real_t));
+	}
+	else
+	{
+		// second half step, compared with the full step
+		Real_t p2[4], v2[4];
+		std::memcpy(p2, p, 4 * sizeof(Real_t));
+		std::memcpy(v2, v, 4 * sizeof(Real_t));
+		kick_drift(g, p2, v2, 0.5 * s.h, par.omega, par.gdens);
+		const Real_t err = std::sqrt((p2[0] - s.p1[0]) * (p2[0] - s.p1[0]) + (p2[1] - s.p1[1]) * (p2[1] - s.p1[1]) + (p2[2] - s.p1[2]) * (p2[2] - s.p1[2]));
+		Real_t scale = (err > 0.0) ? ADAPTIVE_SAFETY * std::sqrt(par.tolerance / err) : ADAPTIVE_MAX_GROWTH;
+		scale = std::min(std::max(scale, 1.0 / ADAPTIVE_MAX_GROWTH), ADAPTIVE_MAX_GROWTH);
+		if (err <= par.tolerance || s.h <= s.hmin)
+		{
+			if (par.segment_test) // both half steps are tested against the surface
+			{
+				Real_t pm[4], vm[4], t;
+				std::memcpy(pm, p, 4 * sizeof(Real_t));
+				std::memcpy(vm, v, 4 * sizeof(Real_t));
+				std::memcpy(p, s.p0, 4 * sizeof(Real_t));
+				std::memcpy(v, s.v0, 4 * sizeof(Real_t));
+				if (move_checked(mesh, p, v, pm, vm, &t))
+				{
+					s.time += 0.5 * s.h * t;
+					return;
+				}
+				if (move_checked(mesh, p, v, p2, v2, &t))
+				{
+					s.time += 0.5 * s.h * (1.0 + t);
+					return;
+				}
+			}
+			else
+			{
+				std::memcpy(p, p2, 4 * sizeof(Real_t));
+				std::memcpy(v, v2, 4 * sizeof(Real_t));
+			}
+			// a step clamped to the end of the launch does not shrink the proposal
+			s.next = (s.h < s.next) ? std::max(s.next, s.h * scale) : s.h * scale;
+			s.remaining -= s.h;
+			s.time += s.h;
+			s.half = false;
+			return; // the next attempt needs the field at the new position
+		}
+		// rejected, retried from the start of the attempt, the field there is known
+		s.next = std::max(s.h * scale, s.hmin);
+		std::memcpy(p, s.p0, 4 * sizeof(Real_t));
+		std::memcpy(v, s.v0, 4 * sizeof(Real_t));
+		gs = s.g0;
+	}
+
+	// new attempt: the full step and the first half step, the field at the midpoint is evaluated next
+	s.h = std::min(s.next, s.remaining);
+	std::memcpy(s.p1, p, 4 * sizeof(Real_t));
+	std::memcpy(s.v1, v, 4 * sizeof(Real_t));
+	kick_drift(gs, s.p1, s.v1, s.h, par.omega, par.gdens);
+	kick_drift(gs, p, v, 0.5 * s.h, par.omega, par.gdens);
+	s.half = true;
+}
+
+} // namespace
+
+void cpu_exact_field(const BodyMesh& mesh, bool shared_edge, const Real_t* pos, int count, Real_t* g, Real_t* thetasum)
+{
+	for (int first = 0; first < count; first += W)
+	{
+		// padding lanes compute the field at the last position
+		alignas(64) Real_t Rx[W], Ry[W], Rz[W];
+		alignas(64) Real_t gx[W], gy[W], gz[W], phi[W], ts[W];
+		for (int l = 0; l < W; ++l)
+		{
+			const int i = std::min(first + l, count - 1);
+			Rx[l] = pos[i*4+0];
+			Ry[l] = pos[i*4+1];
+			Rz[l] = pos[i*4+2];
+			gx[l] = gy[l] = gz[l] = phi[l] = ts[l] = 0.0;
+		}
+
+		if (shared_edge)
+			field_block_shared_edges(mesh, Rx, Ry, Rz, gx, gy, gz, phi, ts);
+		else
+			field_block_edges<true>(mesh, Rx, Ry, Rz, gx, gy, gz, phi, ts);
+
+		for (int l = 0; l < W && first + l < count; ++l)
+		{
+			g[(first+l)*3+0] = gx[l];
+			g[(first+l)*3+1] = gy[l];
+			g[(first+l)*3+2] = gz[l];
+			thetasum[first+l] = ts[l];
+		}
+	}
+}
+
+CpuBackend::~CpuBackend()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shutdown = true;
+	}
+	start_cv.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+}
+
+void CpuBackend::Initialize()
+{
+	const size_t n = 4 * static_cast<size_t>(config.particle_count);
+	posold.assign(n, 0.0);
+	velold.assign(n, 0.0);
+	posnew.assign(n, 0.0);
+	velnew.assign(n, 0.0);
+
+	int thread_count = config.cpu_thread_count;
+	if (thread_count <= 0)
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+	impacts.resize(config.impact_log ? config.particle_count : 0);
+	UpdateParameters();
+	std::cout << "CPU backend: " << thread_count << " threads, " << W << " particles per block" << std::endl;
+
+	for (int i = 0; i < thread_count; ++i)
+		workers.push_back(std::thread(&CpuBackend::WorkerLoop, this));
+}
+
+void CpuBackend::WorkerLoop()
+{
+	size_t seen_generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_cv.wait(lock, [&] { return shutdown || generation != seen_generation; });
+			if (shutdown)
+				return;
+			seen_generation = generation;
+		}
+
+		ProcessBlocks();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--active_workers;
+		}
+		done_cv.notify_one();
+	}
+}
+
+void CpuBackend::RunBlocks()
+{
+	next_block = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		active_workers = static_cast<int>(workers.size());
+		++generation;
+	}
+	start_cv.notify_all();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [&] { return active_workers == 0; });
+	}
+}
+
+void CpuBackend::ProcessBlocks()
+{
+	// dynamic scheduling: blocks differ in cost once particles have re-collided
+	for (int block = next_block++; block < block_count; block = next_block++)
+	{
+		if (diagnose)
+			DiagnoseBlock(block * W);
+		else
+			PropagateBlock(block * W, launch_steps);
+	}
+}
+
+void CpuBackend::PropagateBlock(int first, int numsteps)
+{
+	// particles of this block, padding lanes compute the field at the last particle
+	const int count = std::min(W, active_count - first);
+	int m[W];
+	for (int l = 0; l < W; ++l)
+		m[l] = active[first + std::min(l, count - 1)];
+
+	// the state is kept in the block for all steps of a launch
+	Real_t p[W][4], v[W][4];
+	for (int l = 0; l < W; ++l)
+	{
+		std::memcpy(p[l], &posold[m[l]*4], 4 * sizeof(Real_t));
+		std::memcpy(v[l], &velold[m[l]*4], 4 * sizeof(Real_t));
+	}
+
+	StepParameters par;
+	par.dt = config.delta_t;
+	par.omega = config.comet_angular_frequency;
+	par.gdens = config.const_gravity * config.comet_density;
+	par.tolerance = config.adaptive_tolerance;
+	par.segment_test = config.collision_test == "bvh";
+	par.integrator = (config.integrator == "verlet") ? VERLET : (config.integrator == "yoshida4") ? YOSHIDA4
+	               : (config.integrator == "rk4") ? RK4 : (config.integrator == "rkf45") ? RKF45 : KICK_DRIFT;
+	par.escape_radius = escape_radius;
+	par.escape_gm = escape_gm;
+	par.endstep = step;
+	StepState s[W];
+	for (int l = 0; l < count; ++l)
+		step_begin(s[l], p[l], v[l], par, numsteps);
+	for (;;)
+	{
+		// stop once all particles of the block are done or have re-collided, their state does not change anymore
+		bool all_done = true;
+		for (int l = 0; l < count; ++l)
+			all_done = all_done && !step_continue(s[l], v[l], par);
+		if (all_done)
+			break;
+
+		alignas(64) Real_t Rx[W], Ry[W], Rz[W];
+		alignas(64) Real_t gx[W], gy[W], gz[W], phi[W], thetasum[W];
+		// field from the multipole expansion or the gravity grid, see field_shortcut() in the kernel
+		bool shortcut[W];
+		Real_t sg[W][3], sthetasum[W];
+		bool all_shortcut = true;
+		for (int l = 0; l < W; ++l)
+		{
+			Rx[l] = p[l][0];
+			Ry[l] = p[l][1];
+			Rz[l] = p[l][2];
+			gx[l] = gy[l] = gz[l] = phi[l] = thetasum[l] = 0.0;
+			sthetasum[l] = 0.0;
+			shortcut[l] = multipole.isFar(p[l]);
+			if (shortcut[l])
+				multipole.Field(p[l], sg[l]);
+			else if (grid.isEnabled())
+				shortcut[l] = grid.Sample(p[l], sg[l], &sthetasum[l]);
+			all_shortcut = all_shortcut && shortcut[l];
+		}
+
+		// the sum over the faces is skipped if no particle of the block needs it
+		if (!all_shortcut)
+		{
+			if (config.gravity_kernel == "shared_edge")
+				field_block_shared_edges(mesh, Rx, Ry, Rz, gx, gy, gz, phi, thetasum);
+			else if (par.segment_test)
+				field_block_edges<false>(mesh, Rx, Ry, Rz, gx, gy, gz, phi, thetasum);
+			else
+				field_block_edges<true>(mesh, Rx, Ry, Rz, gx, gy, gz, phi, thetasum);
+		}
+		for (int l = 0; l < count; ++l)
+		{
+			if (!shortcut[l])
+				continue;
+			gx[l] = sg[l][0];
+			gy[l] = sg[l][1];
+			gz[l] = sg[l][2];
+			thetasum[l] = sthetasum[l];
+		}
+
+		for (int l = 0; l < count; ++l)
+		{
+			if (!step_continue(s[l], v[l], par)) // re-collided or at the end of the launch
+				continue;
+			const Real_t g[3] = { gx[l], gy[l], gz[l] };
+			step_update(mesh, par, g, thetasum[l], p[l], v[l], s[l]);
+		}
+	}
+	for (int l = 0; l < count; ++l)
+	{
+		step_end(s[l], p[l], v[l], par);
+		if (v[l][3] == 1.0 && velold[m[l]*4+3] == 0.0 && !impacts.empty())
+		{
+			// see log_impact() in integrate_eom_kernel.cl
+			const int k = impact_count++;
+			const int steps = static_cast<int>(std::floor(s[l].time / par.dt));
+			ImpactEvent& event = impacts[k];
+			event.particle = m[l];
+			event.face = par.segment_test ? static_cast<int>(p[l][3]) : -1;
+			event.step = par.endstep - numsteps + steps;
+			event.time = s[l].time - steps * par.dt;
+			std::memcpy(event.pos, p[l], 3 * sizeof(Real_t));
+			std::memcpy(event.vel, v[l], 3 * sizeof(Real_t));
+		}
+		escape_test(par, p[l], v[l]);
+	}
+
+	for (int l = 0; l < count; ++l)
+	{
+		std::memcpy(&posnew[m[l]*4], p[l], 4 * sizeof(Real_t));
+		std::memcpy(&velnew[m[l]*4], v[l], 4 * sizeof(Real_t));
+	}
+}
+
+void CpuBackend::PropagateSteps(int count)
+{
+	const int steps_per_launch = (config.steps_per_launch > 0) ? config.steps_per_launch : count;
+	for (int done = 0; done < count; done += launch_steps)
+	{
+		ham::util::time::timer timer;
+
+		launch_steps = std::min(steps_per_launch, count - done);
+		step += launch_steps;
+		block_count = (active_count + W - 1) / W;
+		diagnose = false;
+		RunBlocks();
+
+		// double buffering scheme
+		posold.swap(posnew);
+		velold.swap(velnew);
+
+		// the runtime of a launch is distributed evenly over its steps
+		const ham::util::time::rep elapsed = timer.elapsed();
+		for (int i = 0; i < launch_steps; ++i)
+			stats.add(elapsed / launch_steps);
+	}
+}
+
+void CpuBackend::CompactParticles()
+{
+	// removed particles are not propagated anymore, keep both buffers valid for the double buffering
+	int live = 0;
+	for (int a = 0; a < active_count; ++a)
+	{
+		const int m = active[a];
+		if (velold[m*4+3] == 0.0)
+			active[live++] = m;
+		else
+		{
+			std::memcpy(&posnew[m*4], &posold[m*4], 4 * sizeof(Real_t));
+			std::memcpy(&velnew[m*4], &velold[m*4], 4 * sizeof(Real_t));
+		}
+	}
+	active_count = live;
+}
+
+void CpuBackend::GetParticles(int NumBodies, Real_t *pos, Real_t *vel)
+{
+	std::memcpy(pos, posold.data(), 4 * NumBodies * sizeof(Real_t));
+	std::memcpy(vel, velold.data(), 4 * NumBodies * sizeof(Real_t));
+}
+
+void CpuBackend::PutParticles(int NumBodies, Real_t *pos, Real_t *vel)
+{
+	// both buffers, the inactive particles are not written by the propagation
+	std::memcpy(posold.data(), pos, 4 * NumBodies * sizeof(Real_t));
+	std::memcpy(velold.data(), vel, 4 * NumBodies * sizeof(Real_t));
+	std::memcpy(posnew.data(), pos, 4 * NumBodies * sizeof(Real_t));
+	std::memcpy(velnew.data(), vel, 4 * NumBodies * sizeof(Real_t));
+
+	// particles that did not re-collide are active
+	active.clear();
+	for (int i = 0; i < NumBodies; ++i)
+		if (vel[i*4+3] == 0.0)
+			active.push_back(i);
+	active_count = static_cast<int>(active.size());
+	impact_count = 0;
+	impacts_read = 0;
+}
+
+void CpuBackend::PutJacobiReference(int NumBodies, const Real_t *jacobi)
+{
+	jacobi_reference.assign(jacobi, jacobi + NumBodies);
+}
+
+void CpuBackend::DiagnoseBlock(int first)
+{
+	// padding lanes compute the field at the last particle, see diagnostics() in integrate_eom_kernel.cl
+	const int count = std::min(W, diag_count - first);
+	alignas(64) Real_t Rx[W], Ry[W], Rz[W];
+	alignas(64) Real_t gx[W], gy[W], gz[W], phi[W], thetasum[W];
+	for (int l = 0; l < W; ++l)
+	{
+		const int i = first + std::min(l, count - 1);
+		Rx[l] = posold[i*4+0];
+		Ry[l] = posold[i*4+1];
+		Rz[l] = posold[i*4+2];
+		gx[l] = gy[l] = gz[l] = phi[l] = thetasum[l] = 0.0;
+	}
+	if (config.gravity_kernel == "shared_edge")
+		field_block_shared_edges(mesh, Rx, Ry, Rz, gx, gy, gz, phi, thetasum);
+	else
+		field_block_edges<false>(mesh, Rx, Ry, Rz, gx, gy, gz, phi, thetasum);
+
+	const Real_t omega = config.comet_angular_frequency;
+	const Real_t gdens = config.const_gravity * config.comet_density;
+	for (int l = 0; l < count; ++l)
+	{
+		const int i = first + l;
+		const Real_t* v = &velold[i*4];
+		// the field is the gradient of phi (without G*density)
+		const Real_t potential = -gdens * phi[l];
+		const Real_t jacobi = 0.5 * (v[0]*v[0] + v[1]*v[1] + v[2]*v[2]) - 0.5 * omega * omega * (Rx[l]*Rx[l] + Ry[l]*Ry[l]) + potential;
+		diagnostics[i*4+0] = potential;
+		diagnostics[i*4+1] = jacobi;
+		diagnostics[i*4+2] = jacobi - ((i < static_cast<int>(jacobi_reference.size())) ? jacobi_reference[i] : 0.0);
+		diagnostics[i*4+3] = v[3];
+	}
+}
+
+JacobiDrift CpuBackend::Diagnostics(int NumBodies, Real_t *diag)
+{
+	diagnostics.resize(4 * static_cast<size_t>(NumBodies));
+	diag_count = NumBodies;
+	block_count = (NumBodies + W - 1) / W;
+	diagnose = true;
+	RunBlocks();
+
+	JacobiDrift drift;
+	for (int i = 0; i < NumBodies; ++i)
+	{
+		if (diagnostics[i*4+3] != 0.0) // re-collided, not integrated anymore
+			continue;
+		const double d = diagnostics[i*4+2];
+		drift.min = (drift.count > 0) ? std::min(drift.min, d) : d;
+		drift.max = (drift.count > 0) ? std::max(drift.max, d) : d;
+		drift.sum += d;
+		drift.sum_abs += std::fabs(d);
+		++drift.count;
+	}
+	if (diag)
+		std::memcpy(diag, diagnostics.data(), 4 * NumBodies * sizeof(Real_t));
+	return drift;
+}
+
+void CpuBackend::UpdateParameters()
+{
+	escape_radius = EscapeRadius();
+	escape_gm = EscapeGM();
+}
+
+void CpuBackend::GetImpacts(std::vector<ImpactEvent>& events)
+{
+	const int count = impact_count;
+	events.insert(events.end(), impacts.begin() + impacts_read, impacts.begin() + count);
+	impacts_read = count;
+}
@@ -0,0 +1,495 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "GravityGrid.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <unistd.h> // getpid()
+
+#include "CpuBackend.h" // cpu_exact_field()
+#include "ham/util/time.hpp"
+
+namespace {
+
+const char GRID_MAGIC[8] = { 'C', 'O', 'S', 'I', 'M', 'G', 'R', 'D' };
+const uint32_t GRID_VERSION = 1;
+const uint32_t GRID_BYTE_ORDER_MARK = 0x01020304;
+
+const double BAND = 6.0;   // signed distances are clamped to +-BAND*h
+const double MARGIN = 4.0; // interpolated field is used beyond MARGIN*h, > 2*sqrt(3) (stencil reach)
+
+struct GridHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t real_size;  // sizeof(Real_t)
+	int32_t levels;
+	int32_t size;
+	uint32_t reserved;
+	uint64_t key;        // see GravityGrid::Key()
+};
+
+// squared distance of p to the triangle abc, see Ericson, Real-Time Collision Detection, 5.1.5
+double point_triangle_distance2(const double* p, const double* a, const double* b, const double* c)
+{
+	double ab[3], ac[3], ap[3], q[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		ab[k] = b[k] - a[k];
+		ac[k] = c[k] - a[k];
+		ap[k] = p[k] - a[k];
+	}
+	auto dot = [](const double* x, const double* y) { return x[0]*y[0] + x[1]*y[1] + x[2]*y[2]; };
+	auto dist2 = [&](const double* x) { double d[3] = { p[0]-x[0], p[1]-x[1], p[2]-x[2] }; return dot(d, d); };
+
+	const double d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if (d1 <= 0.0 && d2 <= 0.0)
+		return dist2(a);
+
+	double bp[3] = { p[0]-b[0], p[1]-b[1], p[2]-b[2] };
+	const double d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if (d3 >= 0.0 && d4 <= d3)
+		return dist2(b);
+
+	const double vc = d1*d4 - d3*d2;
+	if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0)
+	{
+		const double v = d1 / (d1 - d3);
+		for (int k = 0; k < 3; ++k)
+			q[k] = a[k] + v * ab[k];
+		return dist2(q);
+	}
+
+	double cp[3] = { p[0]-c[0], p[1]-c[1], p[2]-c[2] };
+	const double d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if (d6 >= 0.0 && d5 <= d6)
+		return dist2(c);
+
+	const double vb = d5*d2 - d1*d6;
+	if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0)
+	{
+		const double w = d2 / (d2 - d6);
+		for (int k = 0; k < 3; ++k)
+			q[k] = a[k] + w * ac[k];
+		return dist2(q);
+	}
+
+	const double va = d3*d6 - d5*d4;
+	if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0)
+	{
+		const double w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		for (int k = 0; k < 3; ++k)
+			q[k] = b[k] + w * (c[k] - b[k]);
+		return dist2(q);
+	}
+
+	const double denom = 1.0 / (va + vb + vc);
+	const double v = vb * denom, w = vc * denom;
+	for (int k = 0; k < 3; ++k)
+		q[k] = a[k] + ab[k] * v + ac[k] * w;
+	return dist2(q);
+}
+
+// Catmull-Rom weights of the nodes -1, 0, 1, 2 at t in [0,1)
+inline void catmull_rom(Real_t t, Real_t* w)
+{
+	w[0] = 0.5 * t * ((2.0 - t) * t - 1.0);
+	w[1] = 0.5 * (t * t * (3.0 * t - 5.0) + 2.0);
+	w[2] = 0.5 * t * ((4.0 - 3.0 * t) * t + 1.0);
+	w[3] = 0.5 * (t - 1.0) * t * t;
+}
+
+inline bool is_finite(const Real_t* g)
+{
+	return std::isfinite(g[0]) && std::isfinite(g[1]) && std::isfinite(g[2]);
+}
+
+} // namespace
+
+void GravityGrid::Initialize(const BodyMesh& mesh, bool shared_edge, int levels, int size, const std::string& filename, int thread_count)
+{
+	this->levels = levels;
+	this->size = size;
+	Layout(mesh);
+
+	const unsigned long long key = Key(mesh, shared_edge);
+	if (Load(filename, key))
+	{
+		// grids written before the non-finite nodes were recomputed are rebuilt
+		if (NonFiniteNodes() == 0)
+		{
+			std::cout << "gravity grid   : " << filename << std::endl;
+			return;
+		}
+		std::cout << "Gravity grid '" << filename << "' has non-finite nodes, rebuilding it." << std::endl;
+	}
+
+	Build(mesh, shared_edge, thread_count);
+	if (!Validate(mesh, shared_edge))
+	{
+		std::cerr << "The gravity grid has non-finite values, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	Write(filename, key);
+}
+
+void GravityGrid::Layout(const BodyMesh& mesh)
+{
+	double lo[3] = { 1.0e300, 1.0e300, 1.0e300 };
+	double hi[3] = { -1.0e300, -1.0e300, -1.0e300 };
+	for (int i = 0; i < mesh.NUM_FACES; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				lo[k] = std::min(lo[k], mesh.hrij[(i*4+j)*3+k]);
+				hi[k] = std::max(hi[k], mesh.hrij[(i*4+j)*3+k]);
+			}
+		}
+	}
+	const double extent = std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+
+	// level 0 encloses the mesh with BAND nodes to spare on each side
+	const double half_width = 0.5 * extent / (1.0 - 2.0 * BAND / (size - 1));
+	parameters.assign(8 + 8 * levels, 0.0);
+	parameters[0] = size;
+	for (int k = 0; k < levels; ++k)
+	{
+		const double hw = half_width * std::ldexp(1.0, k);
+		const double h = 2.0 * hw / (size - 1);
+		Real_t* lp = &parameters[8 + 8*k];
+		for (int c = 0; c < 3; ++c)
+			lp[c] = 0.5 * (lo[c] + hi[c]) - hw;
+		lp[3] = 1.0 / h;
+		lp[4] = h;
+	}
+}
+
+void GravityGrid::Build(const BodyMesh& mesh, bool shared_edge, int thread_count)
+{
+	const size_t per_level = static_cast<size_t>(size) * size * size;
+	const size_t total = levels * per_level;
+	std::cout << "Building the gravity grid (" << total << " nodes) ..." << std::endl;
+	ham::util::time::timer timer;
+
+	auto node_position = [&](size_t n, Real_t* pos) {
+		const int k = n / per_level;
+		const size_t i = n % per_level;
+		const Real_t* lp = &parameters[8 + 8*k];
+		pos[0] = lp[0] + (i % size) * lp[4];
+		pos[1] = lp[1] + ((i / size) % size) * lp[4];
+		pos[2] = lp[2] + (i / (static_cast<size_t>(size) * size)) * lp[4];
+		pos[3] = 0.0;
+	};
+
+	// exact field at all nodes, chunks are distributed dynamically over the threads
+	nodes.assign(4 * total, 0.0);
+	std::vector<Real_t> thetasum(total);
+	std::atomic<size_t> next_chunk(0);
+	const size_t chunk = 256;
+	auto worker = [&] {
+		std::vector<Real_t> pos(4 * chunk), g(3 * chunk), ts(chunk);
+		for (size_t first = next_chunk.fetch_add(chunk); first < total; first = next_chunk.fetch_add(chunk))
+		{
+			const int count = std::min(chunk, total - first);
+			for (int i = 0; i < count; ++i)
+				node_position(first + i, &pos[i*4]);
+			cpu_exact_field(mesh, shared_edge, pos.data(), count, g.data(), ts.data());
+			for (int i = 0; i < count; ++i)
+			{
+				for (int k = 0; k < 3; ++k)
+					nodes[(first+i)*4+k] = g[i*3+k];
+				thetasum[first+i] = ts[i];
+			}
+		}
+	};
+	if (thread_count <= 0)
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; ++t)
+		threads.push_back(std::thread(worker));
+	for (auto& thread : threads)
+		thread.join();
+
+	// the exact field can be non-finite at single nodes (cancellation in the face sums), they are
+	// recomputed at positions nudged by a small fraction of the node spacing
+	int recomputed = 0;
+	for (size_t n = 0; n < total; ++n)
+	{
+		if (is_finite(&nodes[n*4]) && std::isfinite(thetasum[n]))
+			continue;
+		Real_t pos[4];
+		node_position(n, pos);
+		const Real_t h = parameters[8 + 8*(n / per_level) + 4];
+		for (double nudge = 1.0e-6; nudge < 1.0; nudge *= 100.0)
+		{
+			const Real_t p[4] = { pos[0] + nudge * h, pos[1] + nudge * h, pos[2] + nudge * h, 0.0 };
+			Real_t g[3], ts;
+			cpu_exact_field(mesh, shared_edge, p, 1, g, &ts);
+			for (int k = 0; k < 3; ++k)
+				nodes[n*4+k] = g[k];
+			thetasum[n] = ts;
+			if (is_finite(g) && std::isfinite(ts))
+				break;
+		}
+		++recomputed;
+	}
+	if (recomputed > 0)
+		std::cout << "gravity grid   : recomputed " << recomputed << " nodes with a non-finite field at nudged positions" << std::endl;
+
+	// signed distance in a narrow band around the surface, the sign is given by the solid angle
+	for (int k = 0; k < levels; ++k)
+	{
+		const Real_t* lp = &parameters[8 + 8*k];
+		const double band = BAND * lp[4];
+		std::vector<double> dist2(per_level, band * band);
+		for (int f = 0; f < mesh.NUM_FACES; ++f)
+		{
+			const Real_t* v[3] = { &mesh.hrij[(f*4+0)*3], &mesh.hrij[(f*4+1)*3], &mesh.hrij[(f*4+2)*3] };
+			int lo[3], hi[3];
+			for (int c = 0; c < 3; ++c)
+			{
+				const double vmin = std::min(v[0][c], std::min(v[1][c], v[2][c])) - band;
+				const double vmax = std::max(v[0][c], std::max(v[1][c], v[2][c])) + band;
+				lo[c] = std::max(0, static_cast<int>(std::ceil((vmin - lp[c]) * lp[3])));
+				hi[c] = std::min(size - 1, static_cast<int>(std::floor((vmax - lp[c]) * lp[3])));
+			}
+			for (int z = lo[2]; z <= hi[2]; ++z)
+			{
+				for (int y = lo[1]; y <= hi[1]; ++y)
+				{
+					for (int x = lo[0]; x <= hi[0]; ++x)
+					{
+						const double p[3] = { lp[0] + x * lp[4], lp[1] + y * lp[4], lp[2] + z * lp[4] };
+						double& d2 = dist2[(static_cast<size_t>(z) * size + y) * size + x];
+						d2 = std::min(d2, point_triangle_distance2(p, v[0], v[1], v[2]));
+					}
+				}
+			}
+		}
+		for (size_t i = 0; i < per_level; ++i)
+		{
+			const size_t n = k * per_level + i;
+			nodes[n*4+3] = (thetasum[n] > 2.0 * 3.1415926535897932385) ? -std::sqrt(dist2[i]) : std::sqrt(dist2[i]);
+		}
+	}
+
+	std::cout << "Building the gravity grid took " << timer.elapsed() * 1.0e-9 << " s" << std::endl; // ns
+}
+
+bool GravityGrid::Sample(const Real_t* pos, Real_t* g, Real_t* thetasum) const
+{
+	const size_t per_level = static_cast<size_t>(size) * size * size;
+	for (int k = 0; k < levels; ++k)
+	{
+		const Real_t* lp = &parameters[8 + 8*k];
+		const Real_t u[3] = { (pos[0] - lp[0]) * lp[3], (pos[1] - lp[1]) * lp[3], (pos[2] - lp[2]) * lp[3] };
+		// the stencil i-1..i+2 has to be inside the level
+		if (u[0] < 1.0 || u[1] < 1.0 || u[2] < 1.0 || u[0] >= size - 2 || u[1] >= size - 2 || u[2] >= size - 2)
+			continue;
+
+		int i[3];
+		Real_t w[3][4];
+		for (int c = 0; c < 3; ++c)
+		{
+			i[c] = static_cast<int>(std::floor(u[c]));
+			catmull_rom(u[c] - i[c], w[c]);
+		}
+		const Real_t* level = &nodes[4 * k * per_level];
+		Real_t s[4] = { 0.0, 0.0, 0.0, 0.0 };
+		for (int c = 0; c < 4; ++c)
+		{
+			for (int b = 0; b < 4; ++b)
+			{
+				for (int a = 0; a < 4; ++a)
+				{
+					const Real_t wabc = w[0][a] * w[1][b] * w[2][c];
+					const Real_t* node = &level[4 * ((static_cast<size_t>(i[2] - 1 + c) * size + (i[1] - 1 + b)) * size + (i[0] - 1 + a))];
+					for (int q = 0; q < 4; ++q)
+						s[q] += wabc * node[q];
+				}
+			}
+		}
+
+		const Real_t margin = MARGIN * lp[4];
+		if (s[3] > margin) // the whole stencil is outside the body
+		{
+			g[0] = s[0];
+			g[1] = s[1];
+			g[2] = s[2];
+			*thetasum = 0.0;
+			return true;
+		}
+		if (s[3] < -margin) // inside
+		{
+			g[0] = g[1] = g[2] = 0.0;
+			*thetasum = 4.0 * 3.1415926535897932385;
+			return true;
+		}
+		return false; // close to the surface
+	}
+	return false;
+}
+
+unsigned long long GravityGrid::Key(const BodyMesh& mesh, bool shared_edge) const
+{
+	// FNV-1a of the vertices and the grid parameters
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&](const void* data, size_t bytes) {
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < bytes; ++i)
+		{
+			hash ^= p[i];
+			hash *= 1099511628211ull;
+		}
+	};
+	add(mesh.hrij, 4*3*mesh.NUM_FACES * sizeof(Real_t));
+	add(parameters.data(), parameters.size() * sizeof(Real_t));
+	const int formulation = shared_edge ? 1 : 0;
+	add(&formulation, sizeof(formulation));
+	return hash;
+}
+
+bool GravityGrid::Load(const std::string& filename, unsigned long long key)
+{
+	FILE *fd = fopen(filename.c_str(), "rb");
+	if (!fd)
+		return false;
+
+	GridHeader header;
+	bool valid = fread(&header, sizeof(header), 1, fd) == 1
+		&& std::memcmp(header.magic, GRID_MAGIC, sizeof(GRID_MAGIC)) == 0
+		&& header.version == GRID_VERSION
+		&& header.byte_order == GRID_BYTE_ORDER_MARK
+		&& header.real_size == sizeof(Real_t)
+		&& header.levels == levels
+		&& header.size == size
+		&& header.key == key;
+	if (valid)
+	{
+		// parameters are part of the key, they are recomputed by Layout()
+		nodes.resize(4 * static_cast<size_t>(levels) * size * size * size);
+		valid = fseek(fd, sizeof(header) + parameters.size() * sizeof(Real_t), SEEK_SET) == 0
+			&& fread(nodes.data(), sizeof(Real_t), nodes.size(), fd) == nodes.size();
+	}
+	fclose(fd);
+	if (!valid)
+	{
+		std::cout << "Ignoring outdated or invalid gravity grid '" << filename << "'." << std::endl;
+		nodes.clear();
+	}
+	return valid;
+}
+
+bool GravityGrid::Write(const std::string& filename, unsigned long long key) const
+{
+	GridHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, GRID_MAGIC, sizeof(GRID_MAGIC));
+	header.version = GRID_VERSION;
+	header.byte_order = GRID_BYTE_ORDER_MARK;
+	header.real_size = sizeof(Real_t);
+	header.levels = levels;
+	header.size = size;
+	header.key = key;
+
+	// written to a temporary file of this process first, concurrent runs never read a partial grid
+	const std::string tmp_file = filename + ".tmp." + std::to_string(getpid());
+	FILE *fd = fopen(tmp_file.c_str(), "wb");
+	if (!fd)
+	{
+		std::cerr << "Could not write gravity grid '" << filename << "'." << std::endl;
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fd) == 1
+		&& fwrite(parameters.data(), sizeof(Real_t), parameters.size(), fd) == parameters.size()
+		&& fwrite(nodes.data(), sizeof(Real_t), nodes.size(), fd) == nodes.size();
+	ok = (fclose(fd) == 0) && ok;
+	if (!ok || rename(tmp_file.c_str(), filename.c_str()) != 0)
+	{
+		std::cerr << "Could not write gravity grid '" << filename << "'." << std::endl;
+		remove(tmp_file.c_str());
+		return false;
+	}
+	std::cout << "Wrote gravity grid '" << filename << "'." << std::endl;
+	return true;
+}
+
+int GravityGrid::NonFiniteNodes() const
+{
+	int count = 0;
+	for (size_t n = 0; n < nodes.size(); n += 4)
+		if (!is_finite(&nodes[n]) || !std::isfinite(nodes[n+3]))
+			++count;
+	return count;
+}
+
+bool GravityGrid::Validate(const BodyMesh& mesh, bool shared_edge) const
+{
+	const int non_finite_nodes = NonFiniteNodes();
+	if (non_finite_nodes > 0)
+	{
+		std::cerr << "gravity grid   : " << non_finite_nodes << " nodes with a non-finite field" << std::endl;
+		return false;
+	}
+
+	// random positions in the outermost level, compared with the exact field where the grid is used
+	const int count = 1000;
+	const Real_t* lp = &parameters[8 + 8*(levels-1)];
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> uniform(0.0, (size - 1) * lp[4]);
+	std::vector<Real_t> pos, g_grid;
+	for (int i = 0; i < count; ++i)
+	{
+		const Real_t p[4] = { lp[0] + uniform(rng), lp[1] + uniform(rng), lp[2] + uniform(rng), 0.0 };
+		Real_t g[3], thetasum;
+		if (Sample(p, g, &thetasum) && thetasum == 0.0)
+		{
+			pos.insert(pos.end(), p, p + 4);
+			g_grid.insert(g_grid.end(), g, g + 3);
+		}
+	}
+	const int sampled = pos.size() / 4;
+	if (sampled == 0)
+		return true;
+
+	std::vector<Real_t> g(3 * sampled), thetasum(sampled);
+	cpu_exact_field(mesh, shared_edge, pos.data(), sampled, g.data(), thetasum.data());
+	// NOTE: std::max() would drop a NaN error, non-finite samples are counted instead
+	double max_error = 0.0;
+	int non_finite = 0;
+	for (int i = 0; i < sampled; ++i)
+	{
+		if (!is_finite(&g_grid[i*3]) || !is_finite(&g[i*3]))
+		{
+			++non_finite;
+			continue;
+		}
+		const double d[3] = { g_grid[i*3+0] - g[i*3+0], g_grid[i*3+1] - g[i*3+1], g_grid[i*3+2] - g[i*3+2] };
+		max_error = std::max(max_error, std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2])
+		                              / std::sqrt(g[i*3+0]*g[i*3+0] + g[i*3+1]*g[i*3+1] + g[i*3+2]*g[i*3+2]));
+	}
+	const std::streamsize precision = std::cout.precision(3);
+	const std::ios_base::fmtflags flags = std::cout.setf(std::ios_base::scientific, std::ios_base::floatfield);
+	std::cout << "gravity grid   : max. relative error " << max_error << " at " << sampled << " random positions" << std::endl;
+	std::cout.flags(flags);
+	std::cout.precision(precision);
+	if (non_finite > 0)
+	{
+		std::cerr << "gravity grid   : non-finite field at " << non_finite << " of the random positions" << std::endl;
+		return false;
+	}
+	return true;
+}
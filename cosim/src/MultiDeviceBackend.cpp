@@ -0,0 +1,289 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "MultiDeviceBackend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+MultiDeviceBackend::MultiDeviceBackend(ComputeConfig& config, const BodyMesh& mesh, const BodyMultipole& multipole, const GravityGrid& grid,
+                                       const std::vector<ComputeBackend*>& devices, const std::vector<std::string>& names)
+	: ComputeBackend(config, mesh, multipole, grid), devices(devices), names(names)
+{
+}
+
+MultiDeviceBackend::~MultiDeviceBackend()
+{
+	for (ComputeBackend* device : devices)
+		delete device;
+}
+
+void MultiDeviceBackend::Initialize()
+{
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		std::cout << "device " << names[d] << std::endl;
+		devices[d]->Initialize();
+	}
+	name = std::string(devices[0]->getName()) + " on " + std::to_string(devices.size()) + " devices";
+	throughput.assign(devices.size(), 1.0);
+	first.assign(devices.size() + 1, 0);
+	hpos.resize(4 * config.particle_count);
+	hvel.resize(4 * config.particle_count);
+}
+
+ham::util::time::rep MultiDeviceBackend::RunDevices(int count)
+{
+	const size_t n = devices.size();
+	std::vector<int> active(n);
+	std::vector<ham::util::time::rep> elapsed(n, 0.0);
+	std::vector<std::thread> threads;
+	for (size_t d = 0; d < n; ++d)
+	{
+		active[d] = devices[d]->getActiveCount();
+		threads.emplace_back([this, d, count, &elapsed]() {
+			ham::util::time::timer timer;
+			devices[d]->PropagateSteps(count);
+			devices[d]->Synchronize();
+			elapsed[d] = timer.elapsed();
+		});
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	ham::util::time::rep slowest = 0.0;
+	for (size_t d = 0; d < n; ++d)
+	{
+		// NOTE: devices without active particles keep their last throughput
+		if (active[d] > 0 && elapsed[d] > 0.0)
+			throughput[d] = active[d] * static_cast<double>(count) / (elapsed[d] * 1.0e-9);
+		slowest = std::max(slowest, elapsed[d]);
+	}
+	return slowest;
+}
+
+void MultiDeviceBackend::PropagateSteps(int count)
+{
+	// the step time is that of the slowest device
+	const ham::util::time::rep elapsed = RunDevices(count);
+	step += count;
+	for (int i = 0; i < count; ++i)
+		stats.add(elapsed / count);
+}
+
+void MultiDeviceBackend::Synchronize()
+{
+	// NOTE: no-op after RunDevices(), which waits for the devices to measure their throughput
+	for (ComputeBackend* device : devices)
+		device->Synchronize();
+}
+
+void MultiDeviceBackend::SetStep(int s)
+{
+	step = s;
+	for (ComputeBackend* device : devices)
+		device->SetStep(s);
+}
+
+void MultiDeviceBackend::CompactParticles()
+{
+	double total_active = 0.0, total_throughput = 0.0, slowest = 0.0;
+	active_count = 0;
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		devices[d]->CompactParticles();
+		active_count += devices[d]->getActiveCount();
+		total_active += devices[d]->getActiveCount();
+		total_throughput += throughput[d];
+		slowest = std::max(slowest, devices[d]->getActiveCount() / throughput[d]);
+	}
+
+	// times of the next step relative to a perfect split
+	if (config.opencl_rebalance <= 0.0 || total_active == 0.0 || slowest <= config.opencl_rebalance * total_active / total_throughput)
+		return;
+	GetParticles(num_bodies, hpos.data(), hvel.data());
+	// PutDevices() resets the impact logs of the devices
+	GetImpacts(impacts);
+	Split(num_bodies, hvel.data());
+	PutDevices(hpos.data(), hvel.data());
+	std::cout << "Rebalanced the particles: ";
+	PrintSplit();
+}
+
+void MultiDeviceBackend::UpdateParameters()
+{
+	for (ComputeBackend* device : devices)
+		device->UpdateParameters();
+}
+
+void MultiDeviceBackend::Split(int NumBodies, const Real_t *vel)
+{
+	const size_t n = devices.size();
+	int total = 0;
+	for (int i = 0; i < NumBodies; ++i)
+		if (vel[i*4+3] == 0.0)
+			++total;
+
+	// cumulative number of active particles up to the end of each range
+	double total_throughput = 0.0;
+	for (size_t d = 0; d < n; ++d)
+		total_throughput += throughput[d];
+	std::vector<int> target(n);
+	double sum = 0.0;
+	for (size_t d = 0; d < n; ++d)
+	{
+		sum += throughput[d];
+		target[d] = static_cast<int>(std::lround(total * sum / total_throughput));
+	}
+
+	// cut after the particle that reaches the target, all particles without active ones go equally
+	first.assign(n + 1, NumBodies);
+	first[0] = 0;
+	if (total == 0)
+	{
+		for (size_t d = 1; d < n; ++d)
+			first[d] = static_cast<int>(static_cast<long long>(NumBodies) * d / n);
+		return;
+	}
+	size_t d = 0;
+	int seen = 0;
+	for (int i = 0; i < NumBodies && d < n - 1; ++i)
+	{
+		while (d < n - 1 && seen >= target[d])
+			first[++d] = i;
+		if (vel[i*4+3] == 0.0)
+			++seen;
+	}
+}
+
+void MultiDeviceBackend::PutDevices(Real_t *pos, Real_t *vel)
+{
+	// also devices with an empty range, that resets their active particles
+	active_count = 0;
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		devices[d]->PutParticles(first[d+1] - first[d], pos + 4 * first[d], vel + 4 * first[d]);
+		devices[d]->SetStep(step);
+		if (!jacobi_reference.empty())
+			devices[d]->PutJacobiReference(first[d+1] - first[d], jacobi_reference.data() + first[d]);
+		active_count += devices[d]->getActiveCount();
+	}
+}
+
+void MultiDeviceBackend::Calibrate(Real_t *pos, Real_t *vel)
+{
+	// equal split, the first run includes one-time costs of the devices, the second one is measured
+	throughput.assign(devices.size(), 1.0);
+	Split(num_bodies, vel);
+	PutDevices(pos, vel);
+	RunDevices(1);
+	PutDevices(pos, vel);
+	RunDevices(1);
+	calibrated = true;
+}
+
+void MultiDeviceBackend::PutParticles(int NumBodies, Real_t *pos, Real_t *vel)
+{
+	num_bodies = NumBodies;
+	if (!calibrated)
+		Calibrate(pos, vel);
+	Split(NumBodies, vel);
+	PutDevices(pos, vel);
+	impacts.clear();
+	PrintSplit();
+}
+
+void MultiDeviceBackend::GetImpacts(std::vector<ImpactEvent>& events)
+{
+	// events may alias impacts (rebalancing)
+	std::vector<ImpactEvent> collected;
+	collected.swap(impacts);
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		const size_t begin = collected.size();
+		devices[d]->GetImpacts(collected);
+		for (size_t i = begin; i < collected.size(); ++i)
+			collected[i].particle += first[d];
+	}
+	events.insert(events.end(), collected.begin(), collected.end());
+}
+
+void MultiDeviceBackend::GetParticles(int NumBodies, Real_t *pos, Real_t *vel)
+{
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		const int count = std::min(first[d+1], NumBodies) - first[d];
+		if (count > 0)
+			devices[d]->GetParticles(count, pos + 4 * first[d], vel + 4 * first[d]);
+	}
+}
+
+void MultiDeviceBackend::GetParticlesAsync(int NumBodies, Real_t *pos, Real_t *vel, std::function<void()> done)
+{
+	// done after the last device, the transfers of all devices overlap
+	std::vector<size_t> used;
+	for (size_t d = 0; d < devices.size(); ++d)
+		if (std::min(first[d+1], NumBodies) - first[d] > 0)
+			used.push_back(d);
+	if (used.empty())
+	{
+		done();
+		return;
+	}
+	auto remaining = std::make_shared<std::atomic<int>>(static_cast<int>(used.size()));
+	auto all_done = std::make_shared<std::function<void()>>(std::move(done));
+	for (size_t d : used)
+	{
+		const int count = std::min(first[d+1], NumBodies) - first[d];
+		devices[d]->GetParticlesAsync(count, pos + 4 * first[d], vel + 4 * first[d], [remaining, all_done]() {
+			if (--*remaining == 0)
+				(*all_done)();
+		});
+	}
+}
+
+void MultiDeviceBackend::PrintSplit() const
+{
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		std::cout << ((d > 0) ? ", " : "") << names[d] << ": " << first[d+1] - first[d] << " particles ("
+		          << devices[d]->getActiveCount() << " active, " << std::lround(throughput[d]) << " particle steps/s)";
+	}
+	std::cout << std::endl;
+}
+
+void MultiDeviceBackend::PutJacobiReference(int NumBodies, const Real_t *jacobi)
+{
+	jacobi_reference.assign(jacobi, jacobi + NumBodies);
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		const int count = std::min(first[d+1], NumBodies) - first[d];
+		if (count > 0)
+			devices[d]->PutJacobiReference(count, jacobi + first[d]);
+	}
+}
+
+JacobiDrift MultiDeviceBackend::Diagnostics(int NumBodies, Real_t *diag)
+{
+	JacobiDrift drift;
+	for (size_t d = 0; d < devices.size(); ++d)
+	{
+		const int count = std::min(first[d+1], NumBodies) - first[d];
+		if (count <= 0)
+			continue;
+		const JacobiDrift part = devices[d]->Diagnostics(count, diag ? diag + 4 * first[d] : nullptr);
+		if (part.count == 0)
+			continue;
+		drift.min = (drift.count > 0) ? std::min(drift.min, part.min) : part.min;
+		drift.max = (drift.count > 0) ? std::max(drift.max, part.max) : part.max;
+		drift.sum += part.sum;
+		drift.sum_abs += part.sum_abs;
+		drift.count += part.count;
+	}
+	return drift;
+}
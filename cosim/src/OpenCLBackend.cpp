@@ -0,0 +1,815 @@
+// Copyright (c) 2015 Tobias Kramer <tobias.kramer@mytum.de>
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "OpenCLBackend.h"
+
+#include <CL/cl.hpp>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <sys/stat.h> // mkdir()
+#include <unistd.h> // getpid()
+
+#include "integrate_eom_kernel.h" // generated kernel header
+
+namespace {
+
+// host values (Real_t) in the precision T of the device
+template <typename T>
+std::vector<T> device_reals(const Real_t* data, size_t count)
+{
+	return std::vector<T>(data, data + count);
+}
+
+// converts count values of type T at the beginning of data into Real_t in place,
+// from the back, so no value is overwritten before it is read
+template <typename T>
+void widen_reals(Real_t* data, size_t count)
+{
+	static_assert(sizeof(T) <= sizeof(Real_t), "only widening in place");
+	for (size_t i = count; i-- > 0; )
+	{
+		T value;
+		std::memcpy(&value, reinterpret_cast<const char*>(data) + i * sizeof(T), sizeof(T));
+		data[i] = value;
+	}
+}
+
+// build options of the kernels for COLLISION_TEST, PRECISION, INTEGRATOR and adaptive time stepping (ADAPTIVE_TOLERANCE)
+std::string build_options(const std::string& collision_test, const std::string& precision, const std::string& integrator, bool adaptive)
+{
+	std::string options;
+	if (integrator == "verlet")
+		options += " -DINTEGRATOR_VERLET";
+	else if (integrator == "yoshida4")
+		options += " -DINTEGRATOR_YOSHIDA4";
+	else if (integrator == "rk4")
+		options += " -DINTEGRATOR_RK4";
+	else if (integrator == "rkf45")
+		options += " -DINTEGRATOR_RKF45";
+	else if (adaptive)
+		options += " -DADAPTIVE_STEPS";
+	if (collision_test == "bvh")
+		options += " -DCOLLISION_BVH";
+	if (precision == "float")
+		options += " -DPRECISION_FLOAT -cl-single-precision-constant";
+	else if (precision == "mixed")
+		options += " -DPRECISION_MIXED";
+	return options;
+}
+
+// program binary cache file: header, then the binary of one device
+const char PROGRAM_MAGIC[8] = { 'C', 'O', 'S', 'I', 'M', 'C', 'L', 'B' };
+const uint32_t PROGRAM_VERSION = 1;
+
+struct ProgramHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t key;  // see OpenCLBackend::ProgramCacheFilename()
+	uint64_t size; // bytes of the binary
+};
+
+bool read_program_binary(const std::string& filename, uint64_t key, std::vector<unsigned char>& binary)
+{
+	FILE *fd = fopen(filename.c_str(), "rb");
+	if (!fd)
+		return false;
+	ProgramHeader header;
+	bool valid = fread(&header, sizeof(header), 1, fd) == 1
+		&& std::memcmp(header.magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC)) == 0
+		&& header.version == PROGRAM_VERSION
+		&& header.key == key
+		&& header.size > 0;
+	if (valid)
+	{
+		binary.resize(header.size);
+		valid = fread(binary.data(), 1, binary.size(), fd) == binary.size();
+	}
+	fclose(fd);
+	return valid;
+}
+
+bool write_program_binary(const std::string& filename, uint64_t key, const std::vector<unsigned char>& binary)
+{
+	// the directory may not exist yet
+	for (size_t slash = filename.find('/', 1); slash != std::string::npos; slash = filename.find('/', slash + 1))
+		mkdir(filename.substr(0, slash).c_str(), 0755);
+
+	ProgramHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC));
+	header.version = PROGRAM_VERSION;
+	header.key = key;
+	header.size = binary.size();
+
+	// written to a temporary file of this process first, concurrent runs never load a partial binary
+	const std::string tmp_file = filename + ".tmp." + std::to_string(getpid());
+	FILE *fd = fopen(tmp_file.c_str(), "wb");
+	if (!fd)
+		return false;
+	bool ok = fwrite(&header, sizeof(header), 1, fd) == 1
+		&& fwrite(binary.data(), 1, binary.size(), fd) == binary.size();
+	ok = (fclose(fd) == 0) && ok;
+	if (!ok || rename(tmp_file.c_str(), filename.c_str()) != 0)
+	{
+		remove(tmp_file.c_str());
+		return false;
+	}
+	return true;
+}
+
+} // namespace
+
+cl::Device OpenCLBackend::SelectDevice()
+{
+	// Get available platforms
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+
+	if (platform_id < 0 || platform_id >= static_cast<int>(platforms.size()))
+	{
+		std::cerr << "OpenCL platform " << platform_id << " not found, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Select platform from config and create a context
+	cl_context_properties cps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[platform_id])(), 0 };
+	context = cl::Context(CL_DEVICE_TYPE_ALL, cps);
+
+	// Get a list of devices on this platform
+	std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+	if (device_id < 0 || device_id >= static_cast<int>(devices.size()))
+	{
+		std::cerr << "OpenCL device " << platform_id << ":" << device_id << " not found, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return devices[device_id];
+}
+
+std::string OpenCLBackend::ProgramCacheFilename(const cl::Device& device, const std::string& options, uint64_t& key) const
+{
+	if (config.opencl_program_cache == "off")
+		return "";
+
+	// FNV-1a of device, driver, kernel source and build options
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&](const void* data, size_t bytes) {
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < bytes; ++i)
+		{
+			hash ^= p[i];
+			hash *= 1099511628211ull;
+		}
+	};
+	const cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+	const std::string identity[] = {
+		platform.getInfo<CL_PLATFORM_NAME>(), platform.getInfo<CL_PLATFORM_VERSION>(),
+		device.getInfo<CL_DEVICE_VENDOR>(), device.getInfo<CL_DEVICE_NAME>(), device.getInfo<CL_DEVICE_VERSION>(),
+		device.getInfo<CL_DRIVER_VERSION>(), options };
+	for (const std::string& s : identity)
+		add(s.c_str(), s.size() + 1);
+	add(integrate_eom_kernel_cl, integrate_eom_kernel_cl_len);
+	key = hash;
+
+	char name[32];
+	sprintf(name, "/%016llx.clbin", static_cast<unsigned long long>(hash));
+	return config.opencl_program_cache + name;
+}
+
+cl::Program OpenCLBackend::BuildProgram(const cl::Device& device, const std::string& options)
+{
+	const std::vector<cl::Device> devices(1, device);
+	uint64_t key = 0;
+	const std::string filename = ProgramCacheFilename(device, options, key);
+
+	// a cached binary skips the compilation of the kernel source
+	std::vector<unsigned char> binary;
+	if (!filename.empty() && read_program_binary(filename, key, binary))
+	{
+		cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void*>(binary.data()), binary.size()));
+		std::vector<int> status(1, CL_SUCCESS);
+		cl_int err = CL_SUCCESS;
+		cl::Program program(context, devices, binaries, &status, &err);
+		if (err == CL_SUCCESS && status[0] == CL_SUCCESS && program.build(devices, options.c_str()) == CL_SUCCESS)
+		{
+			std::cout << "OpenCL program binary: " << filename << std::endl;
+			return program;
+		}
+		std::cout << "Ignoring invalid OpenCL program binary '" << filename << "'." << std::endl;
+	}
+
+	// Read source file
+//	std::ifstream sourceFile_eom("cl/integrate_eom_kernel.cl");
+//	std::string sourceCode_eom(std::istreambuf_iterator<char>(sourceFile_eom),(std::istreambuf_iterator<char>()));
+//	Program::Sources source_eom(1, std::make_pair(sourceCode_eom.c_str(), sourceCode_eom.length()+1));
+	// NOTE: use kernel string from generated include file
+	cl::Program::Sources source_eom(1, std::make_pair((const char*)integrate_eom_kernel_cl, integrate_eom_kernel_cl_len));
+	// Make program of the source code in the context
+	cl::Program program(context, source_eom);
+	// Build program for the selected device
+	const cl_int build_err = program.build(devices, options.c_str());
+	cl_int err = 0;
+	std::string buildInfo = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device, &err);
+	std::cout << "BuildInfo: " << buildInfo << std::endl;
+
+	if (err != CL_SUCCESS || build_err != CL_SUCCESS)
+	{
+		std::cout << "OpenCL kernel build failed, exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if (!filename.empty())
+	{
+		// binary of the single device of the program
+		const std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+		binary.assign(sizes.empty() ? 0 : sizes[0], 0);
+		unsigned char* binaries[1] = { binary.data() };
+		if (!binary.empty() && clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(binaries), binaries, nullptr) == CL_SUCCESS
+			&& write_program_binary(filename, key, binary))
+			std::cout << "Wrote OpenCL program binary '" << filename << "'." << std::endl;
+		else
+			std::cerr << "Could not write OpenCL program binary '" << filename << "'." << std::endl;
+	}
+	return program;
+}
+
+void OpenCLBackend::BuildProgramCache()
+{
+	const cl::Device device = SelectDevice();
+	std::cout << "OpenCL device " << platform_id << ":" << device_id << ": " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+	for (const char* collision_test : { "solid_angle", "bvh" })
+		for (const char* precision : { "double", "float", "mixed" })
+		{
+			// step doubling only with kick_drift, rkf45 is always adaptive
+			BuildProgram(device, build_options(collision_test, precision, "kick_drift", false));
+			BuildProgram(device, build_options(collision_test, precision, "kick_drift", true));
+			for (const char* integrator : { "verlet", "yoshida4", "rk4", "rkf45" })
+				BuildProgram(device, build_options(collision_test, precision, integrator, false));
+		}
+}
+
+void OpenCLBackend::Initialize()
+{
+	const cl::Device device = SelectDevice();
+
+	// Create a command queue and use the device from config
+	queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+	// compiled from the kernel source or loaded from the program binary cache
+	program_eom = BuildProgram(device, build_options(config.collision_test, config.precision, config.integrator, config.adaptive_tolerance > 0.0));
+
+	// Make kernel
+	std::string kernelName = "integrate_eom";
+	if (config.gravity_kernel == "edge")
+		kernelName = "integrate_eom_edges";
+	else if (config.gravity_kernel == "shared_edge")
+		kernelName = "integrate_eom_shared_edges";
+	else if (config.gravity_kernel == "tiled")
+		kernelName = "integrate_eom_tiled";
+	kernel_eom = cl::Kernel(program_eom, kernelName.c_str());
+	fprintf(stderr,"building %s done\n", kernelName.c_str());
+	kernel_compact_scan = cl::Kernel(program_eom, "compact_scan");
+	kernel_compact_scan_blocks = cl::Kernel(program_eom, "compact_scan_blocks");
+	kernel_compact_scatter = cl::Kernel(program_eom, "compact_scatter");
+	kernel_diagnostics = cl::Kernel(program_eom, "diagnostics");
+	kernel_diagnostics_reduce = cl::Kernel(program_eom, "diagnostics_reduce");
+
+
+	// NDRange: global size is padded to a multiple of the work-group size, the kernels skip padding work-items
+	local_size = config.opencl_work_group_size;
+	if (local_size == 0 && config.gravity_kernel == "tiled")
+		local_size = 64; // the tiled kernel needs an explicit work-group size, it equals the tile size
+
+	// compaction: all three kernels use the same work-group size
+	compact_size = 256;
+	compact_size = std::min(compact_size, kernel_compact_scan.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	compact_size = std::min(compact_size, kernel_compact_scan_blocks.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	compact_size = std::min(compact_size, kernel_compact_scatter.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	const size_t compact_groups = (config.particle_count + compact_size - 1) / compact_size;
+
+	// diagnostics: both kernels use the same work-group size
+	diag_size = 256;
+	diag_size = std::min(diag_size, kernel_diagnostics.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	diag_size = std::min(diag_size, kernel_diagnostics_reduce.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	const bool diagnostics = config.jacobi_report || config.jacobi_output;
+	const size_t diag_groups = diagnostics ? (config.particle_count + diag_size - 1) / diag_size : 0;
+
+	// the device holds all floating point data in single precision for PRECISION=float
+	real_size = (config.precision == "float") ? sizeof(cl_float) : sizeof(cl_double);
+
+	// Create memory buffers on OpenCL device
+	gposold  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * real_size);
+	gvelold  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * real_size);
+	gposnew  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * real_size);
+	gvelnew  = cl::Buffer(context, CL_MEM_READ_WRITE, 4*config.particle_count * real_size);
+	gactive    = cl::Buffer(context, CL_MEM_READ_WRITE, config.particle_count * sizeof(int));
+	gactivetmp = cl::Buffer(context, CL_MEM_READ_WRITE, config.particle_count * sizeof(int));
+	goffset    = cl::Buffer(context, CL_MEM_READ_WRITE, config.particle_count * sizeof(int));
+	gblock     = cl::Buffer(context, CL_MEM_READ_WRITE, (compact_groups + 1) * sizeof(int));
+	gnv      = cl::Buffer(context, CL_MEM_READ_ONLY,  3*mesh.NUM_FACES * real_size);
+	grij     = cl::Buffer(context, CL_MEM_READ_ONLY,  4*3*mesh.NUM_FACES * real_size);
+	gjacobiref = cl::Buffer(context, CL_MEM_READ_ONLY,  std::max(diagnostics ? config.particle_count : 0, 1) * real_size);
+	gdiag      = cl::Buffer(context, CL_MEM_WRITE_ONLY, std::max(diagnostics ? 4*config.particle_count : 0, 4) * real_size);
+	gdiagblock = cl::Buffer(context, CL_MEM_READ_WRITE, 4*(diag_groups + 1) * real_size);
+	gdiagcount = cl::Buffer(context, CL_MEM_READ_WRITE, (diag_groups + 1) * sizeof(cl_int));
+	max_impacts = config.impact_log ? config.particle_count : 0;
+	gimpactid    = cl::Buffer(context, CL_MEM_WRITE_ONLY, std::max(max_impacts, 1) * sizeof(cl_int4));
+	gimpact      = cl::Buffer(context, CL_MEM_WRITE_ONLY, 2*4*std::max(max_impacts, 1) * real_size);
+	gimpactcount = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+
+	if (config.gravity_kernel == "edge")
+	{
+		gplane   = cl::Buffer(context, CL_MEM_READ_ONLY,  4*mesh.NUM_FACES * real_size);
+		gedge    = cl::Buffer(context, CL_MEM_READ_ONLY,  2*4*3*mesh.NUM_FACES * real_size);
+
+		// Set invariant kernel arguments
+		kernel_eom.setArg( 5, gplane);
+		kernel_eom.setArg( 6, grij);
+		kernel_eom.setArg( 7, gedge);
+		numpoints_arg = 8; // active particle count, set in PropagateSteps()
+		kernel_eom.setArg( 9, mesh.NUM_FACES);
+		parameters_arg = 10; // DELTA_T, COMET_ANGULAR_FREQUENCY, G*COMET_DENSITY, ADAPTIVE_TOLERANCE, set in UpdateParameters()
+		numsteps_arg = 14; // set in PropagateSteps()
+	}
+	else if (config.gravity_kernel == "shared_edge")
+	{
+		gplane   = cl::Buffer(context, CL_MEM_READ_ONLY,  4*mesh.NUM_FACES * real_size);
+		gsedge   = cl::Buffer(context, CL_MEM_READ_ONLY,  5*4*mesh.NUM_EDGES * real_size);
+
+		// Set invariant kernel arguments
+		kernel_eom.setArg( 5, gplane);
+		kernel_eom.setArg( 6, grij);
+		kernel_eom.setArg( 7, gsedge);
+		numpoints_arg = 8; // active particle count, set in PropagateSteps()
+		kernel_eom.setArg( 9, mesh.NUM_FACES);
+		kernel_eom.setArg(10, mesh.NUM_EDGES);
+		parameters_arg = 11; // DELTA_T, COMET_ANGULAR_FREQUENCY, G*COMET_DENSITY, ADAPTIVE_TOLERANCE, set in UpdateParameters()
+		numsteps_arg = 15; // set in PropagateSteps()
+	}
+	else if (config.gravity_kernel == "tiled")
+	{
+		const size_t tile_bytes = 10 * 4 * local_size * real_size;
+		if (tile_bytes > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+		{
+			std::cout << "Local memory too small for a work-group size of " << local_size << ", exiting." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+
+		gplane   = cl::Buffer(context, CL_MEM_READ_ONLY,  4*mesh.NUM_FACES * real_size);
+		gvert    = cl::Buffer(context, CL_MEM_READ_ONLY,  3*4*mesh.NUM_FACES * real_size);
+		gedgesoa = cl::Buffer(context, CL_MEM_READ_ONLY,  2*4*3*mesh.NUM_FACES * real_size);
+
+		// Set invariant kernel arguments
+		kernel_eom.setArg( 5, gplane);
+		kernel_eom.setArg( 6, gvert);
+		kernel_eom.setArg( 7, gedgesoa);
+		kernel_eom.setArg( 8, cl::__local(tile_bytes));
+		numpoints_arg = 9; // active particle count, set in PropagateSteps()
+		kernel_eom.setArg(10, mesh.NUM_FACES);
+		parameters_arg = 11; // DELTA_T, COMET_ANGULAR_FREQUENCY, G*COMET_DENSITY, ADAPTIVE_TOLERANCE, set in UpdateParameters()
+		numsteps_arg = 15; // set in PropagateSteps()
+	}
+	else
+	{
+		// Set invariant kernel arguments
+		kernel_eom.setArg( 5, gnv);
+		kernel_eom.setArg( 6, grij);
+		numpoints_arg = 7; // active particle count, set in PropagateSteps()
+		kernel_eom.setArg( 8, mesh.NUM_FACES);
+		kernel_eom.setArg( 9, mesh.NUM_VERTICES_PER_FACE );
+		parameters_arg = 10; // DELTA_T, COMET_ANGULAR_FREQUENCY, G*COMET_DENSITY, ADAPTIVE_TOLERANCE, set in UpdateParameters()
+		numsteps_arg = 14; // set in PropagateSteps()
+	}
+
+	UpdateParameters();
+
+	// far-field expansion, a placeholder buffer if it is disabled
+	const std::vector<Real_t>& mp = multipole.getCoefficients();
+	gmultipole = cl::Buffer(context, CL_MEM_READ_ONLY, std::max<size_t>(mp.size(), 1) * real_size);
+	kernel_eom.setArg(numsteps_arg + 1, gmultipole);
+	kernel_eom.setArg(numsteps_arg + 2, multipole.isEnabled() ? multipole.getOrder() : -1);
+
+	// near-field grid, placeholder buffers if it is disabled
+	const std::vector<Real_t>& grid_nodes = grid.getNodes();
+	const std::vector<Real_t>& grid_params = grid.getParameters();
+	ggridnodes = cl::Buffer(context, CL_MEM_READ_ONLY, std::max<size_t>(grid_nodes.size(), 4) * real_size);
+	ggridparams = cl::Buffer(context, CL_MEM_READ_ONLY, std::max<size_t>(grid_params.size(), 1) * real_size);
+	kernel_eom.setArg(numsteps_arg + 3, ggridnodes);
+	kernel_eom.setArg(numsteps_arg + 4, ggridparams);
+	kernel_eom.setArg(numsteps_arg + 5, grid.getLevels());
+
+	// bounding volume hierarchy of COLLISION_TEST=bvh, placeholder buffers otherwise
+	const bool bvh = config.collision_test == "bvh";
+	gbvh    = cl::Buffer(context, CL_MEM_READ_ONLY, (bvh ? 2*4*mesh.NUM_BVH_NODES : 4) * real_size);
+	gbvhtri = cl::Buffer(context, CL_MEM_READ_ONLY, (bvh ? 3*4*mesh.NUM_FACES : 4) * real_size);
+	kernel_eom.setArg(numsteps_arg + 6, gbvh);
+	kernel_eom.setArg(numsteps_arg + 7, gbvhtri);
+
+	// impact log, disabled with maxevents 0
+	kernel_eom.setArg(numsteps_arg + 11, gimpactid);
+	kernel_eom.setArg(numsteps_arg + 12, gimpact);
+	kernel_eom.setArg(numsteps_arg + 13, gimpactcount);
+	kernel_eom.setArg(numsteps_arg + 14, max_impacts);
+
+	// diagnostics, with the per-edge tables of GRAVITY_KERNEL=edge for all gravity kernels
+	if (diagnostics && config.gravity_kernel == "face")
+		gplane = cl::Buffer(context, CL_MEM_READ_ONLY, 4*mesh.NUM_FACES * real_size);
+	if (diagnostics && config.gravity_kernel != "edge")
+		gedge  = cl::Buffer(context, CL_MEM_READ_ONLY, 2*4*3*mesh.NUM_FACES * real_size);
+	if (diagnostics)
+	{
+		kernel_diagnostics.setArg( 2, gjacobiref);
+		kernel_diagnostics.setArg( 3, gplane);
+		kernel_diagnostics.setArg( 4, grij);
+		kernel_diagnostics.setArg( 5, gedge);
+		kernel_diagnostics.setArg( 7, mesh.NUM_FACES);
+		kernel_diagnostics.setArg(10, gdiag);
+		kernel_diagnostics.setArg(11, gdiagblock);
+		kernel_diagnostics.setArg(12, gdiagcount);
+		kernel_diagnostics.setArg(13, cl::__local(diag_size * 4 * real_size));
+		kernel_diagnostics.setArg(14, cl::__local(diag_size * sizeof(cl_int)));
+		kernel_diagnostics_reduce.setArg(0, gdiagblock);
+		kernel_diagnostics_reduce.setArg(1, gdiagcount);
+		kernel_diagnostics_reduce.setArg(2, cl::__local(diag_size * 4 * real_size));
+		kernel_diagnostics_reduce.setArg(3, cl::__local(diag_size * sizeof(cl_int)));
+	}
+
+	// transfer mesh data, particles are transferred by PutParticles()
+	WriteReals(gnv, mesh.hnv, 3*mesh.NUM_FACES);
+	WriteReals(grij, mesh.hrij, 4*3*mesh.NUM_FACES);
+	if (config.gravity_kernel == "edge")
+	{
+		WriteReals(gplane, mesh.hplane, 4*mesh.NUM_FACES);
+		WriteReals(gedge, mesh.hedge, 2*4*3*mesh.NUM_FACES);
+	}
+	if (config.gravity_kernel == "shared_edge")
+	{
+		WriteReals(gplane, mesh.hplane, 4*mesh.NUM_FACES);
+		WriteReals(gsedge, mesh.hsedge, 5*4*mesh.NUM_EDGES);
+	}
+	if (config.gravity_kernel == "tiled")
+	{
+		WriteReals(gplane, mesh.hplane, 4*mesh.NUM_FACES);
+		WriteReals(gvert, mesh.hvert, 3*4*mesh.NUM_FACES);
+		WriteReals(gedgesoa, mesh.hedgesoa, 2*4*3*mesh.NUM_FACES);
+	}
+	if (multipole.isEnabled())
+		WriteReals(gmultipole, mp.data(), mp.size());
+	if (bvh)
+	{
+		WriteReals(gbvh, mesh.hbvh, 2*4*mesh.NUM_BVH_NODES);
+		WriteReals(gbvhtri, mesh.hbvhtri, 3*4*mesh.NUM_FACES);
+	}
+	if (grid.isEnabled())
+	{
+		WriteReals(ggridnodes, grid_nodes.data(), grid_nodes.size());
+		WriteReals(ggridparams, grid_params.data(), grid_params.size());
+	}
+	if (diagnostics)
+	{
+		if (config.gravity_kernel != "edge")
+		{
+			WriteReals(gplane, mesh.hplane, 4*mesh.NUM_FACES);
+			WriteReals(gedge, mesh.hedge, 2*4*3*mesh.NUM_FACES);
+		}
+		const std::vector<Real_t> zero(config.particle_count, 0.0);
+		WriteReals(gjacobiref, zero.data(), zero.size());
+	}
+}
+
+void OpenCLBackend::UpdateParameters()
+{
+	SetRealArg(kernel_eom, parameters_arg + 0, config.delta_t);
+	SetRealArg(kernel_eom, parameters_arg + 1, config.comet_angular_frequency);
+	SetRealArg(kernel_eom, parameters_arg + 2, config.const_gravity * config.comet_density);
+	SetRealArg(kernel_eom, parameters_arg + 3, config.adaptive_tolerance);
+	SetRealArg(kernel_eom, numsteps_arg + 8, EscapeRadius());
+	SetRealArg(kernel_eom, numsteps_arg + 9, EscapeGM());
+	if (config.jacobi_report || config.jacobi_output)
+	{
+		SetRealArg(kernel_diagnostics, 8, config.comet_angular_frequency);
+		SetRealArg(kernel_diagnostics, 9, config.const_gravity * config.comet_density);
+	}
+}
+
+void OpenCLBackend::PropagateSteps(int count)
+{
+	// all particles re-collided, nothing to propagate, both buffers hold the same state (see CompactParticles()),
+	// no launch and no runtime added to the statistics
+	if (active_count == 0)
+	{
+		HarvestLaunches(true);
+		step += count;
+		return;
+	}
+
+	// Run the kernel on specific ND range, only the active particles are propagated
+	size_t global_size = active_count;
+	if (local_size > 0)
+		global_size = ((global_size + local_size - 1) / local_size) * local_size;
+	cl::NDRange global(global_size);
+	cl::NDRange local = (local_size > 0) ? cl::NDRange(local_size) : cl::NullRange;
+
+	kernel_eom.setArg(4, gactive);
+	kernel_eom.setArg(numpoints_arg, active_count);
+
+	// enqueue all launches back to back without waiting, the arguments are captured at enqueue time,
+	// the profiling info is collected later (see HarvestLaunches())
+	HarvestLaunches(false);
+	const int steps_per_launch = (config.steps_per_launch > 0) ? config.steps_per_launch : count;
+	for (int done = 0; done < count; done += launches.back().steps)
+	{
+		// bounded number of launches in flight
+		while (launches.size() >= MAX_LAUNCHES)
+		{
+			launches.front().event.wait();
+			HarvestLaunches(false);
+		}
+
+		// double buffering scheme
+		if (launch_counter % 2 == 0)
+		{
+			kernel_eom.setArg( 0, gposold);
+			kernel_eom.setArg( 1, gvelold);
+			kernel_eom.setArg( 2, gposnew);
+			kernel_eom.setArg( 3, gvelnew);
+		}
+		else
+		{
+			kernel_eom.setArg(0, gposnew);
+			kernel_eom.setArg(1, gvelnew);
+			kernel_eom.setArg(2, gposold);
+			kernel_eom.setArg(3, gvelold);
+		}
+		launches.push_back(Launch());
+		launches.back().steps = std::min(steps_per_launch, count - done);
+		kernel_eom.setArg(numsteps_arg, launches.back().steps);
+		step += launches.back().steps;
+		kernel_eom.setArg(numsteps_arg + 10, step); // the step at the end of the launch, see escape_test()
+		queue.enqueueNDRangeKernel(kernel_eom, cl::NullRange, global, local, 0, &launches.back().event);
+		++launch_counter;
+	}
+	queue.flush();
+}
+
+void OpenCLBackend::HarvestLaunches(bool wait)
+{
+	while (!launches.empty())
+	{
+		Launch& launch = launches.front();
+		if (wait)
+			launch.event.wait();
+		const cl_int status = launch.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+		if (status > CL_COMPLETE)
+			break; // the later launches are not complete either on the in-order queue
+		if (status < 0)
+		{
+			// a negative status is the error of a failed launch, it has no valid profiling info
+			std::cerr << "OpenCL launch failed with error " << status << ", the propagated state is invalid." << std::endl;
+			launches.pop_front();
+			continue;
+		}
+
+		// the runtime of a launch is distributed evenly over its steps
+		double t_start = launch.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		double t_end = launch.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		for (int i = 0; i < launch.steps; ++i)
+			stats.add(static_cast<ham::util::time::rep>(t_end - t_start) / launch.steps);
+		launches.pop_front();
+	}
+}
+
+void OpenCLBackend::Synchronize()
+{
+	HarvestLaunches(true);
+}
+
+void OpenCLBackend::CompactParticles()
+{
+	if (active_count == 0)
+		return;
+
+	// the current state is in the *old buffers after an even number of launches
+	const bool even = (launch_counter % 2 == 0);
+	const int numblocks = static_cast<int>((active_count + compact_size - 1) / compact_size);
+	cl::NDRange global(numblocks * compact_size);
+	cl::NDRange local(compact_size);
+
+	kernel_compact_scan.setArg(0, even ? gposold : gposnew);
+	kernel_compact_scan.setArg(1, even ? gvelold : gvelnew);
+	kernel_compact_scan.setArg(2, even ? gposnew : gposold);
+	kernel_compact_scan.setArg(3, even ? gvelnew : gvelold);
+	kernel_compact_scan.setArg(4, gactive);
+	kernel_compact_scan.setArg(5, goffset);
+	kernel_compact_scan.setArg(6, gblock);
+	kernel_compact_scan.setArg(7, cl::__local(compact_size * sizeof(cl_int)));
+	kernel_compact_scan.setArg(8, active_count);
+	queue.enqueueNDRangeKernel(kernel_compact_scan, cl::NullRange, global, local);
+
+	kernel_compact_scan_blocks.setArg(0, gblock);
+	kernel_compact_scan_blocks.setArg(1, cl::__local(compact_size * sizeof(cl_int)));
+	kernel_compact_scan_blocks.setArg(2, numblocks);
+	queue.enqueueNDRangeKernel(kernel_compact_scan_blocks, cl::NullRange, local, local);
+
+	kernel_compact_scatter.setArg(0, gactive);
+	kernel_compact_scatter.setArg(1, goffset);
+	kernel_compact_scatter.setArg(2, gblock);
+	kernel_compact_scatter.setArg(3, gactivetmp);
+	kernel_compact_scatter.setArg(4, active_count);
+	queue.enqueueNDRangeKernel(kernel_compact_scatter, cl::NullRange, global, local);
+
+	// new active count, the blocking read also waits for the compaction kernels
+	queue.enqueueReadBuffer(gblock, CL_TRUE, numblocks * sizeof(cl_int), sizeof(cl_int), &active_count);
+	std::swap(gactive, gactivetmp);
+	HarvestLaunches(false);
+}
+
+void OpenCLBackend::GetParticles(int NumBodies, Real_t *pos, Real_t *vel )
+{
+	// transfer memory from OpenCL device to CPU, after an odd number of launches the current state is in the *new buffers
+	cl::Buffer& gpos = (launch_counter % 2 == 0) ? gposold : gposnew;
+	cl::Buffer& gvel = (launch_counter % 2 == 0) ? gvelold : gvelnew;
+	ReadReals(gpos, pos, 4*NumBodies);
+	ReadReals(gvel, vel, 4*NumBodies);
+	queue.finish();
+	HarvestLaunches(false);
+}
+
+void OpenCLBackend::PutJacobiReference(int NumBodies, const Real_t *jacobi)
+{
+	if (NumBodies > 0)
+		WriteReals(gjacobiref, jacobi, NumBodies);
+}
+
+JacobiDrift OpenCLBackend::Diagnostics(int NumBodies, Real_t *diag)
+{
+	JacobiDrift drift;
+	if (NumBodies == 0)
+		return drift;
+
+	// of the current state, after an odd number of launches it is in the *new buffers
+	const bool even = (launch_counter % 2 == 0);
+	const int numblocks = static_cast<int>((NumBodies + diag_size - 1) / diag_size);
+	cl::NDRange local(diag_size);
+	kernel_diagnostics.setArg(0, even ? gposold : gposnew);
+	kernel_diagnostics.setArg(1, even ? gvelold : gvelnew);
+	kernel_diagnostics.setArg(6, NumBodies);
+	queue.enqueueNDRangeKernel(kernel_diagnostics, cl::NullRange, cl::NDRange(numblocks * diag_size), local);
+	kernel_diagnostics_reduce.setArg(4, numblocks);
+	queue.enqueueNDRangeKernel(kernel_diagnostics_reduce, cl::NullRange, local, local);
+
+	// the blocking reads also wait for the diagnostics kernels
+	Real_t result[4];
+	ReadReals(gdiagblock, result, 4, 4*numblocks);
+	queue.enqueueReadBuffer(gdiagcount, CL_TRUE, numblocks * sizeof(cl_int), sizeof(cl_int), &drift.count);
+	if (drift.count > 0)
+	{
+		drift.min = result[0];
+		drift.max = result[1];
+		drift.sum = result[2];
+		drift.sum_abs = result[3];
+	}
+	if (diag)
+		ReadReals(gdiag, diag, 4*NumBodies);
+	HarvestLaunches(false);
+	return drift;
+}
+
+Real_t* OpenCLBackend::AllocHostBuffer(size_t count)
+{
+	// pinned host memory, allows DMA transfers that overlap with kernel execution
+	cl::Buffer buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, count * sizeof(Real_t));
+	Real_t* ptr = static_cast<Real_t*>(queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, count * sizeof(Real_t)));
+	host_buffers[ptr] = buffer;
+	return ptr;
+}
+
+void OpenCLBackend::FreeHostBuffer(Real_t *ptr)
+{
+	auto it = host_buffers.find(ptr);
+	if (it == host_buffers.end())
+		return;
+	queue.enqueueUnmapMemObject(it->second, ptr);
+	queue.finish();
+	host_buffers.erase(it);
+}
+
+void CL_CALLBACK OpenCLBackend::TransferComplete(cl_event /*event*/, cl_int status, void *user_data)
+{
+	// a negative status is the error of a failed transfer, done() is called anyway to release the buffers
+	if (status != CL_COMPLETE)
+		std::cerr << "OpenCL particle transfer failed with error " << status << ", the written output is invalid." << std::endl;
+	std::function<void()>* done = static_cast<std::function<void()>*>(user_data);
+	(*done)();
+	delete done;
+}
+
+void OpenCLBackend::GetParticlesAsync(int NumBodies, Real_t *pos, Real_t *vel, std::function<void()> done)
+{
+	// non-blocking transfer, the in-order queue keeps following launches from overwriting the buffers before
+	cl::Buffer& gpos = (launch_counter % 2 == 0) ? gposold : gposnew;
+	cl::Buffer& gvel = (launch_counter % 2 == 0) ? gvelold : gvelnew;
+	cl::Event event;
+	queue.enqueueReadBuffer(gpos, CL_FALSE, 0, 4*NumBodies*real_size, pos);
+	queue.enqueueReadBuffer(gvel, CL_FALSE, 0, 4*NumBodies*real_size, vel, 0, &event);
+	if (real_size != sizeof(Real_t))
+	{
+		// single precision values at the beginning of the host buffers, widened before the output
+		const size_t count = 4*NumBodies;
+		done = [pos, vel, count, done]() { widen_reals<float>(pos, count); widen_reals<float>(vel, count); done(); };
+	}
+	// NOTE: the second read completes last on the in-order queue
+	event.setCallback(CL_COMPLETE, &OpenCLBackend::TransferComplete, new std::function<void()>(std::move(done)));
+	queue.flush();
+}
+
+void OpenCLBackend::PutParticles(int NumBodies, Real_t *pos, Real_t *vel )
+{
+	// particles that did not re-collide are active
+	std::vector<int> active;
+	for (int i = 0; i < NumBodies; ++i)
+		if (vel[i*4+3] == 0.0)
+			active.push_back(i);
+	active_count = static_cast<int>(active.size());
+	const cl_int zero = 0;
+	queue.enqueueWriteBuffer(gimpactcount, CL_TRUE, 0, sizeof(cl_int), &zero);
+	impacts_read = 0;
+	if (NumBodies == 0)
+		return;
+
+	// transfer memory from CPU to OpenCL device, into both buffers of the double buffering scheme,
+	// the inactive particles are not written by the kernels (see CompactParticles())
+	WriteReals(gposold, pos, 4*NumBodies);
+	WriteReals(gvelold, vel, 4*NumBodies);
+	WriteReals(gposnew, pos, 4*NumBodies);
+	WriteReals(gvelnew, vel, 4*NumBodies);
+	if (active_count > 0)
+		queue.enqueueWriteBuffer(gactive, CL_TRUE, 0, active_count * sizeof(int), active.data());
+	queue.finish();
+}
+
+void OpenCLBackend::GetImpacts(std::vector<ImpactEvent>& events)
+{
+	// waits for the launches enqueued so far, the counter keeps counting beyond the capacity
+	cl_int count = 0;
+	queue.enqueueReadBuffer(gimpactcount, CL_TRUE, 0, sizeof(cl_int), &count);
+	count = std::min<cl_int>(count, max_impacts);
+	const int n = count - impacts_read;
+	if (n <= 0)
+		return;
+	std::vector<cl_int4> ids(n);
+	std::vector<Real_t> values(2*4*n);
+	queue.enqueueReadBuffer(gimpactid, CL_TRUE, impacts_read * sizeof(cl_int4), n * sizeof(cl_int4), ids.data());
+	ReadReals(gimpact, values.data(), values.size(), 2*4*static_cast<size_t>(impacts_read));
+	for (int i = 0; i < n; ++i)
+	{
+		ImpactEvent event;
+		event.particle = ids[i].s[0];
+		event.face = ids[i].s[1];
+		event.step = ids[i].s[2];
+		event.time = values[i*8+3];
+		for (int k = 0; k < 3; ++k)
+		{
+			event.pos[k] = values[i*8+k];
+			event.vel[k] = values[i*8+4+k];
+		}
+		events.push_back(event);
+	}
+	impacts_read = count;
+}
+
+void OpenCLBackend::SetRealArg(cl::Kernel& kernel, int index, double value)
+{
+	if (real_size == sizeof(cl_float))
+		kernel.setArg(index, static_cast<cl_float>(value));
+	else
+		kernel.setArg(index, static_cast<cl_double>(value));
+}
+
+void OpenCLBackend::WriteReals(cl::Buffer& buffer, const Real_t* data, size_t count)
+{
+	if (real_size == sizeof(Real_t))
+	{
+		queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, count * sizeof(Real_t), data);
+		return;
+	}
+	const std::vector<float> values = device_reals<float>(data, count);
+	queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, count * sizeof(float), values.data());
+}
+
+void OpenCLBackend::ReadReals(cl::Buffer& buffer, Real_t* data, size_t count, size_t offset)
+{
+	queue.enqueueReadBuffer(buffer, CL_TRUE, offset * real_size, count * real_size, data);
+	if (real_size != sizeof(Real_t))
+		widen_reals<float>(data, count);
+}
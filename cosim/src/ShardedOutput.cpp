@@ -0,0 +1,296 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "ShardedOutput.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include <dirent.h> // opendir()
+#include <fcntl.h> // open()
+#include <sys/stat.h> // mkdir(), stat()
+#include <unistd.h> // close(), rmdir()
+
+#include "ImpactFormat.h"
+#include "SnapshotFormat.h"
+#include "SnapshotReader.h"
+
+namespace {
+
+std::string ShardDirectory(const std::string& directory)
+{
+	return directory + "/shards";
+}
+
+std::string ShardPath(const std::string& directory, const std::string& name, int rank)
+{
+	char suffix[16];
+	sprintf(suffix, ".%04d", rank);
+	return ShardDirectory(directory) + "/" + name + suffix;
+}
+
+std::string MarkerPath(const std::string& directory, int rank)
+{
+	char marker[32];
+	sprintf(marker, "/rank%04d.done", rank);
+	return ShardDirectory(directory) + marker;
+}
+
+bool Exists(const std::string& path)
+{
+	struct stat info;
+	return stat(path.c_str(), &info) == 0;
+}
+
+// marker: number of ranks in the first line, then one written file per line
+bool ReadMarker(const std::string& path, int& rank_count, std::vector<std::string>& names)
+{
+	std::ifstream file(path);
+	if (!(file >> rank_count))
+		return false;
+	names.clear();
+	std::string name;
+	while (file >> name)
+		names.push_back(name);
+	return true;
+}
+
+// text shards are concatenated, comment lines only from the first one
+bool MergeText(const std::vector<std::string>& shards, FILE *fd)
+{
+	for (size_t s = 0; s < shards.size(); ++s)
+	{
+		std::ifstream shard(shards[s]);
+		if (!shard)
+		{
+			std::cerr << "Could not read '" << shards[s] << "'." << std::endl;
+			return false;
+		}
+		std::string line;
+		while (std::getline(shard, line))
+		{
+			if (s > 0 && !line.empty() && line[0] == '#')
+				continue;
+			fputs(line.c_str(), fd);
+			fputc('\n', fd);
+		}
+	}
+	return true;
+}
+
+// binary shards (see SnapshotFormat.h) are merged column by column
+bool MergeBinary(const std::vector<std::string>& shards, FILE *fd)
+{
+	std::vector<SnapshotReader*> readers;
+	bool ok = true;
+	int64_t particle_count = 0;
+	for (const std::string& shard : shards)
+	{
+		readers.push_back(new SnapshotReader(shard));
+		const SnapshotReader& reader = *readers.back();
+		if (!reader.isValid() || reader.getHeader().fields != readers.front()->getHeader().fields
+			|| reader.getHeader().precision != readers.front()->getHeader().precision || reader.getStep() != readers.front()->getStep())
+		{
+			std::cerr << "Invalid or mismatching snapshot shard '" << shard << "'." << std::endl;
+			ok = false;
+			break;
+		}
+		particle_count += reader.getParticleCount();
+	}
+
+	if (ok)
+	{
+		snapshot::Header header = readers.front()->getHeader();
+		header.header_size = sizeof(snapshot::Header);
+		header.particle_count = particle_count;
+		ok = fwrite(&header, sizeof(header), 1, fd) == 1;
+		for (int c = 0; c < snapshot::COLUMN_COUNT && ok; ++c)
+		{
+			const snapshot::Column column = static_cast<snapshot::Column>(c);
+			const size_t value_size = (column == snapshot::FLAG) ? 1 : header.precision;
+			for (const SnapshotReader* reader : readers)
+			{
+				const void* data = reader->getColumn(column);
+				const size_t count = reader->getParticleCount();
+				if (data && count > 0)
+					ok = ok && fwrite(data, value_size, count, fd) == count;
+			}
+		}
+	}
+
+	for (SnapshotReader* reader : readers)
+		delete reader;
+	return ok;
+}
+
+// impact logs (see ImpactFormat.h): the header of the first shard, then the records of all shards
+bool MergeImpacts(const std::vector<std::string>& shards, FILE *fd)
+{
+	for (size_t s = 0; s < shards.size(); ++s)
+	{
+		std::ifstream shard(shards[s], std::ios::binary);
+		impact::Header header;
+		if (!shard.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, impact::MAGIC, sizeof(impact::MAGIC)) != 0)
+		{
+			std::cerr << "Invalid impact log shard '" << shards[s] << "'." << std::endl;
+			return false;
+		}
+		shard.seekg(header.header_size);
+		if (s == 0)
+		{
+			header.header_size = sizeof(impact::Header);
+			if (fwrite(&header, sizeof(header), 1, fd) != 1)
+				return false;
+		}
+		std::vector<char> records((std::istreambuf_iterator<char>(shard)), std::istreambuf_iterator<char>());
+		if (!records.empty() && fwrite(records.data(), 1, records.size(), fd) != records.size())
+			return false;
+	}
+	return true;
+}
+
+} // namespace
+
+void ShardedOutput::Initialize(const std::string& directory, int rank, int rank_count)
+{
+	this->directory = directory;
+	this->rank = rank;
+	this->rank_count = rank_count;
+	names.clear();
+	if (isSharded() && mkdir(ShardDirectory(directory).c_str(), 0755) == -1 && errno != EEXIST)
+	{
+		std::cout << "Could not create directory '" << ShardDirectory(directory) << "', exiting." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// the marker of an interrupted run would let the other ranks merge while this one rewrites its shards
+	if (isSharded())
+	{
+		remove(MarkerPath(directory, rank).c_str());
+		remove((MarkerPath(directory, rank) + ".tmp").c_str());
+		remove((ShardDirectory(directory) + "/merge.lock").c_str());
+	}
+
+	// shards of this rank written before a restart
+	char suffix[16];
+	sprintf(suffix, ".%04d", rank);
+	const size_t suffix_length = strlen(suffix);
+	if (DIR* shards = isSharded() ? opendir(ShardDirectory(directory).c_str()) : nullptr)
+	{
+		while (const dirent* entry = readdir(shards))
+		{
+			const std::string shard = entry->d_name;
+			if (shard.size() > suffix_length && shard.compare(shard.size() - suffix_length, suffix_length, suffix) == 0)
+				names.insert(shard.substr(0, shard.size() - suffix_length));
+		}
+		closedir(shards);
+	}
+}
+
+std::string ShardedOutput::Path(const std::string& name)
+{
+	if (!isSharded())
+		return directory + "/" + name;
+	names.insert(name);
+	return ShardPath(directory, name, rank);
+}
+
+void ShardedOutput::Finish()
+{
+	if (!isSharded())
+		return;
+
+	// written to a temporary file first, the other ranks never read a partial marker
+	const std::string marker = MarkerPath(directory, rank);
+	const std::string tmp_file = marker + ".tmp";
+	{
+		std::ofstream file(tmp_file);
+		file << rank_count << std::endl;
+		for (const std::string& name : names)
+			file << name << std::endl;
+	}
+	if (rename(tmp_file.c_str(), marker.c_str()) != 0)
+	{
+		std::cerr << "Could not write '" << marker << "'." << std::endl;
+		return;
+	}
+
+	// the marker is written before checking the others, so at least the last rank sees all of them
+	for (int r = 0; r < rank_count; ++r)
+	{
+		if (!Exists(MarkerPath(directory, r)))
+		{
+			std::cout << "Output of rank " << rank << " complete, the last rank merges the output." << std::endl;
+			return;
+		}
+	}
+	const int lock = open((ShardDirectory(directory) + "/merge.lock").c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (lock == -1)
+		return; // another rank merges
+	close(lock);
+	Merge(directory);
+}
+
+bool ShardedOutput::Merge(const std::string& directory)
+{
+	int rank_count = 0;
+	std::vector<std::string> names;
+	if (!ReadMarker(MarkerPath(directory, 0), rank_count, names))
+	{
+		std::cerr << "No complete output of rank 0 in '" << ShardDirectory(directory) << "'." << std::endl;
+		return false;
+	}
+	for (int r = 1; r < rank_count; ++r)
+	{
+		int count = 0;
+		std::vector<std::string> rank_names;
+		if (!ReadMarker(MarkerPath(directory, r), count, rank_names) || count != rank_count || rank_names != names)
+		{
+			std::cerr << "No complete output of rank " << r << " in '" << ShardDirectory(directory) << "'." << std::endl;
+			return false;
+		}
+	}
+
+	for (const std::string& name : names)
+	{
+		std::vector<std::string> shards;
+		for (int r = 0; r < rank_count; ++r)
+			shards.push_back(ShardPath(directory, name, r));
+
+		// written to a temporary file first, readers never see a partial snapshot
+		const std::string filename = directory + "/" + name;
+		const std::string tmp_file = filename + ".tmp";
+		FILE *fd = fopen(tmp_file.c_str(), "wb");
+		if (!fd)
+		{
+			std::cerr << "Could not write '" << filename << "'." << std::endl;
+			return false;
+		}
+		const bool binary = name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0;
+		bool ok = (name == "impacts.bin") ? MergeImpacts(shards, fd) : binary ? MergeBinary(shards, fd) : MergeText(shards, fd);
+		ok = (fclose(fd) == 0) && ok;
+		if (!ok || rename(tmp_file.c_str(), filename.c_str()) != 0)
+		{
+			std::cerr << "Could not merge '" << filename << "', keeping the shards." << std::endl;
+			remove(tmp_file.c_str());
+			return false;
+		}
+	}
+
+	for (int r = 0; r < rank_count; ++r)
+	{
+		for (const std::string& name : names)
+			remove(ShardPath(directory, name, r).c_str());
+		remove(MarkerPath(directory, r).c_str());
+	}
+	remove((ShardDirectory(directory) + "/merge.lock").c_str());
+	rmdir(ShardDirectory(directory).c_str());
+	std::cout << "Merged " << names.size() << " output files of " << rank_count << " ranks in '" << directory << "'." << std::endl;
+	return true;
+}
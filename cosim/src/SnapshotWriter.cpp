@@ -0,0 +1,337 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "SnapshotWriter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "ImpactFormat.h"
+#include "SnapshotFormat.h"
+
+SnapshotWriter::SnapshotWriter(ComputeBackend& backend, int particle_count, int depth, bool binary)
+	: backend(backend), particle_count(particle_count), binary(binary), slots(depth)
+{
+	for (auto& slot : slots)
+	{
+		slot.pos = backend.AllocHostBuffer(4 * static_cast<size_t>(particle_count));
+		slot.vel = backend.AllocHostBuffer(4 * static_cast<size_t>(particle_count));
+		free_slots.push_back(&slot);
+	}
+	writer = std::thread(&SnapshotWriter::WriterLoop, this);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	Finish();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shutdown = true;
+	}
+	cv.notify_all();
+	writer.join();
+
+	for (auto& slot : slots)
+	{
+		backend.FreeHostBuffer(slot.pos);
+		backend.FreeHostBuffer(slot.vel);
+	}
+}
+
+SnapshotWriter::Slot* SnapshotWriter::Acquire()
+{
+	// back-pressure: wait until the writer thread releases a slot
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [&] { return !free_slots.empty(); });
+	Slot* slot = free_slots.front();
+	free_slots.pop_front();
+	return slot;
+}
+
+void SnapshotWriter::Write(const std::string& filename, int step, double time)
+{
+	Slot* slot = Acquire();
+	slot->filename = filename;
+	slot->step = step;
+	slot->time = time;
+	slot->kind = Slot::SNAPSHOT;
+	Request(slot);
+}
+
+void SnapshotWriter::WriteCheckpoint(const std::string& filename, const checkpoint::Header& header)
+{
+	Slot* slot = Acquire();
+	slot->filename = filename;
+	slot->step = header.step;
+	slot->kind = Slot::CHECKPOINT;
+	slot->checkpoint = header;
+	Request(slot);
+}
+
+void SnapshotWriter::WriteImpacts(std::vector<ImpactEvent>& events)
+{
+	// no transfer, the slot keeps its buffers
+	Slot* slot = Acquire();
+	slot->kind = Slot::IMPACTS;
+	slot->impacts.swap(events);
+	events.clear();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slot->transferred = true;
+		pending_slots.push_back(slot);
+	}
+	cv.notify_all();
+}
+
+void SnapshotWriter::Request(Slot* slot)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slot->transferred = false;
+		pending_slots.push_back(slot);
+	}
+
+	backend.GetParticlesAsync(particle_count, slot->pos, slot->vel, [this, slot] {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slot->transferred = true;
+		}
+		cv.notify_all();
+	});
+}
+
+void SnapshotWriter::LogEscapes(const std::string& filename, int first, const Real_t* vel, int restart_step)
+{
+	WaitPending();
+	if (escape_log)
+		fclose(escape_log);
+
+	// escapes up to the restart step, the state of the checkpoint has them already
+	std::string kept;
+	if (restart_step >= 0)
+	{
+		std::ifstream log(filename);
+		std::string line;
+		while (std::getline(log, line))
+		{
+			std::istringstream fields(line);
+			int particle, step;
+			if (fields >> particle >> step && step <= restart_step)
+				kept += line + "\n";
+		}
+	}
+	escape_log = fopen(filename.c_str(), "w");
+	if (!escape_log)
+	{
+		std::cerr << "Could not write '" << filename << "'." << std::endl;
+		return;
+	}
+	fputs(kept.c_str(), escape_log);
+	escape_first = first;
+	escaped.resize(particle_count);
+	for (int i = 0; i < particle_count; ++i)
+		escaped[i] = (vel[i*4+3] == 2.0) ? 1 : 0;
+}
+
+void SnapshotWriter::LogImpacts(const std::string& filename, int first, double delta_t, int restart_step)
+{
+	WaitPending();
+	if (impact_log)
+		fclose(impact_log);
+
+	// impacts before the restart step, the state of the checkpoint has them already
+	std::vector<impact::Record> kept;
+	if (restart_step >= 0)
+	{
+		std::ifstream log(filename, std::ios::binary);
+		impact::Header header;
+		if (log.read(reinterpret_cast<char*>(&header), sizeof(header)) && std::memcmp(header.magic, impact::MAGIC, sizeof(impact::MAGIC)) == 0
+			&& header.record_size == sizeof(impact::Record))
+		{
+			log.seekg(header.header_size);
+			impact::Record record;
+			while (log.read(reinterpret_cast<char*>(&record), sizeof(record)))
+				if (record.step < restart_step)
+					kept.push_back(record);
+		}
+	}
+
+	impact_log = fopen(filename.c_str(), "wb");
+	if (!impact_log)
+	{
+		std::cerr << "Could not write '" << filename << "'." << std::endl;
+		return;
+	}
+	impact_first = first;
+	impact_delta_t = delta_t;
+
+	impact::Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, impact::MAGIC, sizeof(impact::MAGIC));
+	header.version = impact::VERSION;
+	header.byte_order = impact::BYTE_ORDER_MARK;
+	header.header_size = sizeof(impact::Header);
+	header.record_size = sizeof(impact::Record);
+	header.delta_t = delta_t;
+	fwrite(&header, sizeof(header), 1, impact_log);
+	if (!kept.empty())
+		fwrite(kept.data(), sizeof(impact::Record), kept.size(), impact_log);
+}
+
+void SnapshotWriter::WaitPending()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [&] { return pending_slots.empty(); });
+}
+
+void SnapshotWriter::Finish()
+{
+	WaitPending();
+	if (escape_log)
+	{
+		fclose(escape_log);
+		escape_log = nullptr;
+	}
+	if (impact_log)
+	{
+		fclose(impact_log);
+		impact_log = nullptr;
+	}
+}
+
+void SnapshotWriter::WriterLoop()
+{
+	while (true)
+	{
+		Slot* slot;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&] { return shutdown || (!pending_slots.empty() && pending_slots.front()->transferred); });
+			if (shutdown)
+				return;
+			slot = pending_slots.front();
+		}
+
+		if (slot->kind == Slot::CHECKPOINT)
+		{
+			// a restart takes every escape in the checkpoint as logged
+			if (escape_log)
+				WriteEscapes(*slot);
+			checkpoint::Write(slot->filename, slot->checkpoint, slot->pos, slot->vel);
+		}
+		else if (slot->kind == Slot::IMPACTS)
+			WriteImpacts(*slot);
+		else
+		{
+			if (binary)
+				WriteBinary(*slot);
+			else
+				WriteText(*slot);
+			if (escape_log)
+				WriteEscapes(*slot);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending_slots.pop_front();
+			free_slots.push_back(slot);
+		}
+		cv.notify_all();
+	}
+}
+
+void SnapshotWriter::WriteText(const Slot& slot)
+{
+	FILE *fd = fopen(slot.filename.c_str(), "w");
+	if (!fd)
+	{
+		std::cerr << "Could not write '" << slot.filename << "'." << std::endl;
+		return;
+	}
+	for(int i = 0; i < particle_count; ++i)
+	{
+		fprintf(fd,"%f %f %f %f"   , slot.pos[i*4+0], slot.pos[i*4+1], slot.pos[i*4+2], slot.pos[i*4+3]);
+		fprintf(fd," %f %f %f %f\n", slot.vel[i*4+0], slot.vel[i*4+1], slot.vel[i*4+2], slot.vel[i*4+3]);
+	}
+	fclose(fd);
+}
+
+void SnapshotWriter::WriteBinary(const Slot& slot)
+{
+	FILE *fd = fopen(slot.filename.c_str(), "wb");
+	if (!fd)
+	{
+		std::cerr << "Could not write '" << slot.filename << "'." << std::endl;
+		return;
+	}
+
+	snapshot::Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, snapshot::MAGIC, sizeof(snapshot::MAGIC));
+	header.version = snapshot::VERSION;
+	header.byte_order = snapshot::BYTE_ORDER_MARK;
+	header.header_size = sizeof(snapshot::Header);
+	header.fields = snapshot::FIELD_POSITION | snapshot::FIELD_VELOCITY | snapshot::FIELD_FLAGS;
+	header.precision = sizeof(Real_t);
+	header.step = slot.step;
+	header.time = slot.time;
+	header.particle_count = particle_count;
+	fwrite(&header, sizeof(header), 1, fd);
+
+	// transpose the 4 values per particle into columns
+	std::vector<Real_t> column(particle_count);
+	const Real_t* state[2] = { slot.pos, slot.vel };
+	for (int s = 0; s < 2; ++s)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			for (int i = 0; i < particle_count; ++i)
+				column[i] = state[s][i*4+k];
+			fwrite(column.data(), sizeof(Real_t), particle_count, fd);
+		}
+	}
+	std::vector<uint8_t> flags(particle_count);
+	for (int i = 0; i < particle_count; ++i)
+		flags[i] = static_cast<uint8_t>(slot.vel[i*4+3]);
+	fwrite(flags.data(), 1, particle_count, fd);
+	fclose(fd);
+}
+
+void SnapshotWriter::WriteEscapes(const Slot& slot)
+{
+	// particle, escape step (in the 4th position value), position and velocity
+	for (int i = 0; i < particle_count; ++i)
+	{
+		if (slot.vel[i*4+3] != 2.0 || escaped[i])
+			continue;
+		escaped[i] = 1;
+		fprintf(escape_log, "%d %d %f %f %f %f %f %f\n", escape_first + i, static_cast<int>(slot.pos[i*4+3]),
+		        slot.pos[i*4+0], slot.pos[i*4+1], slot.pos[i*4+2], slot.vel[i*4+0], slot.vel[i*4+1], slot.vel[i*4+2]);
+	}
+	fflush(escape_log);
+}
+
+void SnapshotWriter::WriteImpacts(const Slot& slot)
+{
+	if (!impact_log)
+		return;
+	for (const ImpactEvent& event : slot.impacts)
+	{
+		impact::Record record;
+		record.particle = impact_first + event.particle;
+		record.face = event.face;
+		record.step = event.step;
+		record.time = event.step * impact_delta_t + event.time;
+		for (int k = 0; k < 3; ++k)
+		{
+			record.position[k] = event.pos[k];
+			record.velocity[k] = event.vel[k];
+		}
+		fwrite(&record, sizeof(record), 1, impact_log);
+	}
+	fflush(impact_log);
+}
@@ -5,23 +5,125 @@
 
 #include <iostream>
 #include <string>
+#include <cstdlib>
+#include <utility>
+#include <vector>
 #include "ComputeConfig.h"
 #include "BodyParticleSystem.h"
+#include "BodyMesh.h"
 #include "ConfigParser.h"
+#include "ShardedOutput.h"
+#ifdef COSIM_WITH_OPENCL
+#include "OpenCLBackend.h"
+#endif
 
 int main( int argc, char **argv )
 {
 	std::string configFilename = "config.cfg";
+	bool buildMeshCache = false;
+	bool buildProgramCache = false;
+	bool merge = false;
+	int rank = 0;
+	int rankCount = 0; // 0: not given
+	std::string restart;
+	std::string sweep; // sweep file, empty: single simulation
 
-	if (argc >= 2)
+	int arg = 1;
+	while (argc > arg && std::string(argv[arg]).compare(0, 2, "--") == 0)
 	{
-		configFilename = argv[1];
+		const std::string option = argv[arg++];
+		if (option == "--build-mesh-cache")
+			buildMeshCache = true;
+		else if (option == "--build-program-cache")
+			buildProgramCache = true;
+		else if (option == "--merge")
+			merge = true;
+		else if (option == "--rank" && argc > arg)
+			rank = atoi(argv[arg++]);
+		else if (option == "--ranks" && argc > arg)
+			rankCount = atoi(argv[arg++]);
+		else if (option == "--restart" && argc > arg)
+			restart = argv[arg++];
+		else if (option == "--sweep" && argc > arg)
+			sweep = argv[arg++];
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--build-mesh-cache | --build-program-cache | --merge] [--restart <checkpoint> | --sweep <sweep file>] [--rank <r> --ranks <n>] [config.cfg]" << std::endl;
+			return 1;
+		}
+	}
+	if (argc > arg)
+	{
+		configFilename = argv[arg];
 	}
 	ConfigParser cfgParser(configFilename);
+	if (!cfgParser.isValid())
+	{
+		std::cerr << "Config file '" << configFilename << "' not found, exiting." << std::endl;
+		return 1;
+	}
+
+	// merge the shards of a distributed run whose last rank did not finish
+	if (merge)
+		return ShardedOutput::Merge(configFilename.substr(0, configFilename.find_last_of('.'))) ? 0 : 1;
+
 	ComputeConfig config(cfgParser);
 
+	// without --ranks, the rank is taken from an MPI launcher (Open MPI, MPICH and derived)
+	const char* launcherVariables[][2] = { { "OMPI_COMM_WORLD_RANK", "OMPI_COMM_WORLD_SIZE" }, { "PMI_RANK", "PMI_SIZE" } };
+	for (const auto& variables : launcherVariables)
+	{
+		if (rankCount == 0 && getenv(variables[0]) && getenv(variables[1]))
+		{
+			rank = atoi(getenv(variables[0]));
+			rankCount = atoi(getenv(variables[1]));
+		}
+	}
+	if (rankCount == 0)
+		rankCount = 1;
+	if (rank < 0 || rank >= rankCount)
+	{
+		std::cerr << "Invalid rank " << rank << " of " << rankCount << " ranks, exiting." << std::endl;
+		return 1;
+	}
+	config.rank = rank;
+	config.rank_count = rankCount;
+	config.restart = restart;
+
+	if (buildMeshCache)
+	{
+		BodyMesh mesh;
+		mesh.BuildCache(config);
+		return 0;
+	}
+
+	if (buildProgramCache)
+	{
+#ifdef COSIM_WITH_OPENCL
+		// the programs do not depend on the mesh
+		BodyMesh mesh;
+		BodyMultipole multipole;
+		GravityGrid grid;
+		std::vector<std::pair<int, int>> devices = config.opencl_device_list;
+		if (devices.empty())
+			devices.push_back(std::make_pair(config.opencl_platform_id, config.opencl_device_id));
+		for (const auto& device : devices)
+		{
+			OpenCLBackend backend(config, mesh, multipole, grid, device.first, device.second);
+			backend.BuildProgramCache();
+		}
+		return 0;
+#else
+		std::cerr << "OpenCL is not available in this build, exiting." << std::endl;
+		return 1;
+#endif
+	}
+
 	BodyParticleSystem cometDust(config);
-	cometDust.RunSimulation();
+	if (sweep.empty())
+		cometDust.RunSimulation();
+	else
+		cometDust.RunSweep(sweep);
 
 	return 0;
 }
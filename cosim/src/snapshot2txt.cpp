@@ -0,0 +1,48 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+// converts binary snapshot files (OUTPUT_FORMAT=binary) into the text format
+// (OUTPUT_FORMAT=text), e.g. for tools/pre-process.sh
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "SnapshotReader.h"
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		std::cout << "Usage: " << argv[0] << " <pNNNNNN.bin>... (writes pNNNNNN.dat next to each file)" << std::endl;
+		return 1;
+	}
+
+	for (int a = 1; a < argc; ++a)
+	{
+		SnapshotReader reader(argv[a]);
+		if (!reader.isValid() || !reader.hasField(snapshot::FIELD_POSITION) || !reader.hasField(snapshot::FIELD_VELOCITY))
+		{
+			std::cerr << "Skipping " << argv[a] << std::endl;
+			continue;
+		}
+
+		std::string filename = argv[a];
+		filename = filename.substr(0, filename.find_last_of('.')) + ".dat";
+		FILE *fd = fopen(filename.c_str(), "w");
+		if (!fd)
+		{
+			std::cerr << "Could not write '" << filename << "'." << std::endl;
+			return 1;
+		}
+		const uint8_t* flags = reader.getFlags();
+		for (int64_t i = 0; i < reader.getParticleCount(); ++i)
+		{
+			fprintf(fd,"%f %f %f %f"   , reader.getValue(snapshot::POS_X, i), reader.getValue(snapshot::POS_Y, i), reader.getValue(snapshot::POS_Z, i), 0.0);
+			fprintf(fd," %f %f %f %f\n", reader.getValue(snapshot::VEL_X, i), reader.getValue(snapshot::VEL_Y, i), reader.getValue(snapshot::VEL_Z, i), flags ? static_cast<double>(flags[i]) : 0.0);
+		}
+		fclose(fd);
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+// Parses a fixture config with ConfigParser and checks the values, returns
+// non-zero if a check fails.
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "ConfigParser.h"
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string& what)
+{
+	if (!condition)
+	{
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+template<typename F>
+void checkThrows(F f, const std::string& what)
+{
+	try
+	{
+		f();
+		check(false, what + " throws ConfigParser::Error");
+	}
+	catch (const ConfigParser::Error&)
+	{
+	}
+}
+
+// CRLF line endings, whitespace, comments and a repeated key
+const char* fixture =
+	"# leading comment\r\n"
+	"  STEP_COUNT =  100  \r\n"
+	"\tDELTA_T=\t20.5\r\n"
+	"NAME = comet # inline comment\r\n"
+	"URL=http://host/#anchor\r\n"
+	"STEP_COUNT=200\r\n"
+	"   # indented comment = ignored\r\n"
+	"no equals sign\r\n"
+	" = no key\r\n"
+	"EMPTY=\r\n"
+	"BAD_INT=12abc\r\n"
+	"LAST=1"; // no line ending at the end of the file
+
+void checkFixture(const ConfigParser& config)
+{
+	check(config.isValid(), "fixture is valid");
+	check(config.getIntKeyValue("STEP_COUNT") == 100, "trimmed int, first value wins");
+	check(config.getDoubleKeyValue("DELTA_T") == 20.5, "tab trimmed double");
+	check(config.getFloatKeyValue("DELTA_T") == 20.5f, "tab trimmed float");
+	check(config.getStringKeyValue("NAME") == "comet", "inline comment stripped");
+	check(config.getStringKeyValue("URL") == "http://host/#anchor", "'#' within a value kept");
+	check(config.getStringKeyValue("EMPTY").empty(), "empty value");
+	check(config.getIntKeyValue("LAST") == 1, "last line without line ending");
+	check(!config.hasKey("# indented comment"), "indented comment ignored");
+	check(!config.hasKey(""), "line without key ignored");
+	check(config.getKeys().size() == 7, "number of keys");
+	check(config.getIntKeyValueOr("MISSING", 42) == 42, "default for a missing key");
+	check(config.getStringKeyValueOr("NAME", "default") == "comet", "no default for an existing key");
+
+	checkThrows([&] { config.getStringKeyValue("MISSING"); }, "missing key");
+	checkThrows([&] { config.getIntKeyValue("BAD_INT"); }, "trailing garbage");
+	checkThrows([&] { config.getIntKeyValue("NAME"); }, "non-numeric value");
+	checkThrows([&] { config.getIntKeyValueOr("BAD_INT", 0); }, "bad value with default");
+}
+
+} // namespace
+
+int main()
+{
+	ConfigParser fromString = ConfigParser::fromString(fixture, "fixture");
+	check(fromString.getFilename() == "fixture", "fromString() name");
+	checkFixture(fromString);
+
+	// the same fixture through a file, binary to keep the CRs
+	const std::string filename = "ConfigParserTest.cfg";
+	{
+		std::ofstream file(filename, std::ios::binary);
+		file << fixture;
+	}
+	ConfigParser fromFile(filename);
+	check(fromFile.getFilename() == filename, "file name");
+	checkFixture(fromFile);
+	check(ConfigParser::isFileValid(filename), "static isFileValid()");
+	check(ConfigParser::getIntKeyValue(filename, "STEP_COUNT") == 100, "static getIntKeyValue()");
+	std::remove(filename.c_str());
+
+	ConfigParser missing("ConfigParserTest.missing.cfg");
+	check(!missing.isValid(), "missing file is invalid");
+	checkThrows([&] { missing.getStringKeyValue("STEP_COUNT"); }, "key of a missing file");
+	checkThrows([&] { ConfigParser::getIntKeyValue("ConfigParserTest.missing.cfg", "STEP_COUNT"); }, "static key of a missing file");
+
+	if (failures)
+		std::cerr << failures << " check(s) failed." << std::endl;
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+# Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+#
+# See accompanying file LICENSE and README for further information.
+
+# Checks the vectoriser report of the CPU backend (-fopt-info-vec-optimized):
+# every loop following an omp simd pragma in SOURCE has to be vectorised,
+# otherwise the backend silently runs scalar code, e.g. if a math function
+# has no vector variant.
+#
+# cmake -DSOURCE=<CpuBackend.cpp> -DREPORT=<report> -P CpuVectorisation.cmake
+
+if (NOT EXISTS ${REPORT})
+	message(FATAL_ERROR "vectoriser report ${REPORT} not found, rebuild cosim")
+endif()
+file(READ ${REPORT} REPORT_TEXT)
+file(STRINGS ${SOURCE} LINES)
+get_filename_component(NAME ${SOURCE} NAME)
+
+# line numbers of the vectorised loops, GCC reports a line within the loop body
+string(REGEX MATCHALL "${NAME}:[0-9]+:[0-9]+: optimized: loop vectorized" VECTORISED "${REPORT_TEXT}")
+set(VECTORISED_LINES)
+foreach(ENTRY IN LISTS VECTORISED)
+	string(REGEX REPLACE "^${NAME}:([0-9]+):.*" "\\1" VECTORISED_LINE "${ENTRY}")
+	list(APPEND VECTORISED_LINES ${VECTORISED_LINE})
+endforeach()
+
+# each loop after an omp simd pragma ends with the closing brace at the indentation of its for
+set(LINE_NUMBER 0)
+set(LOOP_COUNT 0)
+set(FAILED_COUNT 0)
+set(NEXT_IS_LOOP FALSE)
+set(LOOP_START 0)
+foreach(LINE IN LISTS LINES)
+	math(EXPR LINE_NUMBER "${LINE_NUMBER} + 1")
+	if (NEXT_IS_LOOP)
+		set(NEXT_IS_LOOP FALSE)
+		set(LOOP_START ${LINE_NUMBER})
+		string(REGEX MATCH "^[ \t]*" LOOP_INDENT "${LINE}")
+	elseif (LOOP_START AND LINE STREQUAL "${LOOP_INDENT}}")
+		math(EXPR LOOP_COUNT "${LOOP_COUNT} + 1")
+		set(FOUND FALSE)
+		foreach(VECTORISED_LINE IN LISTS VECTORISED_LINES)
+			if (NOT VECTORISED_LINE LESS LOOP_START AND NOT VECTORISED_LINE GREATER LINE_NUMBER)
+				set(FOUND TRUE)
+			endif()
+		endforeach()
+		if (NOT FOUND)
+			message("loop ${NAME}:${LOOP_START} is not vectorised")
+			math(EXPR FAILED_COUNT "${FAILED_COUNT} + 1")
+		endif()
+		set(LOOP_START 0)
+	endif()
+	if (LINE MATCHES "^[ \t]*#pragma omp simd")
+		set(NEXT_IS_LOOP TRUE)
+	endif()
+endforeach()
+
+if (LOOP_COUNT EQUAL 0)
+	message(FATAL_ERROR "no omp simd loops found in ${SOURCE}")
+endif()
+if (FAILED_COUNT GREATER 0)
+	message(FATAL_ERROR "${FAILED_COUNT} of ${LOOP_COUNT} omp simd loops not vectorised")
+endif()
+message(STATUS "${LOOP_COUNT} omp simd loops vectorised")
@@ -0,0 +1,52 @@
+# Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+#
+# See accompanying file LICENSE and README for further information.
+
+# Runs the same simulation with OUTPUT_FORMAT=text and OUTPUT_FORMAT=binary,
+# converts the binary snapshots with snapshot2txt and compares them to the text
+# snapshots, which have to match exactly.
+#
+# cmake -DCOSIM=<cosim> -DSNAPSHOT2TXT=<snapshot2txt> -DOBJ_FILE=<obj> -DWORK_DIR=<dir> -P SnapshotRoundTrip.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# no ESCAPE_CRITERION, the 4th position value (escape step) is not stored in the binary format
+set(CONFIG "STEP_COUNT=20
+OUTPUT_STEP_COUNT=10
+COMET_OBJ_FILE=${OBJ_FILE}
+COMET_DENSITY=517.057
+COMET_ANGULAR_FREQUENCY=0.0001454441043328607980
+PARTICLE_COUNT=32
+PARTICLE_INITIAL_VELOCITY=0.5
+PARTICLE_INITIAL_HEIGHT=1.0
+DELTA_T=20.0
+BACKEND=cpu
+MESH_CACHE=off
+")
+
+foreach(FORMAT text binary)
+	file(WRITE ${WORK_DIR}/${FORMAT}.cfg "${CONFIG}OUTPUT_FORMAT=${FORMAT}\n")
+	execute_process(COMMAND ${COSIM} ${FORMAT}.cfg WORKING_DIRECTORY ${WORK_DIR} RESULT_VARIABLE RESULT OUTPUT_QUIET)
+	if (NOT RESULT EQUAL 0)
+		message(FATAL_ERROR "cosim with OUTPUT_FORMAT=${FORMAT} failed: ${RESULT}")
+	endif()
+endforeach()
+
+file(GLOB SNAPSHOTS RELATIVE ${WORK_DIR}/binary ${WORK_DIR}/binary/p*.bin)
+list(LENGTH SNAPSHOTS SNAPSHOT_COUNT)
+if (NOT SNAPSHOT_COUNT EQUAL 3)
+	message(FATAL_ERROR "expected 3 binary snapshots, found ${SNAPSHOT_COUNT}")
+endif()
+
+foreach(SNAPSHOT ${SNAPSHOTS})
+	execute_process(COMMAND ${SNAPSHOT2TXT} ${SNAPSHOT} WORKING_DIRECTORY ${WORK_DIR}/binary RESULT_VARIABLE RESULT)
+	if (NOT RESULT EQUAL 0)
+		message(FATAL_ERROR "snapshot2txt ${SNAPSHOT} failed: ${RESULT}")
+	endif()
+	string(REPLACE ".bin" ".dat" TEXT ${SNAPSHOT})
+	execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/binary/${TEXT} ${WORK_DIR}/text/${TEXT} RESULT_VARIABLE RESULT)
+	if (NOT RESULT EQUAL 0)
+		message(FATAL_ERROR "${SNAPSHOT} does not read back to ${TEXT}")
+	endif()
+endforeach()
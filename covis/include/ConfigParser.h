@@ -3,29 +3,57 @@
 // See accompanying file LICENSE and README for further information.
 
 // This file provides an class for parsing a simple config file with one entry
-// entry of the form KEY=VALUE per line. A comment lines are allowed and 
+// entry of the form KEY=VALUE per line. A comment lines are allowed and
 // starts with '#'.
+//
+// The input is parsed once on construction into a hash map. Whitespace around
+// keys and values is ignored, as are comments starting with '#' at the
+// beginning of a line or after whitespace. If a key occurs more than once,
+// the first value is used. Config files, streams and strings can be parsed.
+//
+// The get*KeyValueOr() accessors return a default value for a missing key, the
+// get*KeyValue() accessors throw ConfigParser::Error. All accessors throw it if
+// a value cannot be converted.
 
 #ifndef ConfigParser_h
 #define ConfigParser_h
 
+#include <istream>
+#include <stdexcept>
 #include <string>
-#include <fstream>
+#include <unordered_map>
+#include <vector>
 
 class ConfigParser
 {
 public:
+	class Error : public std::runtime_error
+	{
+	public:
+		Error(const std::string& what) : std::runtime_error(what) {}
+	};
+
 	ConfigParser(const std::string& filename);
-	~ConfigParser();
+	// parse from a stream, name is returned by getFilename()
+	ConfigParser(std::istream& stream, const std::string& name = "");
+	static ConfigParser fromString(const std::string& text, const std::string& name = "");
+
 	// interface
 	bool isValid() const;
 	const std::string& getFilename() const;
-	bool hasKey(const std::string& key);
-	std::string getStringKeyValue(const std::string& key);
-	int getIntKeyValue(const std::string& key);
-	float getFloatKeyValue(const std::string& key);
-	double getDoubleKeyValue(const std::string& key);
-	
+	bool hasKey(const std::string& key) const;
+	// all keys, sorted
+	std::vector<std::string> getKeys() const;
+	std::string getStringKeyValue(const std::string& key) const;
+	int getIntKeyValue(const std::string& key) const;
+	float getFloatKeyValue(const std::string& key) const;
+	double getDoubleKeyValue(const std::string& key) const;
+	// with a default for missing keys
+	std::string getStringKeyValueOr(const std::string& key, const std::string& defaultValue) const;
+	int getIntKeyValueOr(const std::string& key, int defaultValue) const;
+	float getFloatKeyValueOr(const std::string& key, float defaultValue) const;
+	double getDoubleKeyValueOr(const std::string& key, double defaultValue) const;
+
 	// static interface
 	static bool isFileValid(const std::string& filename);
 	static std::string getStringKeyValue(const std::string& filename, const std::string& key);
@@ -33,9 +61,13 @@ public:
 	static float getFloatKeyValue(const std::string& filename, const std::string& key);
 	static double getDoubleKeyValue(const std::string& filename, const std::string& key);
 private:
+	void parse(std::istream& stream);
+	template<typename T>
+	T convert(const std::string& key, const std::string& value, const char* type) const;
+
 	bool valid; // true if file is valid
-	std::ifstream configFile; // represents the config file
 	std::string filename;
+	std::unordered_map<std::string, std::string> values; // KEY -> VALUE
 };
 
 #endif // ConfigParser_h
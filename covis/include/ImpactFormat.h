@@ -0,0 +1,52 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+// This file describes the binary impact log written by cosim with
+// IMPACT_LOG=1 (impacts.bin). A file consists of a fixed size header followed
+// by one fixed size Record per impact of a re-colliding particle, in the order
+// the impacts were collected (output by output, not sorted by time), the
+// number of records follows from the file size.
+//
+// All values are stored in the byte order of the writing machine, readers
+// check it with byte_order (BYTE_ORDER_MARK).
+
+#ifndef ImpactFormat_h
+#define ImpactFormat_h
+
+#include <cstdint>
+
+namespace impact {
+
+const char MAGIC[8] = { 'C', 'O', 'S', 'I', 'M', 'I', 'M', 'P' };
+const uint32_t VERSION = 1;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size; // offset of the first record
+	uint32_t record_size;
+	double delta_t;       // DELTA_T in s
+	char padding[32];
+};
+
+static_assert(sizeof(Header) == 64, "impact header layout changed");
+
+struct Record
+{
+	int64_t particle;     // index of the particle, line in the snapshots
+	int32_t face;         // hit face (COLLISION_TEST=bvh), -1 otherwise or for a particle retired with a non-finite field
+	int32_t step;         // during which the particle hit
+	double time;          // of the impact in s, interpolated within the step with COLLISION_TEST=bvh
+	double position[3];   // impact point
+	double velocity[3];   // at the impact, in the rotating frame of the comet
+};
+
+static_assert(sizeof(Record) == 72, "impact record layout changed");
+
+} // namespace impact
+
+#endif // ImpactFormat_h
@@ -0,0 +1,61 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+// This file describes the binary snapshot format written by cosim with
+// OUTPUT_FORMAT=binary (p%06d.bin). A file consists of a fixed size header
+// followed by contiguous columns of particle_count values each, in the order
+// of the Column enum, only columns of the fields present are stored:
+//
+// position: x[], y[], z[]      (precision bytes per value)
+// velocity: vx[], vy[], vz[]   (precision bytes per value)
+// flags:    flag[]             (1 byte per value, 1: re-collided with the body, 2: escaped)
+//
+// All values are stored in the byte order of the writing machine, readers
+// check it with byte_order (BYTE_ORDER_MARK).
+
+#ifndef SnapshotFormat_h
+#define SnapshotFormat_h
+
+#include <cstdint>
+
+namespace snapshot {
+
+const char MAGIC[8] = { 'C', 'O', 'S', 'I', 'M', 'S', 'N', 'P' };
+const uint32_t VERSION = 1;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// field bits
+enum Field : uint32_t {
+	FIELD_POSITION = 1,
+	FIELD_VELOCITY = 2,
+	FIELD_FLAGS = 4
+};
+
+enum Column {
+	POS_X, POS_Y, POS_Z,
+	VEL_X, VEL_Y, VEL_Z,
+	FLAG,
+	COLUMN_COUNT
+};
+
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size; // offset of the first column
+	uint32_t fields;      // Field bits
+	uint32_t precision;   // bytes per position/velocity value: 4 (float) or 8 (double)
+	uint32_t reserved;
+	int64_t step;
+	double time;          // step * DELTA_T in s
+	int64_t particle_count;
+	char padding[8];
+};
+
+static_assert(sizeof(Header) == 64, "snapshot header layout changed");
+
+} // namespace snapshot
+
+#endif // SnapshotFormat_h
@@ -0,0 +1,58 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+// This file provides a class for reading binary snapshot files (see
+// SnapshotFormat.h). The file is memory mapped, the columns are accessed
+// in place without copying.
+
+#ifndef SnapshotReader_h
+#define SnapshotReader_h
+
+#include <cstddef>
+#include <string>
+
+#include "SnapshotFormat.h"
+
+class SnapshotReader
+{
+public:
+	SnapshotReader(const std::string& filename);
+	~SnapshotReader();
+	SnapshotReader(const SnapshotReader&) = delete;
+	SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+	// interface
+	bool isValid() const;
+	const std::string& getFilename() const;
+	const snapshot::Header& getHeader() const;
+	int64_t getStep() const;
+	double getTime() const;
+	int64_t getParticleCount() const;
+	bool hasField(snapshot::Field field) const;
+
+	// raw column data, nullptr if the field is not stored
+	const void* getColumn(snapshot::Column column) const;
+	// typed column data, nullptr if the field is not stored or T does not match the precision
+	template<typename T>
+	const T* getColumn(snapshot::Column column) const
+	{
+		if (!valid || (column != snapshot::FLAG && sizeof(T) != header->precision))
+			return nullptr;
+		return static_cast<const T*>(getColumn(column));
+	}
+	const uint8_t* getFlags() const { return static_cast<const uint8_t*>(getColumn(snapshot::FLAG)); }
+
+	// position or velocity value as double, independent of the precision
+	double getValue(snapshot::Column column, int64_t i) const;
+
+private:
+	bool valid; // true if file is mapped and the header is valid
+	std::string filename;
+	void* data; // mapped file
+	size_t size;
+	const snapshot::Header* header;
+	size_t offsets[snapshot::COLUMN_COUNT]; // 0: column not present
+};
+
+#endif // SnapshotReader_h
@@ -3,170 +3,157 @@
 // See accompanying file LICENSE and README for further information.
 
 #include "ConfigParser.h"
-#include <iostream>
+#include <algorithm>
+#include <fstream>
 #include <sstream>
 
-ConfigParser::ConfigParser(const std::string& filename) : valid(true), configFile(filename.c_str()), filename(filename)
+namespace {
+
+const char* whitespace = " \t\r\n";
+
+std::string trim(const std::string& s)
 {
-	if (!configFile.is_open())
-	{
-		valid = false;
-		// debug output
-		std::cout << "ConfigParser::ConfigParser(const std::string& filename): Warning: File: " << filename << " not found." << std::endl;
-	}
+	size_t first = s.find_first_not_of(whitespace);
+	if (first == std::string::npos)
+		return "";
+	size_t last = s.find_last_not_of(whitespace);
+	return s.substr(first, last - first + 1);
 }
 
-ConfigParser::~ConfigParser()
+} // namespace
+
+ConfigParser::ConfigParser(const std::string& filename) : valid(false), filename(filename)
 {
+	std::ifstream configFile(filename.c_str());
 	if (configFile.is_open())
-		configFile.close(); 
+	{
+		valid = true;
+		parse(configFile);
+	}
 }
 
-const std::string& ConfigParser::getFilename() const
+ConfigParser::ConfigParser(std::istream& stream, const std::string& name) : valid(true), filename(name)
 {
-	return filename;
+	parse(stream);
 }
 
-bool ConfigParser::isValid() const
+ConfigParser ConfigParser::fromString(const std::string& text, const std::string& name)
 {
-	return valid;
+	std::istringstream stream(text);
+	return ConfigParser(stream, name);
 }
 
-bool ConfigParser::hasKey(const std::string& key)
+void ConfigParser::parse(std::istream& stream)
 {
-  	bool found = false;
-	if (configFile.is_open())
+	std::string line;
+	while (getline(stream, line))
 	{
-		configFile.clear();
-		configFile.seekg(0, std::ios_base::beg);
-		std::string beg = key + '=';
-		std::string line;
-		while (!configFile.eof())
+		// strip comments: '#' at the beginning of a line or after whitespace
+		for (size_t pos = line.find('#'); pos != std::string::npos; pos = line.find('#', pos + 1))
 		{
-			getline(configFile, line);
-			if (beg.compare(line.substr(0, beg.length())) == 0) // line begins with key + "="
+			if (pos == 0 || line[pos-1] == ' ' || line[pos-1] == '\t')
 			{
-				found = true;
+				line.erase(pos);
 				break;
 			}
 		}
+
+		size_t eq = line.find('=');
+		if (eq == std::string::npos)
+			continue;
+		std::string key = trim(line.substr(0, eq));
+		if (key.empty())
+			continue;
+		values.emplace(key, trim(line.substr(eq + 1))); // NOTE: keeps the first value of a key
 	}
-	else
-	{
-		std::cout << "ConfigParser::hasKey(const std::string& key): Error: No Config-File." << std::endl;
-	}
-	return found;
 }
 
-std::string ConfigParser::getStringKeyValue(const std::string& key)
+const std::string& ConfigParser::getFilename() const
 {
-  	std::string keyValue = "";
-  	bool found = false;
-	if (configFile.is_open())
-	{
-		configFile.clear();
-		configFile.seekg(0, std::ios_base::beg);
-		std::string beg = key + '='; 
-		std::string line;
-		while (!configFile.eof())
-		{
-			getline(configFile, line);
-			// debug output
-			// std::cout << line << std::endl;
-			if (beg.compare(line.substr(0, beg.length())) == 0) // line begins with key + "="
-			{
-				keyValue = line.substr(beg.length());
-				// debug output
-				std::cout << "ConfigParser::getStringKeyValue(const std::string& key): Information: Found " << key << keyValue << std::endl;
-				found = true;
-				break;
-			}
-			
-		}
-		// delete carriage return
-		//if(keyValue.at(keyValue.length() - 1) == '\n')
-		//	keyValue = keyValue.substr(0, keyValue.length() - 1);
-		if (found)
-		{
-			if (keyValue.at(keyValue.length() - 1) == '\r')
-				keyValue = keyValue.substr(0, keyValue.length() - 1);
-		}
-		else
-		{
-			std::cout << "ConfigParser::getStringKeyValue(const std::string& key): Information: Key not found " << key << keyValue << std::endl;
-			exit(1);
-		}
+	return filename;
+}
 
+bool ConfigParser::isValid() const
+{
+	return valid;
+}
 
-	}
-	else
-	{
-		std::cout << "ConfigParser::getStringKeyValue(const std::string& key): Error: No Config-File." << std::endl;
-	}
+bool ConfigParser::hasKey(const std::string& key) const
+{
+	return values.count(key) > 0;
+}
 
-	return keyValue;
+std::vector<std::string> ConfigParser::getKeys() const
+{
+	std::vector<std::string> keys;
+	for (const auto& value : values)
+		keys.push_back(value.first);
+	std::sort(keys.begin(), keys.end());
+	return keys;
 }
 
-int ConfigParser::getIntKeyValue(const std::string& key)
+std::string ConfigParser::getStringKeyValue(const std::string& key) const
 {
-  	int keyValue = 0;
-	
-	std::string temp = getStringKeyValue(key);
-	// convert string to int, then return result
-	std::istringstream ss(temp);
-	ss >> keyValue;
-	if (ss.fail())
-	{
-		// debug output: error
-		std::cout << "ConfigParser::getIntKeyValue(const std::string& key): Error: Converting string value to int failed." << keyValue << std::endl;
-		keyValue = 0;
-	}
+	auto it = values.find(key);
+	if (it == values.end())
+		throw Error("ConfigParser: key " + key + " not found in '" + filename + "'");
+	return it->second;
+}
 
+template<typename T>
+T ConfigParser::convert(const std::string& key, const std::string& value, const char* type) const
+{
+	T keyValue = T();
+	// convert string to T, the whole value has to be consumed
+	std::istringstream ss(value);
+	ss >> keyValue;
+	if (ss.fail() || !(ss >> std::ws).eof())
+		throw Error("ConfigParser: converting value '" + value + "' of key " + key + " to " + type + " failed");
 	return keyValue;
 }
 
-float ConfigParser::getFloatKeyValue(const std::string& key)
+int ConfigParser::getIntKeyValue(const std::string& key) const
 {
-  	float keyValue = 0.0f;
-	
-	std::string temp = getStringKeyValue(key);
-	// convert string to float, then return result
-	std::istringstream ss(temp);
-	ss >> keyValue;
-	if (ss.fail())
-	{
-		// debug output: error
-		std::cout << "ConfigParser::getFloatKeyValue(const std::string& key): Error: Converting string value to float failed." << keyValue << std::endl;
-		keyValue = 0.0f;
-	}
+	return convert<int>(key, getStringKeyValue(key), "int");
+}
 
-	return keyValue;
+float ConfigParser::getFloatKeyValue(const std::string& key) const
+{
+	return convert<float>(key, getStringKeyValue(key), "float");
 }
 
-double ConfigParser::getDoubleKeyValue(const std::string& key)
+double ConfigParser::getDoubleKeyValue(const std::string& key) const
 {
-  	double keyValue = 0.0;
-	
-	std::string temp = getStringKeyValue(key);
-	// convert string to double, then return result
-	std::istringstream ss(temp);
-	ss >> keyValue;
-	if (ss.fail())
-	{
-		// debug output: error
-		std::cout << "ConfigParser::getDoubleKeyValue(const std::string& key): Error: Converting string value to double failed." << keyValue << std::endl;
-		keyValue = 0.0;
-	}
+	return convert<double>(key, getStringKeyValue(key), "double");
+}
 
-	return keyValue;
+std::string ConfigParser::getStringKeyValueOr(const std::string& key, const std::string& defaultValue) const
+{
+	return hasKey(key) ? getStringKeyValue(key) : defaultValue;
+}
+
+int ConfigParser::getIntKeyValueOr(const std::string& key, int defaultValue) const
+{
+	return hasKey(key) ? getIntKeyValue(key) : defaultValue;
+}
+
+float ConfigParser::getFloatKeyValueOr(const std::string& key, float defaultValue) const
+{
+	return hasKey(key) ? getFloatKeyValue(key) : defaultValue;
+}
+
+double ConfigParser::getDoubleKeyValueOr(const std::string& key, double defaultValue) const
+{
+	return hasKey(key) ? getDoubleKeyValue(key) : defaultValue;
 }
 
 // static interface
 
 bool ConfigParser::isFileValid(const std::string& filename)
 {
-	ConfigParser parser(filename);
-	return parser.isValid();
+	// NOTE: only checks if the file can be opened, it is not parsed
+	std::ifstream file(filename.c_str());
+	return file.is_open();
 }
 
 std::string ConfigParser::getStringKeyValue(const std::string& filename, const std::string& key)
@@ -0,0 +1,127 @@
+// Copyright (c) 2015 Matthias Noack <ma.noack.pr@gmail.com>
+//
+// See accompanying file LICENSE and README for further information.
+
+#include "SnapshotReader.h"
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>    // open()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <unistd.h>   // close()
+
+SnapshotReader::SnapshotReader(const std::string& filename) : valid(false), filename(filename), data(nullptr), size(0), header(nullptr)
+{
+	std::memset(offsets, 0, sizeof(offsets));
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		std::cout << "SnapshotReader::SnapshotReader(const std::string& filename): Warning: File: " << filename << " not found." << std::endl;
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(snapshot::Header)))
+	{
+		size = st.st_size;
+		data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+			data = nullptr;
+	}
+	close(fd); // the mapping stays valid
+	if (!data)
+	{
+		std::cout << "SnapshotReader::SnapshotReader(const std::string& filename): Error: Mapping " << filename << " failed." << std::endl;
+		return;
+	}
+
+	header = static_cast<const snapshot::Header*>(data);
+	if (std::memcmp(header->magic, snapshot::MAGIC, sizeof(snapshot::MAGIC)) != 0 || header->version != snapshot::VERSION)
+	{
+		std::cout << "SnapshotReader::SnapshotReader(const std::string& filename): Error: " << filename << " is not a snapshot file of version " << snapshot::VERSION << "." << std::endl;
+		return;
+	}
+	if (header->byte_order != snapshot::BYTE_ORDER_MARK)
+	{
+		std::cout << "SnapshotReader::SnapshotReader(const std::string& filename): Error: " << filename << " was written with a different byte order." << std::endl;
+		return;
+	}
+	if (header->precision != sizeof(float) && header->precision != sizeof(double))
+	{
+		std::cout << "SnapshotReader::SnapshotReader(const std::string& filename): Error: Unsupported precision " << header->precision << "." << std::endl;
+		return;
+	}
+
+	// column offsets
+	const size_t n = static_cast<size_t>(header->particle_count);
+	size_t offset = header->header_size;
+	for (int c = snapshot::POS_X; c < snapshot::COLUMN_COUNT; ++c)
+	{
+		snapshot::Field field = (c <= snapshot::POS_Z) ? snapshot::FIELD_POSITION : ((c <= snapshot::VEL_Z) ? snapshot::FIELD_VELOCITY : snapshot::FIELD_FLAGS);
+		if (!(header->fields & field))
+			continue;
+		offsets[c] = offset;
+		offset += n * ((c == snapshot::FLAG) ? 1 : header->precision);
+	}
+	if (offset > size)
+	{
+		std::cout << "SnapshotReader::SnapshotReader(const std::string& filename): Error: " << filename << " is truncated." << std::endl;
+		return;
+	}
+	valid = true;
+}
+
+SnapshotReader::~SnapshotReader()
+{
+	if (data)
+		munmap(data, size);
+}
+
+bool SnapshotReader::isValid() const
+{
+	return valid;
+}
+
+const std::string& SnapshotReader::getFilename() const
+{
+	return filename;
+}
+
+const snapshot::Header& SnapshotReader::getHeader() const
+{
+	return *header;
+}
+
+int64_t SnapshotReader::getStep() const
+{
+	return valid ? header->step : 0;
+}
+
+double SnapshotReader::getTime() const
+{
+	return valid ? header->time : 0.0;
+}
+
+int64_t SnapshotReader::getParticleCount() const
+{
+	return valid ? header->particle_count : 0;
+}
+
+bool SnapshotReader::hasField(snapshot::Field field) const
+{
+	return valid && (header->fields & field);
+}
+
+const void* SnapshotReader::getColumn(snapshot::Column column) const
+{
+	if (!valid || offsets[column] == 0)
+		return nullptr;
+	return static_cast<const char*>(data) + offsets[column];
+}
+
+double SnapshotReader::getValue(snapshot::Column column, int64_t i) const
+{
+	if (header->precision == sizeof(float))
+		return getColumn<float>(column)[i];
+	return getColumn<double>(column)[i];
+}
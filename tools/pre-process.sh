@@ -4,8 +4,9 @@
 # See accompanying file LICENSE and README for further information.
 
 # replace the fourth column of each data file with a sequence as particle id 
-# filter inactive particles (last column is 1.0)
+# filter inactive particles (last column is 1.0: re-collided, 2.0: escaped)
 # append everything into a single file
+# (the impact sites of the re-collided particles are in impacts.bin with IMPACT_LOG=1)
 
 DATA_PATH=$1
 
@@ -27,7 +28,7 @@ do
 #	echo "Lines: $LINES"
 	cut -d ' ' -f1-4 --complement ${file} | paste -d ' ' ${file}.tmp2 - > ${file}.tmp1 # paste the remaining columns
 	# filter inactive
-	grep -v "1.000000$" ${file}.tmp1 > ${file}.tmp2 # grep lines not (-v) ending ($) with 1.00000 
+	grep -v -E "(1|2)\.000000$" ${file}.tmp1 > ${file}.tmp2 # grep lines not (-v) ending ($) with 1.00000 or 2.00000
 	cat ${file}.tmp2 >> ${RESULT_FILE}.tmp
 	rm ${file}.tmp1 ${file}.tmp2
 done
@@ -40,6 +41,6 @@ echo "$RESULT_ENTRIES" > ${RESULT_FILE}
 cat ${RESULT_FILE}.tmp2 >> ${RESULT_FILE}
 rm -f ${RESULT_FILE}.tmp ${RESULT_FILE}.tmp2
 echo "Result entries: $RESULT_ENTRIES"
-echo "Filtered entries: $(grep "1.000000$" $FILES | wc -l)"
+echo "Filtered entries: $(grep -E "(1|2)\.000000$" $FILES | wc -l)"
 
 cd ..